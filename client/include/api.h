@@ -1,6 +1,8 @@
 #ifndef API_H
 #define API_H
 
+#include <stddef.h>
+
 typedef struct {
   int width;
   int height;
@@ -8,16 +10,92 @@ typedef struct {
   int victory;
   int game_over;
   int accumulated_points;
+  int tick;                 // server tick this frame was taken at
+  long long server_time_us; // server CLOCK_MONOTONIC time of that tick, in microseconds
+  int input_seq;            // sequence number of the last command the server applied, 0 if none
+  long long input_apply_us; // server CLOCK_MONOTONIC time that command was applied
+  int board_width;          // size of the whole board, data only holds width x height of it
+  int board_height;
+  int view_x, view_y;       // where data starts on the whole board, 0 for whole frames
   char* data;
+  size_t capacity; // bytes allocated for data, reused between frames
 } Board;
 
-int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path);
+/// Connection to one game. Every call below works on its own session, so a single
+/// process can drive as many games as it has file descriptors for.
+typedef struct Session pacman_session_t;
+
+/// Called by pacman_poll for every frame decoded. board is owned by the session and is
+/// reused for its next frame; it is NULL when the server closed the session's pipe.
+typedef void (*pacman_frame_cb)(pacman_session_t *session, Board *board, void *arg);
+
+/// @return a new unconnected session, or NULL if it could not be allocated.
+pacman_session_t *pacman_session_new(void);
+
+/// Frees a session, disconnecting it first if needed.
+void pacman_session_free(pacman_session_t *session);
+
+/// @return the session's notification pipe, to plug it into a caller-owned event loop.
+int pacman_session_fd(pacman_session_t *session);
+
+/// Makes receive_board_update_into wait up to timeout_ms for a server that went away to come
+/// back, restarted on the session store it left (PACMAN_SESSION_STORE), and go on with the same
+/// session instead of reporting the end of the pipe; 0, the default, does not wait.
+/// pacman_poll does not wait, it reports the pipe closed right away.
+void pacman_set_reconnect(pacman_session_t *session, int timeout_ms);
+
+/// Attaches caller data to a session, so pacman_poll callbacks can find their own state.
+void pacman_session_set_user(pacman_session_t *session, void *user);
+void *pacman_session_user(pacman_session_t *session);
+
+int pacman_connect(pacman_session_t *session, char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path);
 
-void pacman_play(char command);
+/// Like pacman_connect, but the game's random moves are drawn from seed, so the same seed and inputs play the same game.
+int pacman_connect_seeded(pacman_session_t *session, char const *req_pipe_path, char const *notif_pipe_path,
+                          char const *server_pipe_path, unsigned long long seed);
+
+/// Joins a running game with a pacman of its own on the same board as the game's other players.
+/// Frames show this player's pacman as 'C' and the others as 'c', with this player's points.
+/// @return 0 on success, non-zero if the game does not exist, has no session or is full.
+int pacman_join(pacman_session_t *session, char const *req_pipe_path, char const *notif_pipe_path,
+                char const *server_pipe_path, int game_id);
+
+/// Attaches to a running game as a read-only spectator, frames arrive through receive_board_update.
+/// @return 0 on success, non-zero if the game does not exist or is not accepting spectators.
+int pacman_spectate(pacman_session_t *session, char const *notif_pipe_path, char const *server_pipe_path, int game_id);
+
+/// Declares the window of the board the client draws, width x height cells. The server then
+/// only sends that window around the player's pacman, as the cells that changed or scrolled in,
+/// and frames hold the window with view_x/view_y telling where it is on the board.
+/// Without it, boards too big to be sent whole come as a window of the server's default size.
+/// @return 0 on success, -1 if it could not be sent.
+int pacman_set_viewport(pacman_session_t *session, int width, int height);
+
+/// Sends a command tagged with the next sequence number and the current time.
+/// @return the sequence number, which frames echo back once the server applied it.
+int pacman_play(pacman_session_t *session, char command);
+
+/// @return when command seq was sent (CLOCK_MONOTONIC microseconds), or -1 if it is too old to be known.
+long long pacman_input_sent_us(pacman_session_t *session, int seq);
 
 /// @return 0 if the disconnection was successful, 1 otherwise.
-int pacman_disconnect();
+int pacman_disconnect(pacman_session_t *session);
+
+Board receive_board_update(pacman_session_t *session);
+
+/// Reads the next frame into a caller-owned board, reusing board->data when it is big enough.
+/// Blocks until a whole frame has arrived.
+/// @return 0 on success, -1 if the pipe was closed or the frame could not be read.
+int receive_board_update_into(pacman_session_t *session, Board *board);
+
+/// Frees the buffer owned by a board filled with receive_board_update_into.
+void board_release(Board *board);
 
-Board receive_board_update(void);
+/// Waits up to timeout_ms (-1 for ever) for any of the sessions' notification pipes, reads what
+/// is available without blocking and calls on_frame for every complete frame.
+/// Sessions whose pipe was closed are reported once with a NULL board and then skipped; it never
+/// reconnects, whatever pacman_set_reconnect was given.
+/// @return the number of frames delivered, or -1 on error.
+int pacman_poll(pacman_session_t **sessions, int n_sessions, int timeout_ms, pacman_frame_cb on_frame, void *arg);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,14 +1,12 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
-// DEBUG FILE
-
-void open_debug_file(char *filename);
-
-void close_debug_file();
-
-void debug(const char * format, ...);
+// DEBUG FILE, see log.h
+#include "log.h"
 
 void sleep_ms(int milliseconds);
 
+/*CLOCK_MONOTONIC time in microseconds, the same clock the server stamps frames with*/
+long long now_us(void);
+
 #endif
\ No newline at end of file
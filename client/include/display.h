@@ -17,6 +17,9 @@ Potential Structures for ncurses
 /*Initialize everything ncurses requires*/
 int terminal_init();
 
+/*How many cells of the board fit on the terminal between the header and the points*/
+void terminal_view_size(int *width, int *height);
+
 void draw_board_client(Board board);
 
 char* get_board_displayed(board_t* board);
@@ -39,6 +42,9 @@ void draw(char c, int colour_i, int pos_x, int pos_y);
 /*Call ncurses refresh() to update the screen*/
 void refresh_screen();
 
+// What get_input returns when the terminal was resized, not a command
+#define INPUT_RESIZE 'R'
+
 /*Ncurses will be reading the player's inputs*/
 char get_input();
 
@@ -0,0 +1,44 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "api.h"
+
+// Log-linear buckets: values below LATENCY_SUB_BUCKETS get one bucket each, every
+// power of two above is split in LATENCY_SUB_BUCKETS, so the error stays under 12.5%
+#define LATENCY_SUB_BUCKETS 8
+#define LATENCY_BUCKETS (40 * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long n;
+    long long sum_us;
+    long long min_us, max_us;
+} latency_histogram_t;
+
+/*
+Input latency of one session, split where the clocks are sampled:
+the client sending a command, the server applying it and the client drawing the first frame
+that shows it. Client and server share CLOCK_MONOTONIC, so the three can be compared.
+*/
+typedef struct {
+    latency_histogram_t send_to_apply;
+    latency_histogram_t apply_to_render;
+    latency_histogram_t send_to_render;
+    int last_seq;   // last command measured, each one is counted on its first frame only
+} latency_tracker_t;
+
+void latency_init(latency_tracker_t *tracker);
+
+void latency_record(latency_histogram_t *hist, long long value_us);
+
+/*@return the smallest value at or above fraction p (0..1] of the samples, 0 if there are none*/
+long long latency_percentile(const latency_histogram_t *hist, double p);
+
+/*Measures the command frame echoes, if it was not measured yet, as drawn at render_us*/
+void latency_record_frame(latency_tracker_t *tracker, pacman_session_t *session, const Board *frame, long long render_us);
+
+/*Writes a summary and the non-empty buckets of each histogram to path
+@return 0 on success, -1 if the file could not be written*/
+int latency_dump(const latency_tracker_t *tracker, const char *path);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include "api.h"
+#include <pthread.h>
+
+// Minimum time between two renders, roughly one display refresh
+#define RENDER_INTERVAL_MS 16
+
+/*
+Latest-frame slot shared by the receiver and the render thread.
+Three Boards rotate between them: the receiver decodes into "back", publishing swaps it
+with "latest", and the renderer swaps "latest" with "front" before drawing.
+The receiver never waits for the renderer, frames it did not get to draw are just replaced.
+*/
+typedef struct {
+    Board slots[3];
+    int back, latest, front;   // index of the slot each side currently owns
+    int fresh;                 // latest holds a frame the renderer has not taken yet
+    int closed;                // the receiver will not publish anything else
+    int tick;                  // server tick of the last published frame, -1 before the first
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} frame_mailbox_t;
+
+void mailbox_init(frame_mailbox_t *mailbox);
+
+/*Frees the three frame buffers*/
+void mailbox_destroy(frame_mailbox_t *mailbox);
+
+/*Board the receiver should decode the next frame into, only the receiver touches it*/
+Board *mailbox_back(frame_mailbox_t *mailbox);
+
+/*Makes the back board the latest frame and wakes the renderer*/
+void mailbox_publish(frame_mailbox_t *mailbox);
+
+/*Tells the renderer no more frames will come*/
+void mailbox_close(frame_mailbox_t *mailbox);
+
+/*Waits for a frame newer than the last one taken and returns it,
+NULL once the mailbox is closed and every frame was taken*/
+Board *mailbox_take(frame_mailbox_t *mailbox);
+
+/*Whether a frame newer than the last one taken is waiting*/
+int mailbox_pending(frame_mailbox_t *mailbox);
+
+/*Waits until a frame with a server tick after after_tick is published and returns its tick,
+-1 once the mailbox is closed. Input is paced on this so one command goes out per server tick*/
+int mailbox_wait_tick(frame_mailbox_t *mailbox, int after_tick);
+
+#endif
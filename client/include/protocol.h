@@ -8,6 +8,11 @@ enum {
   OP_CODE_DISCONNECT = 2,
   OP_CODE_PLAY = 3,
   OP_CODE_BOARD = 4,
+  OP_CODE_SPECTATE = 5,
+  OP_CODE_CONNECT_SEEDED = 6,
+  OP_CODE_JOIN = 7,
+  OP_CODE_VIEWPORT = 8,
+  OP_CODE_VIEW = 9,
 };
 
 #endif
\ No newline at end of file
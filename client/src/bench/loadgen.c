@@ -0,0 +1,495 @@
+#include "api.h"
+#include "protocol.h"
+#include "debug.h"
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+Load generator: starts a server on a level directory and ramps up synthetic clients in steps,
+reporting per step how fast connections are accepted, how steadily frames arrive and what the
+server costs, until the frame rate falls behind the level tempo.
+
+Usage: loadgen -l <level_dir> [-s server] [-n max_clients] [-r step] [-t seconds] [-i random|file] [-S seed]
+*/
+
+#define DEFAULT_SERVER "../server/bin/Pacmanist"
+#define RANDOM_COMMANDS "WASD"
+#define POLL_MS 10
+
+// A step is saturated once sessions get less than this fraction of the tempo's frame rate,
+// or frames arrive later than half a tick at the 99th percentile
+#define SATURATION_FPS_RATIO 0.9
+#define SATURATION_JITTER_TICKS 0.5
+
+typedef enum {
+    CLIENT_PLAYING,
+    CLIENT_ENDED,           // the server finished or closed the game
+    CLIENT_CONNECTING,      // a reconnect thread owns the session
+    CLIENT_CONNECTED,       // the reconnect thread is done, result in connect_result
+} client_state_t;
+
+typedef struct {
+    pacman_session_t *session;
+    int index;
+    int generation;         // connections so far, every one gets pipes of its own
+    char req_path[MAX_PIPE_PATH_LENGTH];
+    char notif_path[MAX_PIPE_PATH_LENGTH];
+    client_state_t state;   // read and written with atomics once a reconnect thread runs
+    pthread_t reconnect_thread;
+    const char *register_pipe;
+    int connect_result;
+    long long connect_us;
+    int frames;             // frames received during the current step
+    long long last_frame_us;
+    int last_tick;
+    int tempo_ms;
+    size_t script_pos;
+    unsigned int seed;
+} load_client_t;
+
+typedef struct {
+    const char *server;
+    const char *level_dir;
+    int max_clients;
+    int step;
+    int step_seconds;
+    const char *input;      // NULL for random input
+    unsigned int seed;
+} loadgen_options_t;
+
+// Shared by the step being measured
+static latency_histogram_t connect_hist;
+static latency_histogram_t jitter_hist;
+static char *script = NULL;
+static size_t script_len = 0;
+static int games_finished = 0;
+static int measuring = 0;       // off while draining the frames that piled up between steps
+
+// Helper private function that returns the CPU time of a process in microseconds, -1 if unknown
+static long long process_cpu_us(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char buffer[1024];
+    size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+    fclose(fp);
+    buffer[len] = '\0';
+    // The command name may contain spaces, fields are counted from its closing parenthesis
+    char *p = strrchr(buffer, ')');
+    unsigned long long utime, stime;
+    if (p == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (long long)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+// Helper private function that returns the resident set of a process in KB, -1 if unknown
+static long process_rss_kb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char line[256];
+    long rss = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return rss;
+}
+
+// Helper private function that loads a command file, keeping only the commands
+static int load_script(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    size_t capacity = 256;
+    script = malloc(capacity);
+    int ch;
+    while (script != NULL && (ch = fgetc(fp)) != EOF) {
+        if (ch == '\n' || ch == '\r' || ch == '\0') {
+            continue;
+        }
+        if (script_len == capacity) {
+            capacity *= 2;
+            char *grown = realloc(script, capacity);
+            if (grown == NULL) {
+                free(script);
+                script = NULL;
+                break;
+            }
+            script = grown;
+        }
+        script[script_len++] = (char)toupper(ch);
+    }
+    fclose(fp);
+    return script != NULL && script_len > 0 ? 0 : -1;
+}
+
+// Helper private function that picks the next command of a client
+static char next_command(load_client_t *client) {
+    if (script != NULL) {
+        char command = script[client->script_pos];
+        client->script_pos = (client->script_pos + 1) % script_len;
+        return command;
+    }
+    return RANDOM_COMMANDS[rand_r(&client->seed) % (sizeof(RANDOM_COMMANDS) - 1)];
+}
+
+static void unlink_pipes(load_client_t *client) {
+    unlink(client->req_path);
+    unlink(client->notif_path);
+}
+
+// Helper private function that connects a client and records how long the server took.
+// The server may still hold the pipes of the previous game for a moment, which would then
+// answer this connection with its last frames, so every connection uses new paths
+static int connect_client(load_client_t *client) {
+    snprintf(client->req_path, sizeof(client->req_path), "/tmp/lg%d_%d_%d_request",
+             (int)getpid(), client->index, client->generation);
+    snprintf(client->notif_path, sizeof(client->notif_path), "/tmp/lg%d_%d_%d_notification",
+             (int)getpid(), client->index, client->generation);
+    client->generation++;
+    long long start = now_us();
+    if (pacman_connect(client->session, client->req_path, client->notif_path, client->register_pipe) != 0) {
+        return -1;
+    }
+    client->connect_us = now_us() - start;
+    client->last_frame_us = 0;
+    client->script_pos = 0;
+    return 0;
+}
+
+// A connection waits for a free worker, which takes about a tick once a game ended: done here
+// so the other sessions keep being read on time meanwhile
+static void *reconnect_thread(void *arg) {
+    load_client_t *client = arg;
+    client->connect_result = connect_client(client);
+    __atomic_store_n(&client->state, CLIENT_CONNECTED, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Called by pacman_poll for every frame: measures it and answers with the next command,
+// one per frame so every client plays at the server's pace
+static void on_frame(pacman_session_t *session, Board *board, void *arg) {
+    (void)arg;
+    load_client_t *client = pacman_session_user(session);
+    if (board == NULL) {
+        client->state = CLIENT_ENDED;
+        return;
+    }
+    long long now = now_us();
+    client->tempo_ms = board->tempo;
+    // Measured against the ticks the frames were taken at: ticks the server skipped already
+    // show in the frame rate, and ticks restart with every level
+    if (measuring && client->last_frame_us != 0 && board->tick > client->last_tick) {
+        long long expected = (long long)(board->tick - client->last_tick) * board->tempo * 1000;
+        long long jitter = now - client->last_frame_us - expected;
+        latency_record(&jitter_hist, jitter < 0 ? -jitter : jitter);
+    }
+    client->last_frame_us = now;
+    client->last_tick = board->tick;
+    client->frames++;
+    if (board->victory || board->game_over) {
+        client->state = CLIENT_ENDED;
+        games_finished++;
+        return;
+    }
+    pacman_play(session, next_command(client));
+}
+
+// Helper private function that makes path absolute, the server runs in another directory
+static int absolute_path(const char *path, char *out, size_t size) {
+    if (path[0] == '/') {
+        return snprintf(out, size, "%s", path) < (int)size ? 0 : -1;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+    return snprintf(out, size, "%s/%s", cwd, path) < (int)size ? 0 : -1;
+}
+
+// Helper private function that starts the server in its own working directory and waits for
+// its registration pipe
+static pid_t start_server(const loadgen_options_t *options, const char *register_pipe, char *workdir) {
+    char level_dir[PATH_MAX];
+    char server[PATH_MAX];
+    if (absolute_path(options->level_dir, level_dir, sizeof(level_dir)) != 0 ||
+        absolute_path(options->server, server, sizeof(server)) != 0) {
+        perror("loadgen: getcwd");
+        return -1;
+    }
+    if (mkdtemp(workdir) == NULL) {
+        perror("loadgen: mkdtemp");
+        return -1;
+    }
+    char max_games[16];
+    snprintf(max_games, sizeof(max_games), "%d", options->max_clients);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("loadgen: fork");
+        return -1;
+    }
+    if (pid == 0) {
+        // The server writes its logs and score files to its working directory
+        if (chdir(workdir) != 0) {
+            _exit(127);
+        }
+        execl(server, server, level_dir, max_games, register_pipe, (char *)NULL);
+        _exit(127);
+    }
+
+    struct stat st;
+    for (int i = 0; i < 500; i++) {
+        if (stat(register_pipe, &st) == 0 && S_ISFIFO(st.st_mode)) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            break;
+        }
+        sleep_ms(10);
+    }
+    fprintf(stderr, "loadgen: server did not create %s\n", register_pipe);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGINT);
+    for (int i = 0; i < 200; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return;
+        }
+        sleep_ms(10);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s -l <level_dir> [-s server] [-n max_clients] [-r step] [-t seconds] [-i random|file] [-S seed]\n",
+        name);
+}
+
+int main(int argc, char *argv[]) {
+    loadgen_options_t options = {DEFAULT_SERVER, NULL, 64, 8, 5, NULL, 1};
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:n:r:t:i:S:")) != -1) {
+        switch (opt) {
+            case 's': options.server = optarg; break;
+            case 'l': options.level_dir = optarg; break;
+            case 'n': options.max_clients = atoi(optarg); break;
+            case 'r': options.step = atoi(optarg); break;
+            case 't': options.step_seconds = atoi(optarg); break;
+            case 'i': options.input = strcmp(optarg, "random") == 0 ? NULL : optarg; break;
+            case 'S': options.seed = (unsigned int)strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (options.level_dir == NULL || options.max_clients <= 0 || options.step <= 0 || options.step_seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.input != NULL && load_script(options.input) != 0) {
+        fprintf(stderr, "loadgen: cannot read commands from %s\n", options.input);
+        return 1;
+    }
+    // Games the server ends close their pipes, a late command must not kill the generator
+    signal(SIGPIPE, SIG_IGN);
+
+    char register_pipe[MAX_PIPE_PATH_LENGTH];
+    snprintf(register_pipe, sizeof(register_pipe), "/tmp/lg%d_register", (int)getpid());
+    char workdir[] = "/tmp/loadgen-XXXXXX";
+    pid_t server = start_server(&options, register_pipe, workdir);
+    if (server < 0) {
+        return 1;
+    }
+
+    load_client_t *clients = calloc(options.max_clients, sizeof(load_client_t));
+    pacman_session_t **playing = calloc(options.max_clients, sizeof(pacman_session_t *));
+    if (clients == NULL || playing == NULL) {
+        perror("loadgen: calloc");
+        stop_server(server);
+        return 1;
+    }
+
+    printf("server pid %d, working directory %s, %s input\n",
+           (int)server, workdir, options.input != NULL ? options.input : "random");
+    printf("%7s %9s %9s %8s %8s %9s %9s %7s %9s %6s\n",
+           "clients", "conn_p50", "conn_p99", "fps_avg", "fps_min",
+           "jit_p50", "jit_p99", "cpu%", "rss_kb", "games");
+
+    int n_clients = 0;
+    int saturated_at = 0;
+    int exit_code = 0;
+    while (n_clients < options.max_clients && saturated_at == 0) {
+        memset(&connect_hist, 0, sizeof(connect_hist));
+        memset(&jitter_hist, 0, sizeof(jitter_hist));
+        games_finished = 0;
+        int n_playing = 0;
+
+        int target = n_clients + options.step;
+        if (target > options.max_clients) target = options.max_clients;
+        for (; n_clients < target; n_clients++) {
+            load_client_t *client = &clients[n_clients];
+            client->session = pacman_session_new();
+            if (client->session == NULL) {
+                perror("loadgen: pacman_session_new");
+                exit_code = 1;
+                break;
+            }
+            pacman_session_set_user(client->session, client);
+            client->index = n_clients;
+            client->seed = options.seed + (unsigned int)n_clients;
+            client->register_pipe = register_pipe;
+            if (connect_client(client) != 0) {
+                fprintf(stderr, "loadgen: client %d could not connect\n", n_clients);
+                pacman_session_free(client->session);
+                unlink_pipes(client);
+                exit_code = 1;
+                break;
+            }
+            latency_record(&connect_hist, client->connect_us);
+        }
+        if (exit_code != 0) {
+            break;
+        }
+        // Frames piled up while the new clients connected, that gap is not the server's
+        measuring = 0;
+        for (int i = 0; i < n_clients; i++) {
+            if (clients[i].state == CLIENT_PLAYING) {
+                playing[n_playing++] = clients[i].session;
+            }
+        }
+        while (n_playing > 0 && pacman_poll(playing, n_playing, 0, on_frame, NULL) > 0) {
+        }
+        measuring = 1;
+        for (int i = 0; i < n_clients; i++) {
+            clients[i].frames = 0;
+            clients[i].last_frame_us = 0;
+        }
+
+        long long cpu_start = process_cpu_us(server);
+        long long start = now_us();
+        long long deadline = start + (long long)options.step_seconds * 1000000;
+        while (now_us() < deadline && exit_code == 0) {
+            n_playing = 0;
+            for (int i = 0; i < n_clients; i++) {
+                if (__atomic_load_n(&clients[i].state, __ATOMIC_ACQUIRE) == CLIENT_PLAYING) {
+                    playing[n_playing++] = clients[i].session;
+                }
+            }
+            if (n_playing == 0) {
+                sleep_ms(POLL_MS);
+            } else if (pacman_poll(playing, n_playing, POLL_MS, on_frame, NULL) < 0) {
+                perror("loadgen: pacman_poll");
+                exit_code = 1;
+                break;
+            }
+            // Finished games start over, so the load stays constant for the whole step
+            for (int i = 0; i < n_clients; i++) {
+                load_client_t *client = &clients[i];
+                client_state_t state = __atomic_load_n(&client->state, __ATOMIC_ACQUIRE);
+                if (state == CLIENT_ENDED) {
+                    pacman_disconnect(client->session);
+                    unlink_pipes(client);
+                    client->state = CLIENT_CONNECTING;
+                    if (pthread_create(&client->reconnect_thread, NULL, reconnect_thread, client) != 0) {
+                        perror("loadgen: pthread_create");
+                        client->state = CLIENT_ENDED;
+                        exit_code = 1;
+                        break;
+                    }
+                } else if (state == CLIENT_CONNECTED) {
+                    pthread_join(client->reconnect_thread, NULL);
+                    if (client->connect_result != 0) {
+                        fprintf(stderr, "loadgen: client %d could not reconnect\n", i);
+                        client->state = CLIENT_ENDED;
+                        exit_code = 1;
+                        break;
+                    }
+                    latency_record(&connect_hist, client->connect_us);
+                    client->state = CLIENT_PLAYING;
+                }
+            }
+        }
+        if (exit_code != 0) {
+            break;
+        }
+        double elapsed_s = (double)(now_us() - start) / 1000000;
+        long long cpu_end = process_cpu_us(server);
+
+        double fps_sum = 0;
+        double fps_min = -1;
+        int tempo_ms = 0;
+        for (int i = 0; i < n_clients; i++) {
+            double fps = clients[i].frames / elapsed_s;
+            fps_sum += fps;
+            if (fps_min < 0 || fps < fps_min) fps_min = fps;
+            if (clients[i].tempo_ms > tempo_ms) tempo_ms = clients[i].tempo_ms;
+        }
+        double fps_avg = fps_sum / n_clients;
+        double cpu = cpu_start >= 0 && cpu_end >= 0 ? 100.0 * (double)(cpu_end - cpu_start) / (elapsed_s * 1000000) : -1;
+        long long jitter_p99 = latency_percentile(&jitter_hist, 0.99);
+
+        printf("%7d %9lld %9lld %8.1f %8.1f %9lld %9lld %7.1f %9ld %6d\n",
+               n_clients, latency_percentile(&connect_hist, 0.5), latency_percentile(&connect_hist, 0.99),
+               fps_avg, fps_min, latency_percentile(&jitter_hist, 0.5), jitter_p99,
+               cpu, process_rss_kb(server), games_finished);
+        fflush(stdout);
+
+        if (tempo_ms > 0 &&
+            (fps_avg < SATURATION_FPS_RATIO * 1000.0 / tempo_ms ||
+             jitter_p99 > (long long)(SATURATION_JITTER_TICKS * tempo_ms * 1000))) {
+            saturated_at = n_clients;
+        }
+    }
+
+    if (exit_code == 0) {
+        if (saturated_at > 0) {
+            printf("saturated at %d clients\n", saturated_at);
+        } else {
+            printf("not saturated up to %d clients\n", n_clients);
+        }
+    }
+
+    for (int i = 0; i < n_clients; i++) {
+        client_state_t state = __atomic_load_n(&clients[i].state, __ATOMIC_ACQUIRE);
+        if (state == CLIENT_CONNECTING || state == CLIENT_CONNECTED) {
+            pthread_join(clients[i].reconnect_thread, NULL);
+        }
+        pacman_session_free(clients[i].session);
+        unlink_pipes(&clients[i]);
+    }
+    stop_server(server);
+    unlink(register_pipe);
+    free(playing);
+    free(clients);
+    free(script);
+    return exit_code;
+}
@@ -9,139 +9,635 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
 
 
+// Header of an OP_CODE_BOARD frame: op code, seven ints, the server timestamp
+// and the last applied input (sequence number and apply time)
+#define FRAME_HEADER_SIZE (1 + 8 * sizeof(int) + 2 * sizeof(long long))
+// An OP_CODE_VIEW frame adds the origin and size of the window and the number of changes
+#define VIEW_HEADER_SIZE (FRAME_HEADER_SIZE + 5 * sizeof(int))
+// Bytes of one changed cell of a window: its index and its character
+#define VIEW_CHANGE_SIZE (sizeof(int) + 1)
+// How many sent commands are remembered to match the sequence numbers frames echo back
+#define INPUT_WINDOW 256
+// Minimum amount of free space offered to each read() on the notification pipe
+#define RX_CHUNK 4096
+// A restarted server is waited for in steps of this, so a disconnect does not wait for it
+#define RECONNECT_STEP_MS 100
+
 struct Session {
   int id;
   int req_pipe;
   int notif_pipe;
+  int closed; // the server closed the notification pipe
+  int reconnect_ms; // how long to wait for a restarted server, see pacman_set_reconnect
   char req_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
   char notif_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
+  // Bytes read from the notification pipe, rx[rx_start..rx_len) is not decoded yet
+  char *rx;
+  size_t rx_start;
+  size_t rx_len;
+  size_t rx_capacity;
+  Board frame; // frame handed to pacman_poll callbacks
+  // Window of the board from the OP_CODE_VIEW frames, the changes of the next one apply to it
+  char *view;
+  char *view_scratch;
+  size_t view_capacity;
+  int view_x, view_y, view_width, view_height;
+  int next_seq; // sequence number of the next command
+  long long sent_us[INPUT_WINDOW]; // send time of the last INPUT_WINDOW commands, by seq
+  void *user; // caller data, see pacman_session_set_user
 };
 
-static struct Session session = {.id = -1};
+pacman_session_t *pacman_session_new(void) {
+  pacman_session_t *session = calloc(1, sizeof(pacman_session_t));
+  if (session == NULL) {
+    return NULL;
+  }
+  session->id = -1;
+  session->next_seq = 1; // 0 means no command in frames
+  session->req_pipe = -1;
+  session->notif_pipe = -1;
+  return session;
+}
 
-int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
-  // TODO - implement me
-  
+void pacman_session_free(pacman_session_t *session) {
+  if (session == NULL) {
+    return;
+  }
+  if (session->notif_pipe >= 0) {
+    pacman_disconnect(session);
+  }
+  free(session->rx);
+  free(session->view);
+  free(session->view_scratch);
+  board_release(&session->frame);
+  free(session);
+}
+
+int pacman_session_fd(pacman_session_t *session) {
+  return session->notif_pipe;
+}
+
+void pacman_set_reconnect(pacman_session_t *session, int timeout_ms) {
+  __atomic_store_n(&session->reconnect_ms, timeout_ms, __ATOMIC_RELAXED);
+}
+
+void pacman_session_set_user(pacman_session_t *session, void *user) {
+  session->user = user;
+}
+
+void *pacman_session_user(pacman_session_t *session) {
+  return session->user;
+}
+
+// Helper private function behind pacman_connect, pacman_connect_seeded and pacman_join: registers
+// with op_code, the connect record followed by the extra bytes of that op code
+static int connect_session(pacman_session_t *session, char const *req_pipe_path, char const *notif_pipe_path,
+                           char const *server_pipe_path, char op_code, const void *extra, size_t extra_len) {
   mkfifo(req_pipe_path, 0666);
   mkfifo(notif_pipe_path, 0666);
 
-  memset(session.req_pipe_path, 0, MAX_PIPE_PATH_LENGTH); 
-  strncpy(session.req_pipe_path, req_pipe_path, MAX_PIPE_PATH_LENGTH - 1);
+  memset(session->req_pipe_path, 0, MAX_PIPE_PATH_LENGTH); 
+  strncpy(session->req_pipe_path, req_pipe_path, MAX_PIPE_PATH_LENGTH - 1);
 
-  memset(session.notif_pipe_path, 0, MAX_PIPE_PATH_LENGTH); 
-  strncpy(session.notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH - 1);
+  memset(session->notif_pipe_path, 0, MAX_PIPE_PATH_LENGTH); 
+  strncpy(session->notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH - 1);
   
+  // Open the notification pipe before registering so the server's answer is kept
+  // even if the server writes it and closes the pipe straight away (on errors)
+  int notFd = open(session->notif_pipe_path, O_RDONLY | O_NONBLOCK);
+  if (notFd < 0) {
+    perror("notif open error");
+    return EXIT_FAILURE;
+  }
 
   int serverFd = open(server_pipe_path, O_WRONLY);
   if (serverFd < 0) {
     perror("reg open error");
+    close(notFd);
     return EXIT_FAILURE;
   }
-  char op = OP_CODE_CONNECT;
-  write(serverFd, &op, sizeof(char)); //pode nao conseguir escrever toda a data atencao
-  write(serverFd, session.req_pipe_path, MAX_PIPE_PATH_LENGTH);
-  write(serverFd, session.notif_pipe_path, MAX_PIPE_PATH_LENGTH);
-
-  int notFd = open(session.notif_pipe_path, O_RDONLY);
-  if (notFd < 0) {
-    perror("notif open error");
+  // Single write of the whole record: it is below PIPE_BUF, so it is atomic and
+  // cannot be interleaved with other clients registering at the same time
+  char request[1 + 2 * MAX_PIPE_PATH_LENGTH + sizeof(unsigned long long)];
+  size_t request_size = 1 + 2 * MAX_PIPE_PATH_LENGTH;
+  request[0] = op_code;
+  memcpy(request + 1, session->req_pipe_path, MAX_PIPE_PATH_LENGTH);
+  memcpy(request + 1 + MAX_PIPE_PATH_LENGTH, session->notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+  if (extra_len > 0) {
+    memcpy(request + request_size, extra, extra_len);
+    request_size += extra_len;
+  }
+  if (write(serverFd, request, request_size) != (ssize_t)request_size) {
+    perror("reg write error");
+    close(serverFd);
+    close(notFd);
     return EXIT_FAILURE;
   }
-  session.notif_pipe = notFd;
+  close(serverFd);
+
+  struct pollfd pfd = {.fd = notFd, .events = POLLIN};
+  poll(&pfd, 1, -1);
+  fcntl(notFd, F_SETFL, fcntl(notFd, F_GETFL) & ~O_NONBLOCK);
   char buf[2];
-  read(notFd, &buf, 2);
-  printf("buf : %s", buf);
-  if (buf[0]!=op || buf[1]!=0){
+  if (read(notFd, buf, 2) != 2 || buf[0] != OP_CODE_CONNECT || buf[1] != 0) {
+    debug("Connection refused by server\n");
     close(notFd);
     return -1;
   }
+  session->notif_pipe = notFd;
   
-  int reqFd = open(session.req_pipe_path, O_WRONLY);
+  int reqFd = open(session->req_pipe_path, O_WRONLY);
   if (reqFd < 0) {
     perror("req open error");
     debug("Could not open req pipe\n");
+    close(notFd);
+    session->notif_pipe = -1;
+    return EXIT_FAILURE;
+  }
+  session->req_pipe = reqFd;
+  session->closed = 0;
+  session->rx_start = session->rx_len = 0;
+
+  return 0;
+}
+
+int pacman_connect(pacman_session_t *session, char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
+  return connect_session(session, req_pipe_path, notif_pipe_path, server_pipe_path, OP_CODE_CONNECT, NULL, 0);
+}
+
+int pacman_connect_seeded(pacman_session_t *session, char const *req_pipe_path, char const *notif_pipe_path,
+                          char const *server_pipe_path, unsigned long long seed) {
+  return connect_session(session, req_pipe_path, notif_pipe_path, server_pipe_path, OP_CODE_CONNECT_SEEDED,
+                         &seed, sizeof(seed));
+}
+
+int pacman_join(pacman_session_t *session, char const *req_pipe_path, char const *notif_pipe_path,
+                char const *server_pipe_path, int game_id) {
+  return connect_session(session, req_pipe_path, notif_pipe_path, server_pipe_path, OP_CODE_JOIN,
+                         &game_id, sizeof(game_id));
+}
+
+int pacman_spectate(pacman_session_t *session, char const *notif_pipe_path, char const *server_pipe_path, int game_id) {
+  mkfifo(notif_pipe_path, 0666);
+
+  memset(session->notif_pipe_path, 0, MAX_PIPE_PATH_LENGTH);
+  strncpy(session->notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH - 1);
+
+  // Open the notification pipe before registering so the server's answer is kept
+  // even if the server writes it and closes the pipe straight away (on errors)
+  int notFd = open(session->notif_pipe_path, O_RDONLY | O_NONBLOCK);
+  if (notFd < 0) {
+    perror("notif open error");
+    return EXIT_FAILURE;
+  }
+
+  int serverFd = open(server_pipe_path, O_WRONLY);
+  if (serverFd < 0) {
+    perror("reg open error");
+    close(notFd);
+    return EXIT_FAILURE;
+  }
+  // The game id goes where a player would send its request pipe
+  char request[1 + 2 * MAX_PIPE_PATH_LENGTH] = {0};
+  request[0] = OP_CODE_SPECTATE;
+  snprintf(request + 1, MAX_PIPE_PATH_LENGTH, "%d", game_id);
+  memcpy(request + 1 + MAX_PIPE_PATH_LENGTH, session->notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+  if (write(serverFd, request, sizeof(request)) != (ssize_t)sizeof(request)) {
+    perror("reg write error");
+    close(serverFd);
+    close(notFd);
     return EXIT_FAILURE;
   }
-  session.req_pipe = reqFd;
+  close(serverFd);
 
+  struct pollfd pfd = {.fd = notFd, .events = POLLIN};
+  poll(&pfd, 1, -1);
+  fcntl(notFd, F_SETFL, fcntl(notFd, F_GETFL) & ~O_NONBLOCK);
+  char buf[2];
+  if (read(notFd, buf, 2) != 2 || buf[0] != OP_CODE_CONNECT || buf[1] != 0) {
+    close(notFd);
+    return -1;
+  }
+  session->notif_pipe = notFd;
+  session->req_pipe = -1;
+  session->closed = 0;
+  session->rx_start = session->rx_len = 0;
   return 0;
 }
 
-void pacman_play(char command) {
-  char msg[2];
+int pacman_play(pacman_session_t *session, char command) {
+  int seq = session->next_seq++;
+  long long sent_us = now_us();
+  session->sent_us[seq % INPUT_WINDOW] = sent_us;
+
+  // Written at once so the server always finds the whole message after the op code
+  char msg[2 + sizeof(int) + sizeof(long long)];
   msg[0] = OP_CODE_PLAY;
   msg[1] = command;
-  debug("pacman_play: Command: %c\n", command);
-  if (write(session.req_pipe, msg, 2) < 0) {
+  memcpy(msg + 2, &seq, sizeof(int));
+  memcpy(msg + 2 + sizeof(int), &sent_us, sizeof(long long));
+  log_trace("pacman_play: Command: %c seq %d\n", command, seq);
+  if (write(session->req_pipe, msg, sizeof(msg)) < 0) {
     debug("Error writing to req pipe: %s\n", strerror(errno));
-    return;
   }
+  return seq;
+}
+
+int pacman_set_viewport(pacman_session_t *session, int width, int height) {
+  char msg[1 + 2 * sizeof(int)];
+  msg[0] = OP_CODE_VIEWPORT;
+  memcpy(msg + 1, &width, sizeof(int));
+  memcpy(msg + 1 + sizeof(int), &height, sizeof(int));
+  if (session->req_pipe < 0 || write(session->req_pipe, msg, sizeof(msg)) != (ssize_t)sizeof(msg)) {
+    debug("Error writing viewport to req pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
 }
 
-int pacman_disconnect() {
+long long pacman_input_sent_us(pacman_session_t *session, int seq) {
+  if (seq <= 0 || seq >= session->next_seq || session->next_seq - seq > INPUT_WINDOW) {
+    return -1;
+  }
+  return session->sent_us[seq % INPUT_WINDOW];
+}
+
+int pacman_disconnect(pacman_session_t *session) {
   char op = OP_CODE_DISCONNECT;
   debug("pacman_disconnect: Disconnecting...\n");
-  if (write(session.req_pipe, &op, 1) < 0) {
+  // The server closing the pipes now is not a restart to wait for
+  pacman_set_reconnect(session, 0);
+  if (session->req_pipe < 0) {
+    // Spectators only hold the notification pipe
+    close(session->notif_pipe);
+    session->notif_pipe = -1;
+    return 0;
+  }
+  if (write(session->req_pipe, &op, 1) < 0) {
     debug("Error writing to req pipe: %s\n", strerror(errno));
   } else {
     debug("pacman_disconnect: OP CODE sent: %d\n", op);
   }
-  close(session.req_pipe);
+  close(session->req_pipe);
+  session->req_pipe = -1;
   debug("pacman_disconnect: Req pipe closed\n");
-  close(session.notif_pipe); 
+  close(session->notif_pipe); 
+  session->notif_pipe = -1;
   return 0; 
 }
 
-Board receive_board_update(void) {
-    // TODO - implement me
-  Board cityBoard;
-  char op;
-  if (read(session.notif_pipe, &op, 1) <= 0) {
-    debug("Error reading from FIFO: %s\n", strerror(errno));
-    cityBoard.data = NULL;
-    return cityBoard;
-  }
-  if (read(session.notif_pipe, &cityBoard.width, sizeof(int)) <= 0) {
-    debug("Error reading from FIFO: %s\n", strerror(errno));
-    cityBoard.data = NULL;
-    return cityBoard;
-  }
-  if (read(session.notif_pipe, &cityBoard.height, sizeof(int)) <= 0) {
-    debug("Error reading from FIFO: %s\n", strerror(errno));
-    cityBoard.data = NULL;
-    return cityBoard;
-  }
-  if (read(session.notif_pipe, &cityBoard.tempo, sizeof(int)) <= 0) {
-    debug("Error reading from FIFO: %s\n", strerror(errno));
-    cityBoard.data = NULL;
-    return cityBoard;
-  }
-  if (read(session.notif_pipe, &cityBoard.victory, sizeof(int)) <= 0) {
-    debug("Error reading from FIFO: %s\n", strerror(errno));
-    cityBoard.data = NULL;
-    return cityBoard;
-  }
-  if (read(session.notif_pipe, &cityBoard.game_over, sizeof(int)) <= 0) {
-    debug("Error reading from FIFO: %s\n", strerror(errno));
-    cityBoard.data = NULL;
-    return cityBoard;
-  }
-  if (read(session.notif_pipe, &cityBoard.accumulated_points, sizeof(int)) <= 0) {
-    debug("Error reading from FIFO: %s\n", strerror(errno));
-    cityBoard.data = NULL;
-    return cityBoard;
-  }
-  cityBoard.data = (char*)malloc(sizeof(char)*(cityBoard.height*cityBoard.width+1));
-  if (read(session.notif_pipe, cityBoard.data, cityBoard.height*cityBoard.width) <= 0) {
-    debug("Error reading from FIFO: %s\n", strerror(errno));
-    free(cityBoard.data); // free memory if read fails
-    cityBoard.data = NULL;
-    return cityBoard;
-  }
-  cityBoard.data[cityBoard.height*cityBoard.width] = '\0';
-  //nao esquecer dar free ao data
+static int board_reserve(Board *board, int width, int height) {
+  size_t needed = (size_t)width * (size_t)height + 1;
+  if (board->data != NULL && board->capacity >= needed) {
+    return 0;
+  }
+  char *data = realloc(board->data, needed);
+  if (data == NULL) {
+    debug("Error allocating frame buffer of %zu bytes\n", needed);
+    return -1;
+  }
+  board->data = data;
+  board->capacity = needed;
+  return 0;
+}
+
+// Helper private function for the size of the frame starting at p, from its header.
+// Returns 0 if more bytes are needed to know it and -1 on a malformed frame
+static ssize_t frame_size(const char *p, size_t available) {
+  if (available < FRAME_HEADER_SIZE) {
+    return 0;
+  }
+  int header[2];
+  memcpy(header, p + 1, sizeof(header));
+  if (header[0] < 0 || header[1] < 0) {
+    debug("Invalid board dimensions %d x %d\n", header[0], header[1]);
+    return -1;
+  }
+  if (p[0] == OP_CODE_BOARD) {
+    return (ssize_t)(FRAME_HEADER_SIZE + (size_t)header[0] * (size_t)header[1]);
+  }
+  if (p[0] != OP_CODE_VIEW) {
+    debug("Unexpected op code %d on notification pipe\n", p[0]);
+    return -1;
+  }
+  if (available < VIEW_HEADER_SIZE) {
+    return 0;
+  }
+  int window[5];
+  memcpy(window, p + FRAME_HEADER_SIZE, sizeof(window));
+  if (window[2] < 0 || window[3] < 0 || window[4] < -1) {
+    debug("Invalid window %d x %d with %d changes\n", window[2], window[3], window[4]);
+    return -1;
+  }
+  size_t payload = window[4] < 0 ? (size_t)window[2] * (size_t)window[3] : (size_t)window[4] * VIEW_CHANGE_SIZE;
+  return (ssize_t)(VIEW_HEADER_SIZE + payload);
+}
+
+// Helper private function that brings the session's window up to date with an OP_CODE_VIEW frame:
+// a keyframe replaces it, otherwise it moves by the change of origin and the changes are applied.
+// Returns 0, -1 on a malformed frame
+static int apply_view(pacman_session_t *session, const char *p) {
+  int window[5];
+  memcpy(window, p + FRAME_HEADER_SIZE, sizeof(window));
+  int x = window[0], y = window[1], width = window[2], height = window[3], n_changes = window[4];
+  size_t n_cells = (size_t)width * (size_t)height;
+  const char *payload = p + VIEW_HEADER_SIZE;
+  if (n_changes >= 0 && (width != session->view_width || height != session->view_height)) {
+    debug("Window changes for a %d x %d window, %d x %d was kept\n", width, height,
+          session->view_width, session->view_height);
+    return -1;
+  }
+  if (session->view_capacity < n_cells) {
+    char *view = realloc(session->view, n_cells);
+    if (view != NULL) session->view = view;
+    char *scratch = realloc(session->view_scratch, n_cells);
+    if (scratch != NULL) session->view_scratch = scratch;
+    if (view == NULL || scratch == NULL) {
+      return -1;
+    }
+    session->view_capacity = n_cells;
+  }
+  if (n_changes < 0) {
+    memcpy(session->view, payload, n_cells);
+  } else {
+    // The cells the window scrolled over are kept, the ones that scrolled in are always changes
+    int dx = x - session->view_x, dy = y - session->view_y;
+    char *moved = session->view_scratch;
+    for (int row = 0; row < height; row++) {
+      for (int col = 0; col < width; col++) {
+        int old_row = row + dy, old_col = col + dx;
+        int inside = old_row >= 0 && old_row < height && old_col >= 0 && old_col < width;
+        moved[row * width + col] = inside ? session->view[old_row * width + old_col] : ' ';
+      }
+    }
+    for (int i = 0; i < n_changes; i++) {
+      int index;
+      memcpy(&index, payload + i * VIEW_CHANGE_SIZE, sizeof(int));
+      if (index < 0 || (size_t)index >= n_cells) {
+        debug("Window change out of the window: %d\n", index);
+        return -1;
+      }
+      moved[index] = payload[i * VIEW_CHANGE_SIZE + sizeof(int)];
+    }
+    session->view_scratch = session->view;
+    session->view = moved;
+  }
+  session->view_x = x;
+  session->view_y = y;
+  session->view_width = width;
+  session->view_height = height;
+  return 0;
+}
+
+// Helper private function that moves one complete frame from the session's buffer into board.
+// Returns 1 if a frame was decoded, 0 if more bytes are needed and -1 on a malformed stream
+static int decode_frame(pacman_session_t *session, Board *board) {
+  size_t available = session->rx_len - session->rx_start;
+  const char *p = session->rx + session->rx_start;
+  ssize_t size = frame_size(p, available);
+  if (size <= 0) {
+    return (int)size;
+  }
+  if (available < (size_t)size) {
+    return 0;
+  }
+  int header[7];
+  memcpy(header, p + 1, sizeof(header));
+  // A whole frame is a window over all of the board
+  int width = header[0], height = header[1];
+  const char *cells = p + FRAME_HEADER_SIZE;
+  board->view_x = board->view_y = 0;
+  if (p[0] == OP_CODE_VIEW) {
+    if (apply_view(session, p) < 0) {
+      return -1;
+    }
+    width = session->view_width;
+    height = session->view_height;
+    cells = session->view;
+    board->view_x = session->view_x;
+    board->view_y = session->view_y;
+  }
+  size_t data_size = (size_t)width * (size_t)height;
+  if (board_reserve(board, width, height) < 0) {
+    return -1;
+  }
+  board->width = width;
+  board->height = height;
+  board->board_width = header[0];
+  board->board_height = header[1];
+  board->tempo = header[2];
+  board->victory = header[3];
+  board->game_over = header[4];
+  board->accumulated_points = header[5];
+  board->tick = header[6];
+  const char *q = p + 1 + sizeof(header);
+  memcpy(&board->server_time_us, q, sizeof(long long));
+  q += sizeof(long long);
+  memcpy(&board->input_seq, q, sizeof(int));
+  q += sizeof(int);
+  memcpy(&board->input_apply_us, q, sizeof(long long));
+  memcpy(board->data, cells, data_size);
+  board->data[data_size] = '\0';
+
+  session->rx_start += (size_t)size;
+  if (session->rx_start == session->rx_len) {
+    session->rx_start = session->rx_len = 0;
+  }
+  return 1;
+}
+
+// Helper private function doing one read() of the notification pipe into the session's buffer.
+// Returns the bytes read, 0 on end of file and -1 on error (errno is kept)
+static ssize_t fill_rx(pacman_session_t *session) {
+  // Make room for the frame being received, or for at least one chunk
+  size_t needed = session->rx_len + RX_CHUNK;
+  ssize_t size = frame_size(session->rx + session->rx_start, session->rx_len - session->rx_start);
+  if (size > 0 && session->rx_start + (size_t)size > needed) {
+    needed = session->rx_start + (size_t)size;
+  }
+  if (session->rx_start > 0 && needed > session->rx_capacity) {
+    // Slide the undecoded bytes to the front before growing
+    memmove(session->rx, session->rx + session->rx_start, session->rx_len - session->rx_start);
+    session->rx_len -= session->rx_start;
+    needed -= session->rx_start;
+    session->rx_start = 0;
+  }
+  if (needed > session->rx_capacity) {
+    char *rx = realloc(session->rx, needed);
+    if (rx == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    session->rx = rx;
+    session->rx_capacity = needed;
+  }
+
+  ssize_t n = read(session->notif_pipe, session->rx + session->rx_len, session->rx_capacity - session->rx_len);
+  if (n > 0) {
+    session->rx_len += (size_t)n;
+  }
+  return n;
+}
+
+// Helper private function for a notification pipe that reached end of file: waits up to
+// reconnect_ms for a restarted server to re-attach the session, which it answers on the same
+// pipe like a connect. The request pipe is kept, the new server opens it again
+// @return 0 once re-attached, -1 otherwise
+static int reconnect(pacman_session_t *session) {
+  if (__atomic_load_n(&session->reconnect_ms, __ATOMIC_RELAXED) <= 0 || session->req_pipe < 0) {
+    return -1;
+  }
+  // A fresh descriptor waits for the next writer instead of seeing the end of file again; it
+  // takes the number of the old one, so callers holding pacman_session_fd are not affected
+  int notFd = open(session->notif_pipe_path, O_RDONLY | O_NONBLOCK);
+  if (notFd < 0 || dup2(notFd, session->notif_pipe) < 0) {
+    if (notFd >= 0) close(notFd);
+    return -1;
+  }
+  close(notFd);
+  // What was left of a frame the old server was sending never comes
+  session->rx_start = session->rx_len = 0;
+  debug("Server gone, waiting %d ms for it to come back\n", session->reconnect_ms);
+
+  struct pollfd pfd = {.fd = session->notif_pipe, .events = POLLIN};
+  int ready = 0;
+  for (int waited = 0; !ready && waited < __atomic_load_n(&session->reconnect_ms, __ATOMIC_RELAXED);
+       waited += RECONNECT_STEP_MS) {
+    ready = poll(&pfd, 1, RECONNECT_STEP_MS) > 0;
+  }
+  if (!ready) {
+    debug("Server did not come back\n");
+    return -1;
+  }
+  fcntl(session->notif_pipe, F_SETFL, fcntl(session->notif_pipe, F_GETFL) & ~O_NONBLOCK);
+  char buf[2];
+  if (read(session->notif_pipe, buf, 2) != 2 || buf[0] != OP_CODE_CONNECT || buf[1] != 0) {
+    debug("Session not re-attached by the server\n");
+    return -1;
+  }
+  debug("Session re-attached by the restarted server\n");
+  return 0;
+}
+
+int receive_board_update_into(pacman_session_t *session, Board *board) {
+  while (true) {
+    int decoded = decode_frame(session, board);
+    if (decoded != 0) {
+      return decoded > 0 ? 0 : -1;
+    }
+    ssize_t n = fill_rx(session);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0 && reconnect(session) == 0) {
+      continue;
+    }
+    if (n <= 0) {
+      debug("Error reading from FIFO: %s\n", n == 0 ? "end of file" : strerror(errno));
+      session->closed = 1;
+      return -1;
+    }
+  }
+}
+
+void board_release(Board *board) {
+  free(board->data);
+  board->data = NULL;
+  board->capacity = 0;
+}
+
+Board receive_board_update(pacman_session_t *session) {
+  // Allocating variant, the caller owns cityBoard.data
+  Board cityBoard = {0};
+  if (receive_board_update_into(session, &cityBoard) < 0) {
+    board_release(&cityBoard);
+  }
   return cityBoard;
-  
-}
\ No newline at end of file
+}
+
+// Helper private function that hands every frame already buffered to the callback
+static int deliver_frames(pacman_session_t *session, pacman_frame_cb on_frame, void *arg) {
+  int delivered = 0;
+  while (session->notif_pipe >= 0 && !session->closed) {
+    int decoded = decode_frame(session, &session->frame);
+    if (decoded == 0) {
+      break;
+    }
+    if (decoded < 0) {
+      session->closed = 1;
+      on_frame(session, NULL, arg);
+      break;
+    }
+    on_frame(session, &session->frame, arg);
+    delivered++;
+  }
+  return delivered;
+}
+
+int pacman_poll(pacman_session_t **sessions, int n_sessions, int timeout_ms, pacman_frame_cb on_frame, void *arg) {
+  // Reused between calls, one per thread running an event loop
+  static _Thread_local struct pollfd *pfds = NULL;
+  static _Thread_local pacman_session_t **polled = NULL;
+  static _Thread_local int pfds_capacity = 0;
+
+  if (n_sessions > pfds_capacity) {
+    struct pollfd *new_pfds = realloc(pfds, sizeof(struct pollfd) * n_sessions);
+    if (new_pfds == NULL) {
+      return -1;
+    }
+    pfds = new_pfds;
+    pacman_session_t **new_polled = realloc(polled, sizeof(pacman_session_t *) * n_sessions);
+    if (new_polled == NULL) {
+      return -1;
+    }
+    polled = new_polled;
+    pfds_capacity = n_sessions;
+  }
+
+  // Frames left in the buffers by an earlier read must not wait for the pipe to become readable
+  int delivered = 0;
+  int n_polled = 0;
+  for (int i = 0; i < n_sessions; i++) {
+    pacman_session_t *session = sessions[i];
+    if (session == NULL || session->closed || session->notif_pipe < 0) {
+      continue;
+    }
+    delivered += deliver_frames(session, on_frame, arg);
+    if (session->closed || session->notif_pipe < 0) {
+      continue;
+    }
+    pfds[n_polled].fd = session->notif_pipe;
+    pfds[n_polled].events = POLLIN;
+    pfds[n_polled].revents = 0;
+    polled[n_polled++] = session;
+  }
+
+  int ready = poll(pfds, n_polled, delivered > 0 ? 0 : timeout_ms);
+  if (ready < 0) {
+    return errno == EINTR ? delivered : -1;
+  }
+
+  for (int i = 0; i < n_polled && ready > 0; i++) {
+    if (pfds[i].revents == 0) {
+      continue;
+    }
+    ready--;
+    pacman_session_t *session = polled[i];
+    if (session->notif_pipe != pfds[i].fd) {
+      continue; // disconnected by an earlier callback
+    }
+    // A single read() never blocks once poll() said the pipe is readable
+    ssize_t n = fill_rx(session);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+      session->closed = 1;
+      on_frame(session, NULL, arg);
+      continue;
+    }
+    delivered += deliver_frames(session, on_frame, arg);
+  }
+  return delivered;
+}
@@ -2,6 +2,8 @@
 #include "protocol.h"
 #include "display.h"
 #include "debug.h"
+#include "mailbox.h"
+#include "latency.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,53 +14,141 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
 
 
-Board board;
 bool stop_execution = false;
-int tempo;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// Frames go from the receiver to the renderer through here, nothing else shares a Board
+frame_mailbox_t mailbox;
+pacman_session_t *session;
+// Only touched by the render thread, dumped on exit and whenever SIGUSR1 arrives
+latency_tracker_t latency;
+volatile sig_atomic_t dump_latency = 0;
+
+#define LATENCY_FILE "client-latency.log"
+
+static void request_latency_dump(int sig) {
+    (void)sig;
+    dump_latency = 1;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
+// Only reads the pipe, so a slow terminal never stops frames from being drained
 static void *receiver_thread(void *arg) {
     (void)arg;
 
     while (true) {
-        
-        Board board = receive_board_update();
-        debug("receiver\n");
-        if (!board.data || board.game_over == 1 || board.victory == 1) {
+        Board *frame = mailbox_back(&mailbox);
+        if (receive_board_update_into(session, frame) < 0) {
+            debug("Notification pipe closed, stopping receiver thread\n");
+            break;
+        }
+        log_trace("receiver\n");
+        int last_frame = frame->game_over == 1 || frame->victory == 1;
+        mailbox_publish(&mailbox);
+        if (last_frame) {
             debug("Game over received, stopping receiver thread\n");
-            if (board.data) {
-                draw_board_client(board);
-                refresh_screen();
-                sleep_ms(board.tempo);
-                free(board.data);
-            }
-            pthread_mutex_lock(&mutex);
-            stop_execution = true;
-            pthread_mutex_unlock(&mutex);
             break;
         }
-
-        pthread_mutex_lock(&mutex);
-        tempo = board.tempo;
-        pthread_mutex_unlock(&mutex);
-
-        draw_board_client(board);
-        refresh_screen();
-        free(board.data);
     }
+    mailbox_close(&mailbox);
     
     debug("Returning receiver thread...\n");
     return NULL;
 }
 
+// Draws the most recent frame, at most once per RENDER_INTERVAL_MS
+static void *render_thread(void *arg) {
+    (void)arg;
+    long long last_render = 0;
+
+    Board *frame;
+    while ((frame = mailbox_take(&mailbox)) != NULL) {
+        long long wait = last_render + RENDER_INTERVAL_MS - now_ms();
+        if (wait > 0) {
+            sleep_ms((int)wait);
+            // A newer frame may have arrived meanwhile, prefer it
+            if (mailbox_pending(&mailbox)) {
+                frame = mailbox_take(&mailbox);
+            }
+        }
+        draw_board_client(*frame);
+        refresh_screen();
+        latency_record_frame(&latency, session, frame, now_us());
+        if (dump_latency) {
+            dump_latency = 0;
+            latency_dump(&latency, LATENCY_FILE);
+        }
+        last_render = now_ms();
+        if (frame->game_over == 1 || frame->victory == 1) {
+            sleep_ms(frame->tempo);
+            break;
+        }
+    }
+
+    latency_dump(&latency, LATENCY_FILE);
+
+    pthread_mutex_lock(&mutex);
+    stop_execution = true;
+    pthread_mutex_unlock(&mutex);
+    debug("Returning render thread...\n");
+    return NULL;
+}
+
+// Helper private function for the game id of -s and -j
+// @return the id, 0 if arg is not a number of at least 1
+static int parse_game_id(const char *arg) {
+    char *end = NULL;
+    errno = 0;
+    long game_id = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || game_id < 1 || game_id > INT_MAX) {
+        return 0;
+    }
+    return (int)game_id;
+}
+
+// Helper private function, frames only carry the part of the board that fits on the terminal
+static void send_viewport(void) {
+    int view_width, view_height;
+    terminal_view_size(&view_width, &view_height);
+    pacman_set_viewport(session, view_width, view_height);
+}
+
 int main(int argc, char *argv[]) {
     signal(SIGPIPE, SIG_IGN);
-    if (argc != 3 && argc != 4) {
+    signal(SIGUSR1, request_latency_dump);
+    // Spectator mode: -s <game_id> <client_id> <register_pipe>
+    const char *program = argv[0];
+    int spectate_game = 0;
+    int bad_game_id = 0;
+    if (argc == 5 && strcmp(argv[1], "-s") == 0) {
+        spectate_game = parse_game_id(argv[2]);
+        bad_game_id = spectate_game == 0;
+        argv += 2;
+        argc -= 2;
+    }
+    // Shared game: -j <game_id> <client_id> <register_pipe> [commands_file]
+    int join_game = 0;
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "-j") == 0) {
+        join_game = parse_game_id(argv[2]);
+        bad_game_id = join_game == 0;
+        argv += 2;
+        argc -= 2;
+    }
+    if (bad_game_id || (argc != 3 && (argc != 4 || spectate_game))) {
         fprintf(stderr,
-            "Usage: %s <client_id> <register_pipe> [commands_file]\n",
-            argv[0]);
+            "Usage: %s <client_id> <register_pipe> [commands_file]\n"
+            "       %s -s <game_id> <client_id> <register_pipe>\n"
+            "       %s -j <game_id> <client_id> <register_pipe> [commands_file]\n",
+            program, program, program);
         return 1;
     }
 
@@ -86,22 +176,59 @@ int main(int argc, char *argv[]) {
 
     open_debug_file("client-debug.log");
 
-    
-    if (pacman_connect(req_pipe_path, notif_pipe_path, register_pipe) != 0) {
-        perror("Failed to connect to server");
+    session = pacman_session_new();
+    if (session == NULL) {
+        perror("Failed to allocate session");
         return 1;
     }
+    if (spectate_game) {
+        if (pacman_spectate(session, notif_pipe_path, register_pipe, spectate_game) != 0) {
+            fprintf(stderr, "Failed to spectate game %d\n", spectate_game);
+            return 1;
+        }
+    } else if (join_game) {
+        if (pacman_join(session, req_pipe_path, notif_pipe_path, register_pipe, join_game) != 0) {
+            fprintf(stderr, "Failed to join game %d\n", join_game);
+            return 1;
+        }
+    } else {
+        // PACMAN_SEED=<n> replays the game the server played with seed n, given the same inputs
+        const char *seed = getenv("PACMAN_SEED");
+        int connected = seed != NULL
+            ? pacman_connect_seeded(session, req_pipe_path, notif_pipe_path, register_pipe, strtoull(seed, NULL, 10))
+            : pacman_connect(session, req_pipe_path, notif_pipe_path, register_pipe);
+        if (connected != 0) {
+            perror("Failed to connect to server");
+            return 1;
+        }
+    }
 
+    // Only PACMAN_RECONNECT_MS=<n> waits, n ms, for a server restarted on its session store to
+    // come back; otherwise the game ends with the server
+    const char *reconnect_ms = getenv("PACMAN_RECONNECT_MS");
+    if (reconnect_ms != NULL) {
+        pacman_set_reconnect(session, atoi(reconnect_ms));
+    }
+
+    mailbox_init(&mailbox);
+    latency_init(&latency);
     pthread_t receiver_thread_id;
     pthread_create(&receiver_thread_id, NULL, receiver_thread, NULL);
 
     terminal_init();
+    if (!spectate_game) {
+        send_viewport();
+    }
     set_timeout(500);
-    draw_board_client(board);
+    draw_board_client((Board){0});
     refresh_screen();
 
+    pthread_t render_thread_id;
+    pthread_create(&render_thread_id, NULL, render_thread, NULL);
+
     char command;
     int ch;
+    int sent_tick = -1; // server tick the last command was sent in
 
     while (1) {
 
@@ -129,16 +256,14 @@ int main(int argc, char *argv[]) {
             }
             command = toupper(command);
             
-            // Wait for tempo, to not overflow pipe with requests
-            pthread_mutex_lock(&mutex);
-            int wait_for = tempo;
-            pthread_mutex_unlock(&mutex);
-
-            sleep_ms(wait_for);
-            
         } else {
             // Interactive input
             command = get_input();
+            if (command == INPUT_RESIZE) {
+                // The new terminal size is the window of the next frames
+                if (!spectate_game) send_viewport();
+                continue;
+            }
             command = toupper(command);
         }
 
@@ -151,14 +276,27 @@ int main(int argc, char *argv[]) {
             break;
         }
 
-        pacman_play(command);
-        sleep_ms(tempo);
+        if (spectate_game) {
+            continue; // spectators only watch
+        }
+
+        // One command per server tick: a command sent in a tick the server has not
+        // finished yet would only queue behind the previous one
+        int tick = mailbox_wait_tick(&mailbox, sent_tick);
+        if (tick < 0) {
+            break;
+        }
+        pacman_play(session, command);
+        sent_tick = tick;
     }
     debug("Client main loop exited, disconnecting...\n");
-    pacman_disconnect();
+    pacman_disconnect(session);
     debug("Waiting for receiver thread to finish...\n");
 
     pthread_join(receiver_thread_id, NULL);
+    pthread_join(render_thread_id, NULL);
+    mailbox_destroy(&mailbox);
+    pacman_session_free(session);
 
     if (cmd_fp){
         fclose(cmd_fp);
@@ -46,87 +46,140 @@ int terminal_init() {
     return 0;
 }
 
+void terminal_view_size(int *width, int *height) {
+    // draw_board_client uses three rows above the board and two below it
+    *width = COLS > 1 ? COLS : 1;
+    *height = LINES > 6 ? LINES - 5 : 1;
+}
 
-void draw_board_client(Board board) {
-    // Clear the screen before redrawing
-    clear();
 
-    // Draw the border/title
-    attron(COLOR_PAIR(5));
-    mvprintw(0, 0, "=== PACMAN GAME ===");
-    if (board.victory) {
-        mvprintw(1, 0, " VICTORY ");
-    } else if (board.game_over) {
-        mvprintw(1, 0, " GAME OVER ");
-    } else {
-        mvprintw(1, 0, " Use W/A/S/D to move | Q to quit");
+// Last frame drawn by draw_board_client, so the next one only touches the cells that changed
+static char *drawn_cells = NULL;
+static size_t drawn_capacity = 0;
+static int drawn_width = -1;
+static int drawn_height = -1;
+static int drawn_status = -1;
+static int drawn_points = -1;
+
+// Helper private function that draws one board cell at the cursor with its colour
+static void draw_cell_client(char ch) {
+    switch (ch) {
+        case '#': // Wall
+            attron(COLOR_PAIR(3));
+            addch('#');
+            attroff(COLOR_PAIR(3));
+            break;
+
+        case 'C': // Pacman
+            attron(COLOR_PAIR(1) | A_BOLD);
+            addch('C');
+            attroff(COLOR_PAIR(1) | A_BOLD);
+            break;
+
+        case 'c': // Another player's pacman
+            attron(COLOR_PAIR(7) | A_BOLD);
+            addch('C');
+            attroff(COLOR_PAIR(7) | A_BOLD);
+            break;
+
+        case 'M': // Monster/Ghost
+            attron(COLOR_PAIR(2) | A_BOLD);
+            addch('M');
+            attroff(COLOR_PAIR(2) | A_BOLD);  
+            break;
+
+        case 'G': // Charged Monster/Ghost
+            attron((COLOR_PAIR(2) | A_BOLD) | A_DIM);
+            addch('M');
+            attroff((COLOR_PAIR(2) | A_BOLD) | A_DIM);  
+            break;
+
+        case '.': // Dot
+            attron(COLOR_PAIR(4));
+            addch('.');
+            attroff(COLOR_PAIR(4));
+            break;
+
+        case '@': // Portal
+            attron(COLOR_PAIR(6));
+            addch('@');
+            attroff(COLOR_PAIR(6));
+            break;
+
+        case ' ': // Empty space
+            addch(' ');
+            break;
+
+        default:
+            addch(ch);
+            break;
     }
+}
 
+void draw_board_client(Board board) {
     // Starting row for the game board (leave space for UI)
     int start_row = 3;
+    size_t n_cells = (board.data != NULL) ? (size_t)board.width * (size_t)board.height : 0;
+    int full_redraw = board.width != drawn_width || board.height != drawn_height;
+
+    if (full_redraw) {
+        // Only clear when the layout changes, otherwise the whole screen is sent again
+        clear();
+        attron(COLOR_PAIR(5));
+        mvprintw(0, 0, "=== PACMAN GAME ===");
+        attroff(COLOR_PAIR(5));
+        if (drawn_capacity < n_cells) {
+            char *cells = realloc(drawn_cells, n_cells);
+            if (cells == NULL) {
+                return;
+            }
+            drawn_cells = cells;
+            drawn_capacity = n_cells;
+        }
+        drawn_width = board.width;
+        drawn_height = board.height;
+        drawn_status = -1;
+        drawn_points = -1;
+    }
 
-    // Draw the board
-    for (int y = 0; y < board.height; y++) {
-        for (int x = 0; x < board.width; x++) {
-            char ch = board.data[y * board.width + x];
-
-            // Move cursor to position
-            move(start_row + y, x);
-
-            // Draw with appropriate color
-            switch (ch) {
-                case '#': // Wall
-                    attron(COLOR_PAIR(3));
-                    addch('#');
-                    attroff(COLOR_PAIR(3));
-                    break;
-
-                case 'C': // Pacman
-                    attron(COLOR_PAIR(1) | A_BOLD);
-                    addch('C');
-                    attroff(COLOR_PAIR(1) | A_BOLD);
-                    break;
-
-                case 'M': // Monster/Ghost
-                    attron(COLOR_PAIR(2) | A_BOLD);
-                    addch('M');
-                    attroff(COLOR_PAIR(2) | A_BOLD);  
-                    break;
-
-                case 'G': // Charged Monster/Ghost
-                    attron((COLOR_PAIR(2) | A_BOLD) | A_DIM);
-                    addch('M');
-                    attroff((COLOR_PAIR(2) | A_BOLD) | A_DIM);  
-                    break;
-
-                case '.': // Dot
-                    attron(COLOR_PAIR(4));
-                    addch('.');
-                    attroff(COLOR_PAIR(4));
-                    break;
-
-                case '@': // Portal
-                    attron(COLOR_PAIR(6));
-                    addch('@');
-                    attroff(COLOR_PAIR(6));
-                    break;
-
-                case ' ': // Empty space
-                    addch(' ');
-                    break;
+    int status = board.victory ? 2 : (board.game_over ? 1 : 0);
+    if (status != drawn_status) {
+        attron(COLOR_PAIR(5));
+        if (board.victory) {
+            mvprintw(1, 0, " VICTORY ");
+        } else if (board.game_over) {
+            mvprintw(1, 0, " GAME OVER ");
+        } else {
+            mvprintw(1, 0, " Use W/A/S/D to move | Q to quit");
+        }
+        clrtoeol();
+        attroff(COLOR_PAIR(5));
+        drawn_status = status;
+    }
 
-                default:
-                    addch(ch);
-                    break;
+    // Draw only the cells whose symbol changed since the last frame
+    for (int y = 0; y < board.height && n_cells > 0; y++) {
+        for (int x = 0; x < board.width; x++) {
+            int index = y * board.width + x;
+            char ch = board.data[index];
+            if (!full_redraw && drawn_cells[index] == ch) {
+                continue;
             }
+            move(start_row + y, x);
+            draw_cell_client(ch);
+            drawn_cells[index] = ch;
         }
     }
 
     // Draw score/status at the bottom
-    attron(COLOR_PAIR(5));
-    mvprintw(start_row + board.height + 1, 0, "Points: %d",
-             board.accumulated_points);
-    attroff(COLOR_PAIR(5));
+    if (board.accumulated_points != drawn_points) {
+        attron(COLOR_PAIR(5));
+        mvprintw(start_row + board.height + 1, 0, "Points: %d",
+                 board.accumulated_points);
+        clrtoeol();
+        attroff(COLOR_PAIR(5));
+        drawn_points = board.accumulated_points;
+    }
 }
 
 // Does exaclty the same as draw board but stores the output in a string instead of printing it
@@ -302,6 +355,9 @@ char get_input() {
     if (ch == ERR) {
         return '\0'; // No input
     }
+    if (ch == KEY_RESIZE) {
+        return INPUT_RESIZE;
+    }
 
     ch = toupper((char)ch);
 
@@ -0,0 +1,102 @@
+#include "latency.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void latency_init(latency_tracker_t *tracker) {
+    memset(tracker, 0, sizeof(*tracker));
+}
+
+// Helper private function that maps a value to its bucket
+static int bucket_of(long long value) {
+    if (value < LATENCY_SUB_BUCKETS) {
+        return value < 0 ? 0 : (int)value;
+    }
+    int msb = 63 - __builtin_clzll((unsigned long long)value); // >= 3
+    int index = (msb - 2) * LATENCY_SUB_BUCKETS + (int)((value >> (msb - 3)) & (LATENCY_SUB_BUCKETS - 1));
+    return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+// Helper private function that returns the largest value a bucket holds
+static long long bucket_upper(int index) {
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+    int msb = index / LATENCY_SUB_BUCKETS + 2;
+    long long sub = index % LATENCY_SUB_BUCKETS;
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << (msb - 3)) - 1;
+}
+
+void latency_record(latency_histogram_t *hist, long long value_us) {
+    if (value_us < 0) {
+        value_us = 0;
+    }
+    hist->counts[bucket_of(value_us)]++;
+    if (hist->n == 0 || value_us < hist->min_us) hist->min_us = value_us;
+    if (value_us > hist->max_us) hist->max_us = value_us;
+    hist->sum_us += value_us;
+    hist->n++;
+}
+
+long long latency_percentile(const latency_histogram_t *hist, double p) {
+    if (hist->n == 0) {
+        return 0;
+    }
+    unsigned long long target = (unsigned long long)(p * (double)hist->n);
+    if (target == 0) target = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            long long upper = bucket_upper(i);
+            return upper < hist->max_us ? upper : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
+
+void latency_record_frame(latency_tracker_t *tracker, pacman_session_t *session, const Board *frame, long long render_us) {
+    if (frame->input_seq <= tracker->last_seq) {
+        return;
+    }
+    tracker->last_seq = frame->input_seq;
+    long long sent_us = pacman_input_sent_us(session, frame->input_seq);
+    if (sent_us < 0) {
+        return;
+    }
+    latency_record(&tracker->send_to_apply, frame->input_apply_us - sent_us);
+    latency_record(&tracker->apply_to_render, render_us - frame->input_apply_us);
+    latency_record(&tracker->send_to_render, render_us - sent_us);
+}
+
+// Helper private function to write one histogram
+static void dump_histogram(FILE *fp, const char *name, const latency_histogram_t *hist) {
+    fprintf(fp, "%s count=%llu", name, hist->n);
+    if (hist->n > 0) {
+        fprintf(fp, " min=%lld mean=%lld p50=%lld p90=%lld p99=%lld max=%lld",
+                hist->min_us, hist->sum_us / (long long)hist->n,
+                latency_percentile(hist, 0.50), latency_percentile(hist, 0.90),
+                latency_percentile(hist, 0.99), hist->max_us);
+    }
+    fprintf(fp, "\n");
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (hist->counts[i] > 0) {
+            fprintf(fp, "  le=%lld %llu\n", bucket_upper(i), hist->counts[i]);
+        }
+    }
+}
+
+int latency_dump(const latency_tracker_t *tracker, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        debug("Error opening latency file %s\n", path);
+        return -1;
+    }
+    fprintf(fp, "# input latency in microseconds\n");
+    dump_histogram(fp, "send_to_apply", &tracker->send_to_apply);
+    dump_histogram(fp, "apply_to_render", &tracker->apply_to_render);
+    dump_histogram(fp, "send_to_render", &tracker->send_to_render);
+    fclose(fp);
+    return 0;
+}
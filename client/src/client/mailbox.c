@@ -0,0 +1,81 @@
+#include "mailbox.h"
+#include "api.h"
+#include <string.h>
+
+void mailbox_init(frame_mailbox_t *mailbox) {
+    memset(mailbox->slots, 0, sizeof(mailbox->slots));
+    mailbox->back = 0;
+    mailbox->latest = 1;
+    mailbox->front = 2;
+    mailbox->fresh = 0;
+    mailbox->closed = 0;
+    mailbox->tick = -1;
+    pthread_mutex_init(&mailbox->lock, NULL);
+    pthread_cond_init(&mailbox->cond, NULL);
+}
+
+void mailbox_destroy(frame_mailbox_t *mailbox) {
+    for (int i = 0; i < 3; i++) {
+        board_release(&mailbox->slots[i]);
+    }
+    pthread_mutex_destroy(&mailbox->lock);
+    pthread_cond_destroy(&mailbox->cond);
+}
+
+Board *mailbox_back(frame_mailbox_t *mailbox) {
+    // back is only swapped by the receiver itself in mailbox_publish
+    return &mailbox->slots[mailbox->back];
+}
+
+void mailbox_publish(frame_mailbox_t *mailbox) {
+    pthread_mutex_lock(&mailbox->lock);
+    int published = mailbox->back;
+    mailbox->back = mailbox->latest;
+    mailbox->latest = published;
+    mailbox->fresh = 1;
+    mailbox->tick = mailbox->slots[published].tick;
+    // Both the renderer and the input loop may be waiting
+    pthread_cond_broadcast(&mailbox->cond);
+    pthread_mutex_unlock(&mailbox->lock);
+}
+
+void mailbox_close(frame_mailbox_t *mailbox) {
+    pthread_mutex_lock(&mailbox->lock);
+    mailbox->closed = 1;
+    pthread_cond_broadcast(&mailbox->cond);
+    pthread_mutex_unlock(&mailbox->lock);
+}
+
+Board *mailbox_take(frame_mailbox_t *mailbox) {
+    pthread_mutex_lock(&mailbox->lock);
+    while (!mailbox->fresh && !mailbox->closed) {
+        pthread_cond_wait(&mailbox->cond, &mailbox->lock);
+    }
+    Board *frame = NULL;
+    if (mailbox->fresh) {
+        int taken = mailbox->latest;
+        mailbox->latest = mailbox->front;
+        mailbox->front = taken;
+        mailbox->fresh = 0;
+        frame = &mailbox->slots[taken];
+    }
+    pthread_mutex_unlock(&mailbox->lock);
+    return frame;
+}
+
+int mailbox_pending(frame_mailbox_t *mailbox) {
+    pthread_mutex_lock(&mailbox->lock);
+    int pending = mailbox->fresh;
+    pthread_mutex_unlock(&mailbox->lock);
+    return pending;
+}
+
+int mailbox_wait_tick(frame_mailbox_t *mailbox, int after_tick) {
+    pthread_mutex_lock(&mailbox->lock);
+    while (mailbox->tick <= after_tick && !mailbox->closed) {
+        pthread_cond_wait(&mailbox->cond, &mailbox->lock);
+    }
+    int tick = mailbox->closed ? -1 : mailbox->tick;
+    pthread_mutex_unlock(&mailbox->lock);
+    return tick;
+}
@@ -0,0 +1,6 @@
+PASSO 0
+POS 18 33
+C
+D
+C
+A
@@ -0,0 +1,3 @@
+PASSO 1
+POS 19 10
+R
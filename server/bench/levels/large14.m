@@ -0,0 +1,3 @@
+PASSO 1
+POS 33 44
+R
@@ -0,0 +1,6 @@
+PASSO 0
+POS 66 5
+C
+D
+C
+A
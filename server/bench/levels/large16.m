@@ -0,0 +1,3 @@
+PASSO 1
+POS 103 43
+R
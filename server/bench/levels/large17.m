@@ -0,0 +1,8 @@
+PASSO 0
+POS 54 44
+D
+D
+S
+A
+W
+T 2
@@ -0,0 +1,3 @@
+PASSO 0
+POS 84 4
+R
@@ -0,0 +1,3 @@
+PASSO 1
+POS 9 32
+R
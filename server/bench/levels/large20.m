@@ -0,0 +1,8 @@
+PASSO 1
+POS 45 17
+D
+D
+S
+A
+W
+T 2
@@ -0,0 +1,3 @@
+PASSO 0
+POS 59 4
+R
@@ -0,0 +1,8 @@
+PASSO 1
+POS 32 42
+D
+D
+S
+A
+W
+T 2
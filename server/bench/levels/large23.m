@@ -0,0 +1,3 @@
+PASSO 0
+POS 2 11
+R
@@ -0,0 +1,6 @@
+PASSO 1
+POS 61 22
+C
+D
+C
+A
@@ -0,0 +1,8 @@
+PASSO 0
+POS 19 6
+D
+D
+S
+A
+W
+T 2
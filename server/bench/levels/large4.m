@@ -0,0 +1,3 @@
+PASSO 1
+POS 116 18
+R
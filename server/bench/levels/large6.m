@@ -0,0 +1,6 @@
+PASSO 1
+POS 96 41
+C
+D
+C
+A
@@ -0,0 +1,8 @@
+PASSO 1
+POS 44 5
+D
+D
+S
+A
+W
+T 2
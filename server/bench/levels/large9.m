@@ -0,0 +1,3 @@
+PASSO 0
+POS 8 43
+R
@@ -0,0 +1,8 @@
+PASSO 0
+POS 18 12
+D
+D
+S
+A
+W
+T 2
@@ -0,0 +1,3 @@
+PASSO 1
+POS 17 2
+R
@@ -0,0 +1,3 @@
+PASSO 1
+POS 20 16
+R
@@ -0,0 +1,3 @@
+PASSO 0
+POS 32 3
+R
@@ -0,0 +1,3 @@
+PASSO 1
+POS 26 11
+R
@@ -0,0 +1,3 @@
+PASSO 0
+POS 5 2
+R
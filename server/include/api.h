@@ -1,18 +1,56 @@
 #ifndef API_H
 #define API_H
 
+#include <stddef.h>
+
 #define MAX_PIPE_PATH_LENGTH 40
 #define OP_CODE_CONNECT 1
 #define OP_CODE_DISCONNECT 2
 #define OP_CODE_PLAY 3
 #define OP_CODE_BOARD 4
+// Same record as OP_CODE_CONNECT, but rep_pipe carries the id of the game to watch
+// (optionally followed by ":evict") and only the notification pipe is used
+#define OP_CODE_SPECTATE 5
+// OP_CODE_CONNECT record followed by the seed of the game's random moves (unsigned long long),
+// so a client can ask for a game it played before
+#define OP_CODE_CONNECT_SEEDED 6
+// OP_CODE_CONNECT record followed by the id of a running game (int): the client gets its own
+// pacman on that game's board instead of a session of its own
+#define OP_CODE_JOIN 7
+// Player to server on the request pipe: op code, width and height (ints) of the window the client
+// draws, sent after connecting and whenever it changes. The player then gets OP_CODE_VIEW frames
+#define OP_CODE_VIEWPORT 8
+// Server to player: the header of an OP_CODE_BOARD frame, width and height being those of the
+// whole board, followed by the window's view_x, view_y, view_width, view_height and n_changes
+// (ints). n_changes -1 is a keyframe, the view_width x view_height cells of the window follow.
+// Otherwise the client moves the cells it has by the change of origin, the cells that scrolled in
+// are unknown, and n_changes (int index in the window, char cell) entries follow
+#define OP_CODE_VIEW 9
+
+// Pacmans on one board, one per player of a shared session
+#define MAX_PACMANS 16
+
+// Every registration record is op code + request pipe + notification pipe
+#define CONNECT_REQUEST_SIZE (1 + 2 * MAX_PIPE_PATH_LENGTH)
+#define CONNECT_SEEDED_REQUEST_SIZE (CONNECT_REQUEST_SIZE + sizeof(unsigned long long))
+#define JOIN_REQUEST_SIZE (CONNECT_REQUEST_SIZE + sizeof(int))
+// How many registration records are pulled from the FIFO with a single read()
+#define REG_BATCH_REQUESTS 64
 
 typedef struct {
     int op_code;
     char rep_pipe[MAX_PIPE_PATH_LENGTH];
     char notif_pipe[MAX_PIPE_PATH_LENGTH];
+    int seeded;             // whether the client chose the seed
+    unsigned long long seed;
+    int game_id;            // game to join, OP_CODE_JOIN only
 } connect_request_t;
 
+typedef struct {
+    char buffer[CONNECT_SEEDED_REQUEST_SIZE * REG_BATCH_REQUESTS];
+    size_t len; // bytes buffered, the tail may be a partial record
+} reg_reader_t;
+
 typedef struct {
   int width;
   int height;
@@ -20,14 +58,51 @@ typedef struct {
   int victory;
   int game_over;
   int accumulated_points;
+  int tick;                 // frames sent in this session, one per server tick
+  long long server_time_us; // CLOCK_MONOTONIC time the frame was taken, in microseconds
+  int input_seq;            // sequence number of the last client command applied, 0 if none
+  long long input_apply_us; // CLOCK_MONOTONIC time that command was applied
+  int pacman_cells[MAX_PACMANS]; // cell of every pacman in data, -1 for those not on the board
   char* data;
+  size_t capacity; // bytes allocated for data, reused between frames
 } Board;
 
 int create_and_open_reg_fifo(const char *path);
-int read_connect_request(int req_fd, connect_request_t *request);
+void reg_reader_init(reg_reader_t *reader);
+
+/*Reads every registration record available in one read() and decodes the complete ones into requests.
+Partial records are kept in the reader until the rest arrives, invalid records are discarded.
+Returns the number of valid requests decoded or -1 on error (errno is kept)*/
+int read_connect_requests(int req_fd, reg_reader_t *reader, connect_request_t *requests, int max_requests);
 int open_client_pipes(const char *rep_pipe_path, const char *notif_pipe_path, int *rep_fd, int *notif_fd);
-char get_input_non_blocking(int req_pipe_fd);
-int writeBoardChanges(int notif_pipe_fd, Board board);
+
+/*Checks without waiting that a client has notif_pipe_path open for reading
+@return a descriptor writing to it, to close once the client was answered so it never sees the
+pipe without writers, -1 when nobody reads it*/
+int client_listening(const char *notif_pipe_path);
+// An OP_CODE_PLAY message: op code, command, sequence number and client timestamp
+typedef struct {
+    char command;
+    int seq;
+    long long client_time_us;
+    int view_width, view_height; // window declared by an OP_CODE_VIEWPORT message
+} play_request_t;
+
+/*Reads one request from the client without blocking.
+Returns the command ('Q' on disconnect, '\0' if there is nothing to read or the client has not opened
+the pipe yet) and fills play for OP_CODE_PLAY,
+'V' with the window in play for OP_CODE_VIEWPORT*/
+char get_input_non_blocking(int req_pipe_fd, play_request_t *play);
+
+/*Blocks until the request pipe has data or timeout_ms elapse*/
+void wait_for_input(int req_pipe_fd, int timeout_ms);
 void send_error_response(int notif_pipe_fd);
 
+/*Makes sure board->data can hold a width x height frame (plus terminator).
+Only reallocates when the frame grows, so a session can reuse the same Board every tick*/
+int board_data_reserve(Board *board, int width, int height);
+
+/*Frees the buffer owned by board*/
+void board_data_release(Board *board);
+
 #endif
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include <pthread.h>
 #include "api.h"
+#include "log.h"
+#include "rng.h"
 
 #define MAX_MOVES 20 
 #define MAX_LEVELS 20
@@ -31,6 +33,10 @@ typedef struct {
     int current_move;
     int n_moves; // number of predefined moves, 0 if controlled by user, >0 if readed from level file
     int waiting;
+    rng_t rng; // stream of this pacman's random moves, see load_level
+    int input_seq;            // sequence number of the last command of its player applied, echoed in frames,
+                              // stored with release after input_apply_us
+    long long input_apply_us; // when that command was applied
 } pacman_t;
 
 typedef struct {
@@ -41,26 +47,66 @@ typedef struct {
     int current_move;
     int waiting;
     int charged;
+    rng_t rng; // stream of this ghost's random moves, see load_level
 } ghost_t;
 
+// Occupants of a cell: ghost i is OCCUPANT_GHOST(i), pacman i is OCCUPANT_PACMAN(i), all of them
+// fit in the signed char of board_pos_t
+#define NO_OCCUPANT (-1)
+#define OCCUPANT_GHOST(i) (i)
+#define OCCUPANT_PACMAN(i) (MAX_GHOSTS + (i))
+#define IS_GHOST(occupant) ((occupant) >= 0 && (occupant) < MAX_GHOSTS)
+#define IS_PACMAN(occupant) ((occupant) >= MAX_GHOSTS)
+#define PACMAN_INDEX(occupant) ((occupant) - MAX_GHOSTS)
+
+// Cells are guarded by a table of at most CELL_LOCK_STRIPES locks, cell i by lock i % n_locks:
+// small levels keep a lock per cell, a huge one does not pay for a lock in every cell
+#define CELL_LOCK_STRIPES 65536
+
+// Dots eaten are tracked per chunk of this many cells for the snapshots, see snapshot.h
+#define SNAPSHOT_CHUNK_CELLS 4096
+
+// Four bytes per cell, the levels are only bounded by the memory of the server
 typedef struct {
-    char content;   // stuff like 'P' for pacman 'M' for monster/ghost and 'W' for wall
-    int has_dot;    // whether there is a dot in this position or not
-    int has_portal; // whether there is a portal in this position or not
-    pthread_rwlock_t lock; // lock for this position
+    char content;          // 'W' for wall, ' ' otherwise, fixed when the level is loaded
+    signed char occupant;  // entity standing on this position, kept by the move functions, NO_OCCUPANT if none
+    char has_dot;          // whether there is a dot in this position or not
+    char has_portal;       // whether there is a portal in this position or not
 } board_pos_t;
 
+/*@return what stands on a position: 'P' for pacman, 'M' for monster/ghost, its content otherwise*/
+static inline char cell_char(const board_pos_t *pos) {
+    if (pos->occupant == NO_OCCUPANT) return pos->content;
+    return IS_PACMAN(pos->occupant) ? 'P' : 'M';
+}
+
 typedef struct {
     int width, height;      // dimensions of the board
     board_pos_t* board;     // actual board, a row-major matrix
-    int n_pacmans;          // number of pacmans in the board
-    pacman_t* pacmans;      // array containing every pacman in the board to iterate through when processing (Just 1)
+    pthread_rwlock_t *locks; // n_locks cell locks, see cell_rdlock
+    int n_locks;
+    int n_pacmans;          // pacmans[0..n_pacmans) have been on the board this level, see add_pacman
+    pacman_t* pacmans;      // MAX_PACMANS slots, pacman i belongs to player i of the session
     int n_ghosts;           // number of ghosts in the board
     ghost_t* ghosts;        // array containing every ghost in the board to iterate through when processing
     char level_name[256];   //name for the level file to keep track of which will be the next
     char pacman_file[256];  // file with pacman movements
     char ghosts_files[MAX_GHOSTS][256]; // files with monster movements
     int tempo;              // Duration of each play
+    int game_id;            // game slot playing on this board, 1-based
+    int spawn_x, spawn_y;   // where the level's pacman starts, the pacmans added later appear next to it
+    uint64_t rng_seed;      // session seed, every load_level derives the entities' streams from it and advances it
+    struct recorder *recorder; // records the session's moves when recording is on, see replay.h
+    int has_pursuers;       // whether a ghost has an F move
+    struct pursuit *pursuit[MAX_PACMANS]; // distance field to every pacman when a ghost pursues, see pursuit.h
+    struct ray_index *rays; // walls and occupants of every row and column for the charged moves, see ray.h
+    pthread_rwlock_t snapshot_lock; // read by every change of the entities and dots, written by a capture, see snapshot.h
+    unsigned int *dirty_chunks;     // per SNAPSHOT_CHUNK_CELLS cells, capture epoch a dot was last eaten in
+    unsigned int capture_epoch;     // epoch of the changes until the next capture
+    unsigned long long level_serial; // distinct for every level loaded by the server
+#ifdef PROFILE_LOCKS
+    struct lock_profile *lock_profile; // per-cell lock counters of the loaded level
+#endif
 } board_t;
 
 typedef struct {
@@ -92,37 +138,54 @@ typedef struct queue{
 /*Makes the current thread sleep for 'int milliseconds' miliseconds*/
 void sleep_ms(int milliseconds);
 
+/*Returns CLOCK_MONOTONIC time in microseconds, comparable between server and clients on the same host*/
+long long now_us(void);
+
 /*Processes a command for Pacman or Ghost(Monster)
 *_index - corresponding index in board's pacman_t/ghost_t array
-command - command to be processed*/
+command - command to be processed, ghosts also take F to step towards the nearest pacman
+A move locks the position it leaves and the one it enters, the lower index first, and checks
+the target and moves under both: pacmans of different players block each other.
+G and L are not moves, they only take the entity's turn and advance its script*/
 int move_pacman(board_t* board, int pacman_index, command_t* command);
 int move_ghost(board_t* board, int ghost_index, command_t* command);
 
-/*Process the death of a Pacman*/
+/*Moves a charged ghost as far as it goes in direction, killing pacman if it runs into it*/
+int move_ghost_charged(board_t* board, int ghost_index, char direction);
+
+/*Process the death of a Pacman, or takes the pacman of a player that left off the board*/
 void kill_pacman(board_t* board, int pacman_index);
 
+/*Puts pacman pacman_index (> 0) on a loaded level for a player that joined the session,
+on the free cell nearest to where the level's pacman started
+@return 0, -1 if the slot is taken or there is no free cell*/
+int add_pacman(board_t* board, int pacman_index, int points);
+
 /*Adds a pacman to the board*/
 int load_pacman(board_t* board, int points, level_info*info);
 
 /*Adds a ghost(monster) to the board*/
 int load_ghost(board_t* board, pac_ghost_info* info);
 
-/*Loads a level into board*/
+/*Locks a cell of the board for reading/writing, time spent waiting on a contended lock is
+recorded in the metrics; every access to board_pos_t fields goes through these.
+Cells share their lock with the cells n_locks apart, a thread holds one cell at a time or a pair
+through the move functions*/
+void cell_rdlock(board_t* board, int index);
+void cell_wrlock(board_t* board, int index);
+void cell_unlock(board_t* board, int index);
+
+/*Loads a level into board, seeding every entity's random moves from board->rng_seed and
+building the pursuit distance field when a ghost has an F move*/
 int load_level(board_t* board, int accumulated_points, level_info* info);
 
 /*Unloads levels loaded by load_level*/
 void unload_level(board_t * board);
 
-// DEBUG FILE
-
-/*Opens the debug file*/
-void open_debug_file(char *filename);
-
-/*Closes the debug file*/
-void close_debug_file();
+/*Hashes the cells and the entities of a board, equal boards give equal hashes*/
+unsigned long long board_state_hash(board_t* board);
 
-/*Writes to the open debug file*/
-void debug(const char * format, ...);
+// DEBUG FILE, see log.h
 
 /*Writes the board and its contents to the open debug file*/
 void print_board(board_t* board);
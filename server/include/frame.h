@@ -0,0 +1,124 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "board.h"
+#include "api.h"
+#include <pthread.h>
+
+#define MAX_SUBSCRIBERS 16
+
+#define SUB_POLICY_DROP 0   // skip frames while the subscriber's pipe is full
+#define SUB_POLICY_EVICT 1  // detach the subscriber as soon as its pipe is full
+#define SUB_POLICY_WAIT 2   // wait up to LAST_FRAME_TIMEOUT_MS for room, for a session's last frame
+
+// How long the last frame of a session, the one with victory or game over, waits for a full pipe
+#define LAST_FRAME_TIMEOUT_MS 1000
+
+// Consecutive frames a dropping subscriber may miss before it is considered gone
+#define MAX_CONSECUTIVE_DROPS 100
+
+// Boards of more cells are only sent as OP_CODE_VIEW windows, to players without a window of
+// their own as well, and spectators get a window around the first pacman alive
+#define FULL_FRAME_MAX_CELLS (256 * 256)
+#define DEFAULT_VIEW_WIDTH 80
+#define DEFAULT_VIEW_HEIGHT 24
+#define MAX_VIEW_SIDE 1024 // windows declared larger are cut to this
+
+// A board frame already serialized in the wire format of OP_CODE_BOARD
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+} frame_buffer_t;
+
+// The window of the board a client draws and the cells it has of it, so each frame only carries
+// the cells that changed or scrolled in
+typedef struct {
+    int width, height;  // declared by the client, clamped to the board when encoded
+    int x, y;           // origin of the window on the board
+    int sent_width, sent_height; // window the client has, 0 until the next keyframe
+    char *cells;        // what the client has, sent_width x sent_height
+    char *scratch;      // the window being encoded
+    size_t capacity;    // bytes of cells and of scratch
+    frame_buffer_t wire; // the last frame encoded for this window
+} view_t;
+
+typedef struct {
+    int fd;
+    int policy;
+    int dropped;            // frames dropped since it was attached
+    int consecutive_drops;  // frames dropped since the last successful write
+} subscriber_t;
+
+typedef struct {
+    subscriber_t subs[MAX_SUBSCRIBERS];
+    int n_subs;
+    int open;               // whether a session is running and accepting subscribers
+    pthread_mutex_t lock;
+} subscriber_list_t;
+
+/*Fills the session-owned frame with the current board, reusing its data buffer between ticks*/
+int process_board_to_api(board_t* game_board, int victory, int game_over, Board *board_data);
+
+/*Fills only the header of the frame, without walking the cells*/
+void process_board_header(board_t* game_board, int victory, int game_over, Board *board_data);
+
+/*Serializes board into frame once, so the same bytes can be written to every subscriber*/
+int encode_board_frame(Board *board, frame_buffer_t *frame);
+
+/*Rewrites an encoded frame of a shared board for the player of pacman_index: its points, its
+last applied input, and its pacman as 'C' while the other players' pacmans are 'c'.
+Every player's frame is patched from the same encoding, board is the frame it was encoded from*/
+void personalize_frame(Board *board, frame_buffer_t *frame, board_t *game_board, int pacman_index);
+
+/*Copies the bytes of src into dst, reusing dst's buffer
+@return 0, -1 if it could not be allocated*/
+int frame_buffer_copy(frame_buffer_t *dst, const frame_buffer_t *src);
+
+/*Frees the buffer owned by frame*/
+void frame_buffer_release(frame_buffer_t *frame);
+
+/*Sets the window a client declared, at most MAX_VIEW_SIDE each way; its next frame is a keyframe*/
+void view_resize(view_t *view, int width, int height);
+
+/*Encodes an OP_CODE_VIEW frame into view->wire: the window centred on pacman pacman_index, or on
+the first pacman alive for -1, and left where it was while that pacman is not alive. Only the
+cells that differ from what the client has are sent, unless keyframe is set or a keyframe is
+smaller; the walk is over the window only, whatever the size of the board.
+header - the frame's header from process_board_header, with that pacman's points and input
+@return 0, -1 if the frame could not be allocated*/
+int encode_view_frame(board_t *game_board, Board *header, view_t *view, int pacman_index, int keyframe);
+
+/*Frees the buffers owned by view, it is empty and has no window afterwards*/
+void view_release(view_t *view);
+
+/*Writes the whole frame to a blocking pipe, retrying short writes*/
+int write_frame(int fd, frame_buffer_t *frame);
+
+void subscribers_init(subscriber_list_t *list);
+void subscribers_destroy(subscriber_list_t *list);
+
+/*Starts accepting subscribers for a new session*/
+void subscribers_open(subscriber_list_t *list);
+
+/*Acknowledges and attaches a notification pipe opened in non-blocking mode,
+returns -1 if the list is closed or full*/
+int subscribers_add(subscriber_list_t *list, int fd, int policy);
+
+/*@return how many subscribers are attached*/
+int subscribers_count(subscriber_list_t *list);
+
+/*Writes frame to the non-blocking pipe of sub without waiting for a full pipe, applying its drop
+policy; takes no lock, sub is the caller's
+@return 1 if it got the frame, 0 if it missed it, -1 if it has to be detached*/
+int deliver_frame(subscriber_t *sub, frame_buffer_t *frame);
+
+/*Writes frame to every subscriber, applying each one's drop policy, or SUB_POLICY_WAIT to all of
+them for the last frame of a session
+@return how many subscribers got the frame, dropped is set to how many missed it*/
+int broadcast_frame(subscriber_list_t *list, frame_buffer_t *frame, int last_frame, int *dropped);
+
+/*Closes every subscriber and stops accepting new ones until the next session*/
+void subscribers_close_all(subscriber_list_t *list);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef LEADERBOARD_H
+#define LEADERBOARD_H
+
+/*
+Scores of the running games, kept ranked as they change so the top can be read in O(K log K)
+without copying or sorting every game. Finished games are appended to a history file by a
+writer thread, which also rewrites the top files when asked, so none of it runs in the accept loop.
+*/
+
+#define LEADERBOARD_TOP 5
+#define TOP5_FILE "top5.txt"
+#define HISTORY_FILE "history.log"              // one finished game per line, kept across runs
+#define HISTORY_TOP5_FILE "top5-history.txt"    // best finished games ever, same format as TOP5_FILE
+
+typedef struct {
+    int slot;
+    int score;
+} leaderboard_entry_t;
+
+/*Sets up n_slots game slots, loads the history and starts the writer thread
+@return 0 on success, -1 otherwise*/
+int leaderboard_init(int n_slots);
+
+/*Puts a slot whose session just started in the ranking, with score 0, and allocates the record
+of its game in the history*/
+void leaderboard_start(int slot);
+
+/*Moves a running slot to its new score, O(log n)*/
+void leaderboard_update(int slot, int score);
+
+/*Takes a slot out of the ranking and records its game in the history, with the seed it was played with*/
+void leaderboard_finish(int slot, int levels, int victory, unsigned long long seed);
+
+/*Copies the k best running games, best first
+@return how many were copied*/
+int leaderboard_top(leaderboard_entry_t *out, int k);
+
+/*Asks the writer thread to rewrite TOP5_FILE and HISTORY_TOP5_FILE, returns right away*/
+void leaderboard_request_dump(void);
+
+/*Writes pending history and stops the writer thread*/
+void leaderboard_shutdown(void);
+
+#endif
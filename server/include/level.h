@@ -0,0 +1,13 @@
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include "board.h"
+
+/*Parses a level file and the pacman and ghost files it names, relative to its directory*/
+level_info getLevelInfo(char *level_file);
+
+/*Parses every level file (extension starting with 'l') of a directory, one thread per file
+@return how many levels were read into level_info*/
+int read_dir(char *argv, level_info *level_info);
+
+#endif
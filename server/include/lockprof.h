@@ -0,0 +1,66 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+
+/*
+Lock contention profiler, built in with make PROFILE_LOCKS=1.
+Cell locks are profiled per level: when a level is unloaded its per-cell acquisitions and
+wait times are appended to LOCK_PROFILE_FILE as a heatmap of the board.
+The other locks of a session are profiled per call site and reported when the server exits.
+Without PROFILE_LOCKS the macros below are the plain pthread calls.
+*/
+
+#define LOCK_PROFILE_FILE "lock-profile.txt"
+#define LOCK_PROFILE_HOT_CELLS 10   // cells listed under every heatmap
+
+typedef enum {
+    LOCK_SITE_SESSION,      // result and leave_thread of a session, taken when it ends
+    LOCK_SITE_GAME_STATE,   // score and is_active of a game slot
+    LOCK_SITE_QUEUE,        // connection request queue
+    LOCK_SITES
+} lock_site_t;
+
+typedef struct {
+    unsigned long long acquisitions;
+    unsigned long long contended;   // acquisitions that had to wait
+    unsigned long long wait_us;     // total time waited
+    unsigned long long max_wait_us;
+} lock_stats_t;
+
+typedef struct lock_profile {
+    int width, height;
+    char level_name[256];
+    lock_stats_t *cells;            // row-major, like board_t.board
+} lock_profile_t;
+
+/*@return per-cell counters for a level that is being loaded, NULL if they could not be allocated*/
+lock_profile_t *lockprof_new(int width, int height, const char *level_name);
+
+/*Records one acquisition of a cell lock*/
+void lockprof_cell(lock_profile_t *profile, int index, int contended, long long wait_us);
+
+/*Appends the heatmap and hottest cells of a level to LOCK_PROFILE_FILE and frees the profile*/
+void lockprof_report_level(lock_profile_t *profile);
+
+void lockprof_rwlock_rdlock(lock_site_t site, pthread_rwlock_t *lock);
+void lockprof_rwlock_wrlock(lock_site_t site, pthread_rwlock_t *lock);
+void lockprof_mutex_lock(lock_site_t site, pthread_mutex_t *mutex);
+
+/*Appends the counters of every call site to LOCK_PROFILE_FILE*/
+void lockprof_report_sites(void);
+
+#ifdef PROFILE_LOCKS
+#define PROFILED_RDLOCK(site, lock) lockprof_rwlock_rdlock((site), (lock))
+#define PROFILED_WRLOCK(site, lock) lockprof_rwlock_wrlock((site), (lock))
+#define PROFILED_MUTEX_LOCK(site, mutex) lockprof_mutex_lock((site), (mutex))
+#define LOCKPROF_CELL(board, index, contended, wait_us) \
+    lockprof_cell((board)->lock_profile, (index), (contended), (wait_us))
+#else
+#define PROFILED_RDLOCK(site, lock) pthread_rwlock_rdlock(lock)
+#define PROFILED_WRLOCK(site, lock) pthread_rwlock_wrlock(lock)
+#define PROFILED_MUTEX_LOCK(site, mutex) pthread_mutex_lock(mutex)
+#define LOCKPROF_CELL(board, index, contended, wait_us) ((void)0)
+#endif
+
+#endif
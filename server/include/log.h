@@ -0,0 +1,46 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+Asynchronous debug log.
+Every thread formats its messages into a ring buffer of its own, without locks or system
+calls; a flusher thread drains the rings every LOG_FLUSH_INTERVAL_MS, stamps each message
+with its time and thread and writes them to the file in time order.
+When a ring is full its messages are dropped and the drop is reported in the file.
+*/
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_DEBUG 2
+#define LOG_LEVEL_TRACE 3   // per-tick, per-move and per-frame messages
+
+// Messages above this level are compiled out, build with LOG_LEVEL=3 to get the hot paths too
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_RING_SIZE (64 * 1024)   // bytes buffered per thread, a power of two
+#define LOG_MESSAGE_MAX 8192        // longer messages are truncated
+#define LOG_FLUSH_INTERVAL_MS 10
+
+/*Opens the debug file and starts the flusher thread*/
+void open_debug_file(char *filename);
+
+/*Stops the flusher thread after writing everything logged so far, and closes the debug file*/
+void close_debug_file();
+
+/*Queues a message, use the macros below so levels above LOG_LEVEL cost nothing*/
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Calls above LOG_LEVEL are still type-checked but never evaluated
+#define LOG_AT(level, ...) \
+    do { if ((level) <= LOG_LEVEL) log_write((level), __VA_ARGS__); } while (0)
+
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_trace(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+/*Writes to the open debug file*/
+#define debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+Runtime metrics for capacity planning.
+Counters and histograms are kept in per-thread shards, so recording never touches a
+lock or a cache line another thread writes; metrics_dump adds the shards up.
+*/
+
+typedef enum {
+    METRIC_FRAMES_SENT,         // frames written to players and spectators
+    METRIC_BYTES_SENT,          // bytes of those frames
+    METRIC_FRAMES_DROPPED,      // frames a spectator missed because its pipe was full
+    METRIC_SUBSCRIBERS_EVICTED, // spectators detached for being too slow
+    METRIC_SESSIONS_STARTED,
+    METRIC_SESSIONS_FINISHED,
+    METRIC_LOCK_CONTENDED,      // cell lock acquisitions that had to wait
+    METRIC_COUNTERS
+} metric_counter_t;
+
+typedef enum {
+    METRIC_TICK_US,             // time the screen thread spends producing and sending one frame
+    METRIC_ENCODE_US,           // time taken to snapshot and serialize one frame
+    METRIC_LOCK_WAIT_US,        // time spent waiting for a contended cell lock
+    METRIC_HISTOGRAMS
+} metric_histogram_t;
+
+typedef enum {
+    METRIC_QUEUE_DEPTH,         // connection requests waiting for a worker
+    METRIC_GAUGES
+} metric_gauge_t;
+
+// Log-linear buckets: values below METRIC_SUB_BUCKETS get one bucket each and every
+// power of two above is split in METRIC_SUB_BUCKETS, for a relative error under 7%
+#define METRIC_SUB_BUCKETS 16
+#define METRIC_BUCKETS (36 * METRIC_SUB_BUCKETS)
+
+typedef struct {
+    unsigned long long counts[METRIC_BUCKETS];
+    unsigned long long sum;
+} metric_hist_t;
+
+/*Counters of one game slot, only written by the thread running its session*/
+typedef struct {
+    int active;
+    unsigned long long sessions;
+    unsigned long long ticks;
+    unsigned long long frames_sent;
+    unsigned long long bytes_sent;
+    unsigned long long frames_dropped;
+} session_metrics_t;
+
+/*Allocates the per-game counters, must run before any other thread starts
+@return the counters of game slot 0, n_sessions are contiguous*/
+session_metrics_t *metrics_init(int n_sessions);
+
+void metrics_add(metric_counter_t counter, unsigned long long value);
+void metrics_observe(metric_histogram_t histogram, long long value);
+void metrics_gauge_add(metric_gauge_t gauge, long long delta);
+
+/*Adds to a counter of a session, readers may see it one update late*/
+void session_metrics_add(unsigned long long *counter, unsigned long long value);
+void session_metrics_set_active(session_metrics_t *session, int active);
+
+/*Writes every metric in Prometheus text format to path, replacing it atomically
+@return 0 on success, -1 otherwise*/
+int metrics_dump(const char *path);
+
+#endif
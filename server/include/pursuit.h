@@ -0,0 +1,41 @@
+#ifndef PURSUIT_H
+#define PURSUIT_H
+
+#include "board.h"
+
+/*
+Pursuit of the pacmans by ghosts with the F move in their .m file. A level with pursuers keeps
+one distance field to every pacman, shared by all of its ghosts, over the walls of the level,
+which never change: a pursuer steps to a neighbour one cell closer to the nearest pacman,
+whatever the number of ghosts.
+
+The field is built with a BFS when the level is loaded and repaired when the pacman steps to a
+neighbouring cell. On a grid every distance then changes by exactly one: the cells the pacman
+walked towards get one closer and every other cell gets one farther. The farther cells are
+covered by a bias added to every distance, so only the closer cells are visited.
+Ghosts and the pacman are not obstacles, a pursuer blocked by another ghost waits like any move.
+*/
+
+#define PURSUIT_UNREACHABLE 0x7FFFFFFF // distance of cells walled off from the pacman
+#define PURSUIT_MAX_BIAS (1 << 24)      // the field is rebuilt before the bias gets near overflowing
+
+typedef struct pursuit pursuit_t;
+
+/*Builds the distance field of a loaded level to a pacman standing on (x, y)
+@return the field, NULL if it could not be allocated*/
+pursuit_t *pursuit_new(board_t *board, int x, int y);
+
+void pursuit_free(pursuit_t *pursuit);
+
+/*Moves the target of the field to cell (x, y): repaired when it is next to the previous
+target, rebuilt otherwise*/
+void pursuit_target_moved(pursuit_t *pursuit, int x, int y);
+
+/*Picks the step from (x, y) towards the target, ties broken with rng
+@return 'W', 'S', 'A' or 'D', 0 if the target can not be reached from (x, y)*/
+char pursuit_direction(pursuit_t *pursuit, int x, int y, rng_t *rng);
+
+/*@return the distance from (x, y) to the target, PURSUIT_UNREACHABLE if there is no path*/
+int pursuit_distance(pursuit_t *pursuit, int x, int y);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef RAY_H
+#define RAY_H
+
+#include "board.h"
+
+/*
+Ray casts along rows and columns, for the charged ghosts: where a ray from a cell stops without
+walking and locking the cells on its way.
+Walls never move, the first wall in every direction of every cell is computed when the level is
+loaded. Entities move, every row and every column keeps a bitmap of its occupied cells, updated
+with the occupants of board_pos_t; the nearest occupant is a bit scan over width / 64 words.
+*/
+
+typedef enum {
+    RAY_EDGE,       // nothing until the edge of the board
+    RAY_WALL,       // stopped by a wall
+    RAY_OCCUPANT,   // stopped by an entity, the cell after the free ones is occupied
+} ray_stop_t;
+
+typedef struct ray_index ray_index_t;
+
+/*Builds the wall tables and the occupancy bitmaps of a loaded level from its cells
+@return the index, NULL if it could not be allocated*/
+ray_index_t *ray_index_new(board_t *board);
+
+void ray_index_free(ray_index_t *rays);
+
+/*Marks cell (x, y) as occupied or free, called with the cell's lock held so the bitmaps change
+in the same order as the occupants*/
+void ray_mark(ray_index_t *rays, int x, int y, int occupied);
+
+/*Resets the occupancy bitmaps to the occupants of the cells, after they were written directly*/
+void ray_index_sync(ray_index_t *rays, board_t *board);
+
+/*Casts a ray from (x, y), not included, in direction 'W', 'S', 'A' or 'D'
+*free_cells - how many cells the ray crosses before it stops
+@return what stopped it*/
+ray_stop_t ray_cast(ray_index_t *rays, int x, int y, char direction, int *free_cells);
+
+#endif
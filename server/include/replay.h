@@ -0,0 +1,80 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "board.h"
+#include "snapshot.h"
+
+/*
+Record and replay of sessions. With PACMAN_RECORD=<dir> in the environment every session is
+written to <dir>/game<id>-<n>.rec: its seed, the levels it played and every move in the order
+it was applied, timestamped. While a session is recorded its moves are applied one at a time,
+so the order in the file is the order the engine saw.
+
+Pacmanist --replay <level_directory> <recording> runs a recording again through the engine,
+without threads or sleeps, and checks the points and state hash of every level it reaches.
+A recording keeps the seed of the session and nothing of its random moves: the engine draws them
+from the streams of rng.h that load_level seeds from it, the replay draws the same.
+
+File format, integers little-endian and varints LEB128:
+  header      "PMRC" version:u8 seed:u64 game_id:u32
+  move        actor:u8 (0 pacman, 1 + i ghost i) dt_us:varint [command:u8 for the pacman]
+  player move REC_PLAYER_PACMAN dt_us:varint index:u8 command:u8, pacman index > 0 of a shared session
+  join        REC_PLAYER_JOIN dt_us:varint index:u8 points:varint
+  leave       REC_PLAYER_LEAVE dt_us:varint index:u8
+  restore     REC_RESTORE dt_us:varint len:varint image, a backup loaded, image as in snapshot.h
+  level start REC_LEVEL_START dt_us:varint name_len:u8 name points:varint
+  level end   REC_LEVEL_END dt_us:varint result:u8 points:varint hash:u64
+  session end REC_SESSION_END dt_us:varint points:varint victory:u8
+*/
+
+#define REPLAY_MAGIC "PMRC"
+#define REPLAY_VERSION 4
+#define REPLAY_MIN_VERSION 2 // versions before 3 have no shared sessions, before 4 no restores
+#define RECORD_FILE_BUFFER (64 * 1024)
+
+#define REC_PACMAN 0
+#define REC_LEVEL_START 0xF0
+#define REC_LEVEL_END 0xF1
+#define REC_SESSION_END 0xF2
+#define REC_PLAYER_PACMAN 0xF3
+#define REC_PLAYER_JOIN 0xF4
+#define REC_PLAYER_LEAVE 0xF5
+#define REC_RESTORE 0xF6
+
+typedef struct recorder recorder_t;
+
+/*Reads PACMAN_RECORD, before any session starts*/
+void recorder_init(void);
+
+/*Starts recording a session
+@return the recorder, NULL when recording is off or the file could not be created*/
+recorder_t *recorder_open(int game_id, uint64_t seed);
+
+void recorder_level_start(recorder_t *recorder, const char *level_name, int points);
+
+/*Records how a level ended, with the hash of the board it ended with, and writes the file out*/
+void recorder_level_end(recorder_t *recorder, board_t *board, int result);
+
+/*Records the end of the session, with the points of its last level, and closes its file*/
+void recorder_close(recorder_t *recorder, int victory);
+
+/*Writes out every recording in progress and stops it, on shutdown; the moves of the sessions
+still running wait on their recorder until the process exits*/
+void recorder_shutdown(void);
+
+/*Run move_pacman/move_ghost, recording the move when board->recorder is set*/
+int recorded_move_pacman(board_t *board, int pacman_index, command_t *command);
+int recorded_move_ghost(board_t *board, int ghost_index, command_t *command);
+
+/*Run add_pacman/kill_pacman for a player joining or leaving a shared session, recorded the same way*/
+int recorded_add_pacman(board_t *board, int pacman_index, int points);
+void recorded_remove_pacman(board_t *board, int pacman_index);
+
+/*Runs snapshot_restore, recording the image restored when board->recorder is set*/
+int recorded_restore(board_t *board, const snapshot_t *snap);
+
+/*Replays a recording with the levels of level_dir and prints how it went
+@return 0 if every level ended as recorded, 1 otherwise*/
+int replay_session(char *level_dir, const char *path);
+
+#endif
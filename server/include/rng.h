@@ -0,0 +1,63 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*
+Small, fast random number generators owned by whoever draws from them: xoshiro128** streams
+seeded through splitmix64. No state is shared, so entities moving on different threads never
+contend, and a stream only depends on its seed and on how many numbers it gave.
+*/
+
+typedef struct {
+    uint32_t s[4];
+} rng_t;
+
+/*Advances a splitmix64 state, every call gives an independent 64-bit seed*/
+static inline uint64_t rng_split(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*@return the seed of the index-th stream derived from base, e.g. the sessions of a server*/
+static inline uint64_t rng_derive(uint64_t base, uint64_t index) {
+    uint64_t state = base + index * 0x9E3779B97F4A7C15ULL;
+    return rng_split(&state);
+}
+
+static inline void rng_seed(rng_t *rng, uint64_t seed) {
+    uint64_t a = rng_split(&seed);
+    uint64_t b = rng_split(&seed);
+    rng->s[0] = (uint32_t)a;
+    rng->s[1] = (uint32_t)(a >> 32);
+    rng->s[2] = (uint32_t)b;
+    rng->s[3] = (uint32_t)(b >> 32);
+}
+
+static inline uint32_t rng_rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+/*Steps xoshiro128** once
+@return the next 32 random bits*/
+static inline uint32_t rng_next(rng_t *rng) {
+    uint32_t *s = rng->s;
+    uint32_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 11);
+    return result;
+}
+
+/*@return a number in [0, n), by multiplication instead of a division*/
+static inline uint32_t rng_below(rng_t *rng, uint32_t n) {
+    return (uint32_t)(((uint64_t)rng_next(rng) * n) >> 32);
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef SIM_H
+#define SIM_H
+
+/*
+Headless simulation: plays the levels of a directory through load_level, move_pacman and
+move_ghost tick after tick, without threads, pipes or sleeps, with the pacman following its
+.p script. One tick moves the pacman and then every ghost once, like one tempo of a session.
+
+Pacmanist --headless [-g games] [-s seed] [-t max_ticks] [-j threads] <level_directory>
+*/
+
+#define SIM_DEFAULT_MAX_TICKS 1000000  // per game, a pacman that never ends its level times out
+
+typedef enum {
+    SIM_VICTORY,
+    SIM_GAME_OVER,
+    SIM_TIMEOUT,
+} sim_outcome_t;
+
+typedef struct {
+    sim_outcome_t outcome;
+    int levels;         // levels completed
+    int points;
+    long long ticks;
+    long long moves;
+} sim_result_t;
+
+/*Runs the simulation with the arguments after --headless
+@return the process exit status*/
+int simulate_main(int argc, char **argv);
+
+#endif
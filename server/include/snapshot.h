@@ -0,0 +1,109 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "board.h"
+#include <stddef.h>
+
+/*
+Snapshots of a level being played: the dots left and what changes of every pacman and ghost
+(position, points, script cursor, random stream), without what the level file fixes.
+
+A capture does not stop the game: every change of the entities or the dots is made holding the
+board's snapshot_lock for reading, a capture takes it for writing only while it copies the
+entities and the chunks that changed. Eating a dot stamps its chunk of SNAPSHOT_CHUNK_CELLS cells
+with the board's capture epoch, so a snapshot captured again from the same level only copies the
+chunks stamped since; the first capture of a level copies the whole board without the lock.
+
+A restore runs between two ticks, with the entity threads stopped, on the level the snapshot was
+captured from; it only rewrites the chunks that changed on either side.
+
+Encoded image, integers little-endian and varints LEB128:
+  header  "PMSN" version:u8 name_len:u8 name width:varint height:varint seed:u64
+          n_pacmans:u8 n_ghosts:u8
+  entity  x:varint y:varint alive:u8 points:varint waiting:varint current_move:varint
+          charged:u8 rng:4*u32 n_moves:u8 turns_left:varint*n_moves, pacmans then ghosts
+  dots    one bit per cell, row-major, in 64-bit words
+*/
+
+#define SNAPSHOT_MAGIC "PMSN"
+#define SNAPSHOT_VERSION 1
+#define CHECKPOINT_INTERVAL_MS 5000 // between two checkpoints of a session, see checkpoint_session
+
+// What a snapshot keeps of a pacman or a ghost, the rest comes from the level
+typedef struct {
+    int pos_x, pos_y;
+    int alive, points;      // pacmans only
+    int waiting, current_move;
+    int charged;            // ghosts only
+    rng_t rng;
+    int n_moves;            // number of turns_left, the script of the entity
+    int turns_left[MAX_MOVES];
+} entity_state_t;
+
+typedef struct {
+    char level_name[256];       // empty while nothing was captured
+    int width, height;
+    uint64_t rng_seed;          // seed of the levels after this one
+    unsigned long long level_serial; // level load it was captured from, see snapshot_capture
+    unsigned int epoch;         // capture epoch of that level it was taken in
+    int n_pacmans, n_ghosts;
+    entity_state_t pacmans[MAX_PACMANS];
+    entity_state_t ghosts[MAX_GHOSTS];
+    uint64_t *dots;             // bit i set when cell i has a dot
+    int n_words;
+    int capacity;               // words dots has room for, grown with realloc when the level needs more
+    long long captured_us;
+} snapshot_t;
+
+/*Copies the state of a level being played into snap, only the chunks that changed since snap
+was last captured from the same level load
+@return 0, -1 if the dots could not be allocated*/
+int snapshot_capture(board_t *board, snapshot_t *snap);
+
+/*Puts a loaded level back in the state of snap, the entity threads stopped
+@return 0, -1 if snap was captured from another level or puts an entity off the board*/
+int snapshot_restore(board_t *board, const snapshot_t *snap);
+
+/*Frees the dots of snap and empties it*/
+void snapshot_release(snapshot_t *snap);
+
+/*@return the size of the encoded image of snap*/
+size_t snapshot_encoded_size(const snapshot_t *snap);
+
+/*Encodes snap into data, of at least snapshot_encoded_size bytes
+@return the length of the image*/
+size_t snapshot_encode(const snapshot_t *snap, unsigned char *data);
+
+/*Decodes an image made by snapshot_encode into snap, whose dots are reused
+@return 0, -1 if the image is corrupted or puts an entity off its board*/
+int snapshot_decode(snapshot_t *snap, const unsigned char *data, size_t len);
+
+/*Writes the image of snap to path, through a temporary file renamed over it
+@return 0, -1 on error*/
+int snapshot_save(const snapshot_t *snap, const char *path);
+
+/*Reads an image written by snapshot_save into snap, whose dots are reused
+@return 0, -1 if there is no such file or it is corrupted*/
+int snapshot_load(snapshot_t *snap, const char *path);
+
+/*Reads PACMAN_CHECKPOINT and starts the thread that writes the checkpoints, before any session
+starts*/
+void checkpoint_init(void);
+
+/*With PACMAN_CHECKPOINT=<dir> in the environment, captures the level into snap at most once every
+CHECKPOINT_INTERVAL_MS and hands its image to the writer thread, which writes it to
+<dir>/game<id>.snap; only the capture runs in the caller's tick*/
+void checkpoint_session(board_t *board, snapshot_t *snap);
+
+/*Reads into snap the checkpoint a session of game slot game_id left when the server stopped
+before it ended, for the next session of that slot to go on from it
+@return 0, -1 if checkpoints are off or there is none*/
+int checkpoint_load(int game_id, snapshot_t *snap);
+
+/*Removes the checkpoint of game slot game_id, its session ended, after any write of it queued before*/
+void checkpoint_clear(int game_id);
+
+/*Writes the checkpoints still queued and stops the writer thread, on shutdown*/
+void checkpoint_shutdown(void);
+
+#endif
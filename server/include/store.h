@@ -0,0 +1,82 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include "board.h"
+#include "snapshot.h"
+
+/*
+Sessions that outlive the server. With PACMAN_SESSION_STORE=<file> in the environment, the state
+of every game slot lives in that file, mapped in memory, one region per slot: the seed and tick of
+its session, the pipes, points and window of its players, and two snapshots of the level being
+played. Every STORE_CAPTURE_TICKS ticks, and on the first tick of a level, the level is captured
+into the snapshot that is not committed, which is then committed, so a server killed in the middle
+of a capture leaves the other one whole; a capture only copies what changed since that snapshot
+was last taken, see snapshot.h.
+
+A server started on the same file, with as many games and no bigger levels, re-attaches the
+sessions it finds there: the worker of each slot loads the level of its committed snapshot,
+restores it and reopens the pipes of the players whose clients wait for the server to come back,
+without replaying anything: the session goes back at most STORE_CAPTURE_TICKS ticks. Players that are not back within REATTACH_TIMEOUT_MS leave the session.
+*/
+
+#define STORE_MAGIC "PMST"
+#define STORE_VERSION 1
+#define REATTACH_TIMEOUT_MS 10000
+#define REATTACH_POLL_MS 50
+#define STORE_CAPTURE_TICKS 10 // between two captures of a level into the store
+
+typedef struct {
+    int connected;                          // the player is in the session
+    char req_pipe[MAX_PIPE_PATH_LENGTH];
+    char notif_pipe[MAX_PIPE_PATH_LENGTH];
+    int points;                             // carried from level to level, see player_t
+    int view_width, view_height;            // window declared with OP_CODE_VIEWPORT
+} stored_player_t;
+
+// Region of a game slot; players are written under the players_lock of the slot, the rest by
+// its worker and its screen thread
+typedef struct {
+    int active;                 // a session runs on the slot
+    uint64_t seed;              // seed the session started with
+    int tick;                   // tick of the committed snapshot
+    stored_player_t players[MAX_PACMANS];
+    int committed;              // snapshot that is whole, -1 before the first capture
+    snapshot_t images[2];       // their dots are in the file after the region, see store_init
+} session_region_t;
+
+/*Reads PACMAN_SESSION_STORE and maps the store with a region for each of max_games slots, big
+enough for the largest of the levels; the regions of a store left by a server with the same
+geometry are kept, a store of another geometry is moved to <file>.old and reported on stderr
+@return 0, -1 if the store could not be mapped*/
+int store_init(int max_games, level_info *levels, int n_levels);
+
+/*@return the region of game slot game_id (1-based), NULL when the store is off*/
+session_region_t *store_region(int game_id);
+
+/*@return whether region holds a session the last server left running, with a committed snapshot*/
+int store_resumable(session_region_t *region);
+
+/*@return the committed snapshot of a resumable region*/
+const snapshot_t *store_snapshot(session_region_t *region);
+
+/*Marks a session as running on the slot, or as over; nothing when region is NULL like the
+functions below*/
+void store_session_start(session_region_t *region, uint64_t seed);
+void store_session_end(session_region_t *region);
+
+/*Keeps what a server needs to reopen the pipes of player index and to give it back its window
+and points*/
+void store_player(session_region_t *region, int index, const char *req_pipe, const char *notif_pipe);
+void store_player_gone(session_region_t *region, int index);
+void store_player_view(session_region_t *region, int index, int view_width, int view_height);
+void store_player_points(session_region_t *region, int index, int points);
+
+/*Captures the level being played into the snapshot not committed and commits it, with the tick
+of the frame just sent, if STORE_CAPTURE_TICKS ticks went by since the last capture or the level
+is not the one of the committed snapshot*/
+void store_tick(session_region_t *region, board_t *board, int tick);
+
+/*Writes the store back to its file, on shutdown*/
+void store_sync(void);
+
+#endif
@@ -4,24 +4,49 @@
 #include "board.h"
 #include <pthread.h>
 #include "api.h"
+#include "frame.h"
+#include "metrics.h"
+#include "snapshot.h"
+#include "store.h"
 #include <semaphore.h>
 
-typedef struct {
-    char path[1024];
-    level_info *level_info;
-} thread_args_t;
-
 typedef struct {
     board_t *game_board;
     int ghost_index;
     int *leave_thread;
 } ghost_thread_args_t;
 
+// A client controlling one of the pacmans of a session, player i controls pacman i
+typedef struct {
+    int connected;  // the slot is taken and its pipes are open
+    int reserved;   // taken by a client joining, its pipes are being opened
+    int left;       // quit, disconnected or too slow to read, its pipes are closed when the level ends
+    int on_board;   // its pacman is on the current level and its pacman thread runs
+    int req_fd;
+    int notif_fd;   // non-blocking, a full pipe makes the player miss frames, see deliver_frame
+    int consecutive_drops; // frames it missed in a row
+    int points;     // carried from level to level, like the session's accumulated points
+    pthread_t tid;  // its pacman thread on the current level
+    int view_width, view_height; // window declared with OP_CODE_VIEWPORT, 0 if none
+    view_t view;    // what its client has of that window, written by the thread sending the frames
+    frame_buffer_t frame; // its whole frame of the tick, written out once players_lock is released
+} player_t;
+
 typedef struct {
-    int score;
     int client_id;  
     int is_active;
     pthread_rwlock_t lock;
+    subscriber_list_t spectators; // extra notification pipes watching this game
+    view_t spectator_view;        // window the spectators get of a board too big for whole frames
+    session_metrics_t *metrics;   // counters of this game slot, exported by metrics_dump
+    player_t players[MAX_PACMANS]; // players[0] is the client that started the session
+    int accepting_players;         // whether a session is running that others can join
+    int session_id;                // counts the sessions of the slot, a reservation only holds in its own
+    pthread_mutex_t players_lock;  // guards players and accepting_players
+    snapshot_t backup;             // captured by a player's G, loaded back by an L, see snapshot.h
+    pthread_mutex_t backup_lock;   // guards backup
+    snapshot_t checkpoint;         // last checkpoint of the session, only touched by its screen thread
+    session_region_t *region;      // the slot's region of the session store, NULL when it is off
 } game_state_t;
 
 typedef struct {
@@ -31,6 +56,7 @@ typedef struct {
     pthread_rwlock_t *lock;
     int req_pipe_fd;
     game_state_t *game_state;
+    int pacman_index;
 } pacman_thread_args_t;
 
 typedef struct {
@@ -42,10 +68,21 @@ typedef struct {
     board_t *game_board;
     int *leave_thread;
     int *victory;
-    int notif_fd;
     int *game_over;
+    Board *frame; // session-owned frame buffer, reused every tick
+    frame_buffer_t *wire; // frame encoded once per tick for every pipe
+    game_state_t *game_state; // its players and spectators get the frames
+    pacman_thread_args_t *pacman_args; // one per player, for the players that join during the level
+    int *tick; // session tick counter, kept across levels
+    session_metrics_t *metrics;
 } screen_thread_args_t;
 
+typedef struct {
+    game_state_t *games;
+    int max_games;
+    connect_request_t request;
+} join_thread_args_t;
+
 typedef struct {
     level_info *level_info;
     int n_levels;
@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+Span tracing in the Chrome trace-event format (load trace.json in chrome://tracing or Perfetto).
+Built in with make TRACE=1, otherwise every macro below compiles to nothing.
+Each thread appends spans to a buffer of its own, taken over once it exits by the thread of the
+same role in the next level; trace_export writes them all at shutdown, one process per game and
+one lane per role.
+
+What is recorded is chosen with environment variables, the server's arguments being fixed:
+  PACMAN_TRACE_SESSION=<game>       only that game slot (1-based), every game by default
+  PACMAN_TRACE_WINDOW=<from>:<to>   only spans inside that window, in seconds since start
+*/
+
+#define TRACE_FILE "trace.json"
+#define TRACE_CHUNK_EVENTS 4096            // events allocated at once per thread
+#define TRACE_MAX_THREAD_EVENTS (1 << 18)  // later events of a lane are dropped
+
+/*Reads the environment and starts the trace clock, before any other thread starts*/
+void trace_init(void);
+
+/*Names the calling thread in the trace, index distinguishes threads with the same role
+(-1 for none); game_id selects the process its spans are grouped under*/
+void trace_thread(const char *role, int index, int game_id);
+
+/*Records a span that started at start_us and ends now*/
+void trace_span(const char *name, long long start_us);
+
+/*@return when a span starts, 0 if the calling thread is not being traced*/
+long long trace_begin(void);
+
+/*Writes every recorded span to TRACE_FILE*/
+void trace_export(void);
+
+#ifdef TRACE
+#define TRACE_INIT() trace_init()
+#define TRACE_THREAD(role, index, game_id) trace_thread((role), (index), (game_id))
+#define TRACE_BEGIN(span) long long span = trace_begin()
+#define TRACE_END(span, name) do { if (span) trace_span((name), span); } while (0)
+#define TRACE_EXPORT() trace_export()
+#else
+#define TRACE_INIT() ((void)0)
+#define TRACE_THREAD(role, index, game_id) ((void)0)
+#define TRACE_BEGIN(span) ((void)0)
+#define TRACE_END(span, name) ((void)0)
+#define TRACE_EXPORT() ((void)0)
+#endif
+
+#endif
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 
 int create_and_open_reg_fifo(const char *path) {
     struct stat st;
@@ -25,13 +26,6 @@ int create_and_open_reg_fifo(const char *path) {
         }
     }
 
-    int dummy_fd = open(path, O_WRONLY | O_NONBLOCK);
-    if (dummy_fd < 0) {
-        if (errno != ENXIO) {
-            debug("Error opening FIFO for writing: %s\n", strerror(errno));
-        }
-    }
-
     int reg_fd = open(path, O_RDONLY);
     if (reg_fd < 0) {
         if (errno == EINTR) {
@@ -41,45 +35,96 @@ int create_and_open_reg_fifo(const char *path) {
         return -1;
     }
 
-    
+    // Keep a writer open so read() never sees EOF when the last client closes the FIFO
+    int dummy_fd = open(path, O_WRONLY | O_NONBLOCK);
+    if (dummy_fd < 0) {
+        debug("Error opening FIFO for writing: %s\n", strerror(errno));
+    }
+
     return reg_fd;
 }
-int read_connect_request(int req_fd, connect_request_t *request) {
-    char op;
-    if (read(req_fd, &op, 1)<0){
-        if (errno != EINTR) debug("Error reading from FIFO: %s\n", strerror(errno));
-        return -1;
-    }
-    if (read(req_fd, &request->rep_pipe, MAX_PIPE_PATH_LENGTH)<0){
-        if (errno != EINTR) debug("Error reading from FIFO: %s\n", strerror(errno));
-        return -1;
+
+void reg_reader_init(reg_reader_t *reader) {
+    reader->len = 0;
+}
+
+// Helper private function to check a path field is terminated and not empty
+static int valid_pipe_path(const char *path) {
+    return path[0] != '\0' && memchr(path, '\0', MAX_PIPE_PATH_LENGTH) != NULL;
+}
+
+int read_connect_requests(int req_fd, reg_reader_t *reader, connect_request_t *requests, int max_requests) {
+    size_t space = sizeof(reader->buffer) - reader->len;
+    if ((size_t)max_requests < REG_BATCH_REQUESTS) {
+        // Do not pull more records than the caller can take, they would wait until the next read
+        size_t limit = (size_t)max_requests * CONNECT_SEEDED_REQUEST_SIZE;
+        space = limit > reader->len ? limit - reader->len : 0;
     }
-    if (read(req_fd, &request->notif_pipe, MAX_PIPE_PATH_LENGTH)<0){
-        if (errno != EINTR) debug("Error reading from FIFO: %s\n", strerror(errno));
-        return -1;
+
+    if (space > 0) {
+        ssize_t bytes_read = read(req_fd, reader->buffer + reader->len, space);
+        if (bytes_read < 0) {
+            if (errno != EINTR) debug("Error reading from FIFO: %s\n", strerror(errno));
+            return -1;
+        }
+        reader->len += (size_t)bytes_read;
     }
-    if (op != OP_CODE_CONNECT) {
-        debug("Invalid operation code: %d\n", op);
-        return -1;
+
+    int n_requests = 0;
+    size_t offset = 0;
+    while (reader->len - offset >= CONNECT_REQUEST_SIZE && n_requests < max_requests) {
+        const char *record = reader->buffer + offset;
+        if (record[0] != OP_CODE_CONNECT && record[0] != OP_CODE_SPECTATE && record[0] != OP_CODE_CONNECT_SEEDED &&
+            record[0] != OP_CODE_JOIN) {
+            // Lost the record boundary, resynchronize on the next byte
+            debug("Invalid operation code: %d\n", record[0]);
+            offset++;
+            continue;
+        }
+        size_t record_size = record[0] == OP_CODE_CONNECT_SEEDED ? CONNECT_SEEDED_REQUEST_SIZE
+                           : record[0] == OP_CODE_JOIN ? JOIN_REQUEST_SIZE : CONNECT_REQUEST_SIZE;
+        if (reader->len - offset < record_size) {
+            break;
+        }
+        connect_request_t *request = &requests[n_requests];
+        memcpy(request->rep_pipe, record + 1, MAX_PIPE_PATH_LENGTH);
+        memcpy(request->notif_pipe, record + 1 + MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
+        request->seeded = record[0] == OP_CODE_CONNECT_SEEDED;
+        request->seed = 0;
+        if (request->seeded) {
+            memcpy(&request->seed, record + CONNECT_REQUEST_SIZE, sizeof(request->seed));
+        }
+        request->game_id = 0;
+        if (record[0] == OP_CODE_JOIN) {
+            memcpy(&request->game_id, record + CONNECT_REQUEST_SIZE, sizeof(request->game_id));
+        }
+        offset += record_size;
+
+        if (!valid_pipe_path(request->rep_pipe) || !valid_pipe_path(request->notif_pipe)) {
+            debug("Discarding connect request with malformed pipe paths\n");
+            continue;
+        }
+        request->op_code = record[0];
+        n_requests++;
     }
-    request->op_code = op;
-    return 1;
+
+    // Keep the partial record for the next read
+    memmove(reader->buffer, reader->buffer + offset, reader->len - offset);
+    reader->len -= offset;
+    return n_requests;
 }
 
 int open_client_pipes(const char *rep_pipe_path, const char *notif_pipe_path, int *rep_fd, int *notif_fd) {
     
-    int n_fd = open(notif_pipe_path, O_RDWR);
+    // The client opens its end before it registers. Write-only, a client that exits gives EPIPE
+    // instead of a pipe that silently fills, and frames are written without waiting, a client
+    // that stops reading misses them
+    int n_fd = open(notif_pipe_path, O_WRONLY | O_NONBLOCK);
     if (n_fd < 0) { //esta a entrar aqui dentro
         debug("Error opening notification pipe: %s\n", strerror(errno));
         return -1;
     }
 
-    int r_fd = open(rep_pipe_path, O_RDONLY | O_NONBLOCK);
-    if (r_fd < 0) {
-        debug("Error opening reply pipe: %s\n", strerror(errno));
-        close(n_fd);
-        return -1;
-    }
     char response[2] = {OP_CODE_CONNECT, 0};
     
     ssize_t bytes_written = write(n_fd, response, sizeof(response));
@@ -87,7 +132,15 @@ int open_client_pipes(const char *rep_pipe_path, const char *notif_pipe_path, in
     if (bytes_written != sizeof(response)) {
         debug("Error writing to notification pipe: %s\n", strerror(errno));
         close(n_fd);
-        close(r_fd);
+        return -1;
+    }
+
+    // Not waiting for the client to open its end, a client that dies first would hang the
+    // caller: get_input_non_blocking does not take a pipe never opened for the end of the game
+    int r_fd = open(rep_pipe_path, O_RDONLY | O_NONBLOCK);
+    if (r_fd < 0) {
+        debug("Error opening reply pipe: %s\n", strerror(errno));
+        close(n_fd);
         return -1;
     }
 
@@ -97,9 +150,19 @@ int open_client_pipes(const char *rep_pipe_path, const char *notif_pipe_path, in
     return 0;
 }
 
-char get_input_non_blocking(int req_pipe_fd) {
+int client_listening(const char *notif_pipe_path) {
+    // Opening a FIFO to write without blocking fails when nobody reads it
+    return open(notif_pipe_path, O_WRONLY | O_NONBLOCK);
+}
+
+char get_input_non_blocking(int req_pipe_fd, play_request_t *play) {
+    // Until the client opens its end a read sees end of file; poll only reports the end of file
+    // of a pipe a writer was attached to and left
+    struct pollfd pfd = {.fd = req_pipe_fd, .events = POLLIN};
+    if (poll(&pfd, 1, 0) <= 0) {
+        return '\0';
+    }
     char op;
-    char mov = '\0';
     ssize_t bytes_read = read(req_pipe_fd, &op, 1);
 
     if (bytes_read <= 0) {
@@ -108,11 +171,27 @@ char get_input_non_blocking(int req_pipe_fd) {
     }
 
     if (op == OP_CODE_PLAY) {
-        bytes_read = read(req_pipe_fd, &mov, 1);
-        if (bytes_read > 0) {
-            return mov;
+        // The client writes the whole message at once, so the rest is already in the pipe
+        char body[1 + sizeof(int) + sizeof(long long)];
+        bytes_read = read(req_pipe_fd, body, sizeof(body));
+        if (bytes_read != (ssize_t)sizeof(body)) {
+            debug("Truncated play request\n");
+            return '\0';
         }
-        return '\0'; 
+        play->command = body[0];
+        memcpy(&play->seq, body + 1, sizeof(int));
+        memcpy(&play->client_time_us, body + 1 + sizeof(int), sizeof(long long));
+        return play->command;
+    } else if (op == OP_CODE_VIEWPORT) {
+        int size[2];
+        bytes_read = read(req_pipe_fd, size, sizeof(size));
+        if (bytes_read != (ssize_t)sizeof(size) || size[0] <= 0 || size[1] <= 0) {
+            debug("Invalid viewport request\n");
+            return '\0';
+        }
+        play->view_width = size[0];
+        play->view_height = size[1];
+        return 'V';
     } else if (op == OP_CODE_DISCONNECT) {
         debug("Client requested disconnect\n");
         return 'Q';
@@ -123,41 +202,9 @@ char get_input_non_blocking(int req_pipe_fd) {
     return '\0';
 }
 
-int writeBoardChanges(int notif_pipe_fd, Board board){
-    char op = OP_CODE_BOARD;
-    if (write(notif_pipe_fd, &op, 1)<0){
-        debug("Error writing from notif pipe: %s\n", strerror(errno));
-        return -1;
-    }
-    if (write(notif_pipe_fd, &board.width, sizeof(int))<0){
-        debug("Error writing from notif pipe: %s\n", strerror(errno));
-        return -1;
-    }
-    if (write(notif_pipe_fd, &board.height, sizeof(int))<0){
-        debug("Error writing from notif pipe: %s\n", strerror(errno));
-        return -1;
-    }
-    if (write(notif_pipe_fd, &board.tempo, sizeof(int))<0){
-        debug("Error writing from notif pipe: %s\n", strerror(errno));
-        return -1; 
-    }
-    if (write(notif_pipe_fd, &board.victory, sizeof(int))<0){
-        debug("Error writing from notif pipe: %s\n", strerror(errno));
-        return -1;
-    }
-    if (write(notif_pipe_fd, &board.game_over, sizeof(int))<0){
-        debug("Error writing from notif pipe: %s\n", strerror(errno));
-        return -1;
-    }
-    if (write(notif_pipe_fd, &board.accumulated_points, sizeof(int))<0){
-        debug("Error writing from notif pipe: %s\n", strerror(errno));
-        return -1;
-    }
-    if (write(notif_pipe_fd, board.data, board.height*board.width)<0){
-        debug("Error writing from notif pipe: %s\n", strerror(errno));
-        return -1;
-    }
-    return 0;
+void wait_for_input(int req_pipe_fd, int timeout_ms) {
+    struct pollfd pfd = {.fd = req_pipe_fd, .events = POLLIN};
+    poll(&pfd, 1, timeout_ms);
 }
 
 void send_error_response(int notif_pipe_fd) {
@@ -172,3 +219,24 @@ void send_error_response(int notif_pipe_fd) {
         return;
     }
 }
+
+int board_data_reserve(Board *board, int width, int height) {
+    size_t needed = (size_t)width * (size_t)height + 1;
+    if (board->data != NULL && board->capacity >= needed) {
+        return 0;
+    }
+    char *data = realloc(board->data, needed);
+    if (data == NULL) {
+        debug("Error allocating frame buffer of %zu bytes\n", needed);
+        return -1;
+    }
+    board->data = data;
+    board->capacity = needed;
+    return 0;
+}
+
+void board_data_release(Board *board) {
+    free(board->data);
+    board->data = NULL;
+    board->capacity = 0;
+}
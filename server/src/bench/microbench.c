@@ -0,0 +1,416 @@
+#include "board.h"
+#include "level.h"
+#include "frame.h"
+#include "api.h"
+#include "pursuit.h"
+#include "ray.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+/*
+Microbenchmarks of the engine hot paths, run in isolation on levels loaded with load_level:
+moves, pursuit, frame building and frame writing, for every level of a directory so board sizes and
+ghost counts can be compared. Results are written as JSON and can be compared with a baseline.
+
+Usage: microbench [-l level_dir] [-t ms_per_benchmark] [-f name_filter] [-o results.json] [-b baseline.json]
+*/
+
+#define DEFAULT_LEVEL_DIR "bench/levels"
+#define BATCH_OPS 64            // operations timed together, the board is restored between batches
+#define MIN_BATCHES 16
+#define N_DIRECTIONS 1024       // fixed pseudo-random directions, the same in every run
+#define DIRECTION_SEED 12345u
+#define REGRESSION_PERCENT 10.0 // slower than the baseline by more than this is flagged
+
+typedef struct {
+    board_t board;
+    board_pos_t *initial;       // cells as loaded, restored after every batch
+    pacman_t *initial_pacmans;
+    ghost_t *initial_ghosts;
+    pursuit_t *pursuit;         // distance field of the level, only on the board during the pursuit benchmarks
+    Board frame;
+    frame_buffer_t wire;
+    int pipe_fd;                // write end of a pipe drained by another thread
+    char directions[N_DIRECTIONS];
+} bench_ctx_t;
+
+/*Runs operation i of a benchmark
+@return non-zero when the board can not go on without being restored*/
+typedef int (*bench_op_t)(bench_ctx_t *ctx, int i);
+
+typedef struct {
+    const char *name;
+    bench_op_t op;
+    int needs_ghosts;
+} benchmark_t;
+
+typedef struct {
+    long long ops;
+    double ns_per_op;
+    double best_ns_per_op;      // fastest batch, the least disturbed by the rest of the machine
+} bench_result_t;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int op_move_pacman(bench_ctx_t *ctx, int i) {
+    command_t command = {ctx->directions[i % N_DIRECTIONS], 1, 1};
+    int result = move_pacman(&ctx->board, 0, &command);
+    return result == DEAD_PACMAN || result == REACHED_PORTAL;
+}
+
+static int op_move_ghost(bench_ctx_t *ctx, int i) {
+    command_t command = {ctx->directions[i % N_DIRECTIONS], 1, 1};
+    return move_ghost(&ctx->board, i % ctx->board.n_ghosts, &command) == DEAD_PACMAN;
+}
+
+static int op_move_ghost_charged(bench_ctx_t *ctx, int i) {
+    char direction = ctx->directions[i % N_DIRECTIONS];
+    return move_ghost_charged(&ctx->board, i % ctx->board.n_ghosts, direction) == DEAD_PACMAN;
+}
+
+static int op_move_pacman_pursued(bench_ctx_t *ctx, int i) {
+    ctx->board.pursuit[0] = ctx->pursuit;
+    int stop = op_move_pacman(ctx, i);
+    ctx->board.pursuit[0] = NULL;
+    return stop;
+}
+
+static int op_move_ghost_pursuit(bench_ctx_t *ctx, int i) {
+    command_t command = {'F', 1, 1};
+    ctx->board.pursuit[0] = ctx->pursuit;
+    int result = move_ghost(&ctx->board, i % ctx->board.n_ghosts, &command);
+    ctx->board.pursuit[0] = NULL;
+    return result == DEAD_PACMAN;
+}
+
+static int op_process_board_to_api(bench_ctx_t *ctx, int i) {
+    (void)i;
+    process_board_to_api(&ctx->board, 0, 0, &ctx->frame);
+    return 0;
+}
+
+static int op_encode_board_frame(bench_ctx_t *ctx, int i) {
+    (void)i;
+    encode_board_frame(&ctx->frame, &ctx->wire);
+    return 0;
+}
+
+static int op_write_frame(bench_ctx_t *ctx, int i) {
+    (void)i;
+    write_frame(ctx->pipe_fd, &ctx->wire);
+    return 0;
+}
+
+static const benchmark_t benchmarks[] = {
+    {"move_pacman", op_move_pacman, 0},
+    {"move_ghost", op_move_ghost, 1},
+    {"move_ghost_charged", op_move_ghost_charged, 1},
+    {"move_pacman_pursued", op_move_pacman_pursued, 0},
+    {"move_ghost_pursuit", op_move_ghost_pursuit, 1},
+    {"process_board_to_api", op_process_board_to_api, 0},
+    {"encode_board_frame", op_encode_board_frame, 0},
+    {"write_frame", op_write_frame, 0},
+};
+
+#define N_BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// Helper private function that puts the board back as it was loaded, every move starts
+// from the same positions
+static void restore_board(bench_ctx_t *ctx) {
+    board_t *board = &ctx->board;
+    for (int i = 0; i < board->width * board->height; i++) {
+        board->board[i].content = ctx->initial[i].content;
+        board->board[i].occupant = ctx->initial[i].occupant;
+        board->board[i].has_dot = ctx->initial[i].has_dot;
+        board->board[i].has_portal = ctx->initial[i].has_portal;
+    }
+    memcpy(board->pacmans, ctx->initial_pacmans, board->n_pacmans * sizeof(pacman_t));
+    memcpy(board->ghosts, ctx->initial_ghosts, board->n_ghosts * sizeof(ghost_t));
+    ray_index_sync(board->rays, board);
+    pursuit_target_moved(ctx->pursuit, board->pacmans[0].pos_x, board->pacmans[0].pos_y);
+}
+
+static int bench_ctx_init(bench_ctx_t *ctx, level_info *info, int pipe_fd) {
+    memset(ctx, 0, sizeof(*ctx));
+    if (load_level(&ctx->board, 0, info) != 0) {
+        return -1;
+    }
+    board_t *board = &ctx->board;
+    // Every call moves: no waiting between moves and no charge left from the level files
+    board->pacmans[0].passo = 0;
+    for (int i = 0; i < board->n_ghosts; i++) {
+        board->ghosts[i].passo = 0;
+        board->ghosts[i].charged = 0;
+    }
+    int n_cells = board->width * board->height;
+    ctx->initial = malloc(n_cells * sizeof(board_pos_t));
+    ctx->initial_pacmans = malloc(board->n_pacmans * sizeof(pacman_t));
+    ctx->initial_ghosts = malloc((board->n_ghosts > 0 ? board->n_ghosts : 1) * sizeof(ghost_t));
+    if (ctx->initial == NULL || ctx->initial_pacmans == NULL || ctx->initial_ghosts == NULL) {
+        return -1;
+    }
+    memcpy(ctx->initial, board->board, n_cells * sizeof(board_pos_t));
+    memcpy(ctx->initial_pacmans, board->pacmans, board->n_pacmans * sizeof(pacman_t));
+    memcpy(ctx->initial_ghosts, board->ghosts, board->n_ghosts * sizeof(ghost_t));
+    // Built whether the level pursues or not, the other benchmarks run without it
+    ctx->pursuit = board->pursuit[0] != NULL ? board->pursuit[0]
+                 : pursuit_new(board, board->pacmans[0].pos_x, board->pacmans[0].pos_y);
+    board->pursuit[0] = NULL;
+    if (ctx->pursuit == NULL) {
+        return -1;
+    }
+
+    unsigned int seed = DIRECTION_SEED;
+    for (int i = 0; i < N_DIRECTIONS; i++) {
+        ctx->directions[i] = "WASD"[rand_r(&seed) % 4];
+    }
+    // Frames to write are built once, the write benchmarks only time the writing
+    process_board_to_api(board, 0, 0, &ctx->frame);
+    encode_board_frame(&ctx->frame, &ctx->wire);
+    ctx->pipe_fd = pipe_fd;
+    return 0;
+}
+
+static void bench_ctx_destroy(bench_ctx_t *ctx) {
+    free(ctx->initial);
+    free(ctx->initial_pacmans);
+    free(ctx->initial_ghosts);
+    pursuit_free(ctx->pursuit);
+    free(ctx->frame.data);
+    frame_buffer_release(&ctx->wire);
+    unload_level(&ctx->board);
+}
+
+static bench_result_t run_benchmark(bench_ctx_t *ctx, bench_op_t op, long long budget_ns) {
+    bench_result_t result = {0, 0, 0};
+    long long total_ns = 0;
+    double best = -1;
+    int batches = 0;
+    // The first batch warms the caches up and is not counted
+    for (int i = 0; i < BATCH_OPS && !op(ctx, i); i++) {
+    }
+    restore_board(ctx);
+
+    long long deadline = now_ns() + budget_ns;
+    while (batches < MIN_BATCHES || now_ns() < deadline) {
+        int n = 0;
+        int stop = 0;
+        long long start = now_ns();
+        while (n < BATCH_OPS && !stop) {
+            stop = op(ctx, (int)((result.ops + n) % INT_MAX));
+            n++;
+        }
+        long long elapsed = now_ns() - start;
+        restore_board(ctx);
+
+        total_ns += elapsed;
+        result.ops += n;
+        double per_op = (double)elapsed / n;
+        if (best < 0 || per_op < best) best = per_op;
+        batches++;
+    }
+    result.ns_per_op = (double)total_ns / result.ops;
+    result.best_ns_per_op = best;
+    return result;
+}
+
+// Reads everything written to the pipe, so writes never block on a full pipe
+static void *drain_thread(void *arg) {
+    int fd = *(int *)arg;
+    char buffer[65536];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+    return NULL;
+}
+
+// Helper private function that orders levels by board size, then by name
+static int compare_levels(const void *a, const void *b) {
+    const level_info *la = a;
+    const level_info *lb = b;
+    int area_a = la->width * la->height;
+    int area_b = lb->width * lb->height;
+    if (area_a != area_b) return area_a < area_b ? -1 : 1;
+    return strcmp(la->file_name, lb->file_name);
+}
+
+typedef struct {
+    char name[64];
+    char level[MAX_FILENAME];
+    double ns_per_op;
+} baseline_entry_t;
+
+// Helper private function that reads the results of a previous run, one benchmark per line
+static int load_baseline(const char *path, baseline_entry_t **entries) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    int n = 0;
+    int capacity = 64;
+    *entries = malloc(capacity * sizeof(baseline_entry_t));
+    char line[1024];
+    while (*entries != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        char *name = strstr(line, "\"name\": \"");
+        char *level = strstr(line, "\"level\": \"");
+        char *ns = strstr(line, "\"ns_per_op\": ");
+        if (name == NULL || level == NULL || ns == NULL) {
+            continue;
+        }
+        if (n == capacity) {
+            capacity *= 2;
+            baseline_entry_t *grown = realloc(*entries, capacity * sizeof(baseline_entry_t));
+            if (grown == NULL) break;
+            *entries = grown;
+        }
+        baseline_entry_t *entry = &(*entries)[n];
+        if (sscanf(name, "\"name\": \"%63[^\"]\"", entry->name) == 1 &&
+            sscanf(level, "\"level\": \"%255[^\"]\"", entry->level) == 1 &&
+            sscanf(ns, "\"ns_per_op\": %lf", &entry->ns_per_op) == 1) {
+            n++;
+        }
+    }
+    fclose(fp);
+    return *entries != NULL ? n : -1;
+}
+
+static const baseline_entry_t *find_baseline(const baseline_entry_t *entries, int n, const char *name, const char *level) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(entries[i].name, name) == 0 && strcmp(entries[i].level, level) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-l level_dir] [-t ms_per_benchmark] [-f name_filter] [-o results.json] [-b baseline.json]\n",
+        name);
+}
+
+int main(int argc, char *argv[]) {
+    char *level_dir = DEFAULT_LEVEL_DIR;
+    int budget_ms = 200;
+    const char *filter = NULL;
+    const char *output = NULL;
+    const char *baseline_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:t:f:o:b:")) != -1) {
+        switch (opt) {
+            case 'l': level_dir = optarg; break;
+            case 't': budget_ms = atoi(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'o': output = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (budget_ms <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    level_info *levels = calloc(MAX_LEVELS, sizeof(level_info));
+    if (levels == NULL) {
+        perror("microbench: calloc");
+        return 1;
+    }
+    int n_levels = read_dir(level_dir, levels);
+    if (n_levels <= 0) {
+        fprintf(stderr, "microbench: no levels in %s\n", level_dir);
+        return 1;
+    }
+    qsort(levels, n_levels, sizeof(level_info), compare_levels);
+
+    baseline_entry_t *baseline = NULL;
+    int n_baseline = 0;
+    if (baseline_path != NULL && (n_baseline = load_baseline(baseline_path, &baseline)) < 0) {
+        fprintf(stderr, "microbench: cannot read baseline %s\n", baseline_path);
+        return 1;
+    }
+
+    FILE *out = output != NULL ? fopen(output, "w") : stdout;
+    if (out == NULL) {
+        perror("microbench: fopen");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("microbench: pipe");
+        return 1;
+    }
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain_thread, &fds[0]);
+
+    if (baseline != NULL) {
+        fprintf(stderr, "%-22s %-14s %12s %12s %9s\n", "benchmark", "level", "baseline_ns", "ns_per_op", "change");
+    }
+    fprintf(out, "{\n  \"budget_ms\": %d,\n  \"benchmarks\": [\n", budget_ms);
+    int first = 1;
+    int regressions = 0;
+    for (int l = 0; l < n_levels; l++) {
+        for (int b = 0; b < N_BENCHMARKS; b++) {
+            const benchmark_t *benchmark = &benchmarks[b];
+            if (filter != NULL && strstr(benchmark->name, filter) == NULL) continue;
+            if (benchmark->needs_ghosts && levels[l].n_ghosts == 0) continue;
+
+            bench_ctx_t ctx;
+            if (bench_ctx_init(&ctx, &levels[l], fds[1]) != 0) {
+                fprintf(stderr, "microbench: cannot load %s\n", levels[l].file_name);
+                return 1;
+            }
+            bench_result_t result = run_benchmark(&ctx, benchmark->op, (long long)budget_ms * 1000000);
+            bench_ctx_destroy(&ctx);
+
+            fprintf(out, "%s    {\"name\": \"%s\", \"level\": \"%s\", \"width\": %d, \"height\": %d, \"ghosts\": %d, "
+                         "\"ops\": %lld, \"ns_per_op\": %.1f, \"best_ns_per_op\": %.1f}",
+                    first ? "" : ",\n", benchmark->name, levels[l].file_name, levels[l].width, levels[l].height,
+                    levels[l].n_ghosts, result.ops, result.ns_per_op, result.best_ns_per_op);
+            fflush(out);
+            first = 0;
+
+            if (baseline != NULL) {
+                const baseline_entry_t *before = find_baseline(baseline, n_baseline, benchmark->name, levels[l].file_name);
+                if (before == NULL || before->ns_per_op <= 0) {
+                    fprintf(stderr, "%-22s %-14s %12s %12.1f %9s\n", benchmark->name, levels[l].file_name,
+                            "-", result.ns_per_op, "new");
+                } else {
+                    double change = 100.0 * (result.ns_per_op - before->ns_per_op) / before->ns_per_op;
+                    int regressed = change > REGRESSION_PERCENT;
+                    regressions += regressed;
+                    fprintf(stderr, "%-22s %-14s %12.1f %12.1f %+8.1f%%%s\n", benchmark->name, levels[l].file_name,
+                            before->ns_per_op, result.ns_per_op, change, regressed ? " slower" : "");
+                }
+            }
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (baseline != NULL) {
+        fprintf(stderr, "%d benchmarks more than %.0f%% slower than the baseline\n", regressions, REGRESSION_PERCENT);
+    }
+
+    close(fds[1]);
+    pthread_join(drainer, NULL);
+    close(fds[0]);
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (int l = 0; l < n_levels; l++) {
+        free(levels[l].board);
+    }
+    free(levels);
+    free(baseline);
+    return 0;
+}
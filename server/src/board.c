@@ -1,4 +1,9 @@
 #include "board.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "pursuit.h"
+#include "ray.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -8,20 +13,8 @@
 #include <string.h>
 #include <pthread.h>
 
-FILE * debugfile;
-
-// Helper private function to find and kill pacman at specific position
-static int find_and_kill_pacman(board_t* board, int new_x, int new_y) {
-    for (int p = 0; p < board->n_pacmans; p++) {
-        pacman_t* pac = &board->pacmans[p];
-        if (pac->pos_x == new_x && pac->pos_y == new_y && pac->alive) {
-            pac->alive = 0;
-            kill_pacman(board, p);
-            return DEAD_PACMAN;
-        }
-    }
-    return VALID_MOVE;
-}
+// Counts the level loads of the process, every load gets its own serial for the snapshots
+static unsigned long long levels_loaded = 0;
 
 // Helper private function for getting board position index
 static inline int get_board_index(board_t* board, int x, int y) {
@@ -40,7 +33,99 @@ void sleep_ms(int milliseconds) {
     nanosleep(&ts, NULL);
 }
 
-int move_pacman(board_t* board, int pacman_index, command_t* command) {
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Helper private function for the lock of a cell
+static inline pthread_rwlock_t *cell_lock(board_t* board, int index) {
+    return &board->locks[index % board->n_locks];
+}
+
+void cell_rdlock(board_t* board, int index) {
+    pthread_rwlock_t *lock = cell_lock(board, index);
+    if (pthread_rwlock_tryrdlock(lock) == 0) {
+        LOCKPROF_CELL(board, index, 0, 0);
+        return;
+    }
+    // Only contended acquisitions pay for the clock reads
+    long long start = now_us();
+    pthread_rwlock_rdlock(lock);
+    long long waited = now_us() - start;
+    metrics_add(METRIC_LOCK_CONTENDED, 1);
+    metrics_observe(METRIC_LOCK_WAIT_US, waited);
+    LOCKPROF_CELL(board, index, 1, waited);
+}
+
+void cell_wrlock(board_t* board, int index) {
+    pthread_rwlock_t *lock = cell_lock(board, index);
+    if (pthread_rwlock_trywrlock(lock) == 0) {
+        LOCKPROF_CELL(board, index, 0, 0);
+        return;
+    }
+    long long start = now_us();
+    pthread_rwlock_wrlock(lock);
+    long long waited = now_us() - start;
+    metrics_add(METRIC_LOCK_CONTENDED, 1);
+    metrics_observe(METRIC_LOCK_WAIT_US, waited);
+    LOCKPROF_CELL(board, index, 1, waited);
+}
+
+void cell_unlock(board_t* board, int index) {
+    pthread_rwlock_unlock(cell_lock(board, index));
+}
+
+// Helper private function that reads who stands on a position, under its lock
+static int read_occupant(board_t* board, int index) {
+    cell_rdlock(board, index);
+    int occupant = board->board[index].occupant;
+    cell_unlock(board, index);
+    return occupant;
+}
+
+// Helper private function that puts an entity on a position, or takes it off with NO_OCCUPANT,
+// with the position's lock held; the ray index changes in the same order as the occupants
+static void put_occupant(board_t* board, int index, int occupant) {
+    board->board[index].occupant = occupant;
+    ray_mark(board->rays, index % board->width, index / board->width, occupant != NO_OCCUPANT);
+}
+
+// Helper private functions that lock the two positions of a move for writing, the lower lock
+// first, so entities moving into each other's positions never wait for each other in a cycle;
+// positions sharing a lock take it once
+static void lock_pair(board_t* board, int a, int b) {
+    int lock_a = a % board->n_locks, lock_b = b % board->n_locks;
+    if (lock_a == lock_b) {
+        cell_wrlock(board, a);
+        return;
+    }
+    cell_wrlock(board, lock_a < lock_b ? a : b);
+    cell_wrlock(board, lock_a < lock_b ? b : a);
+}
+
+static void unlock_pair(board_t* board, int a, int b) {
+    cell_unlock(board, a);
+    if (a % board->n_locks != b % board->n_locks) cell_unlock(board, b);
+}
+
+// Helper private function for kill_pacman, with the lock of the pacman's position held
+static void kill_pacman_locked(board_t* board, int pacman_index, int index) {
+    if (board->board[index].occupant == OCCUPANT_PACMAN(pacman_index)) {
+        put_occupant(board, index, NO_OCCUPANT);
+    }
+    __atomic_store_n(&board->pacmans[pacman_index].alive, 0, __ATOMIC_RELEASE);
+}
+
+// Helper private function for a dot eaten at index, with the snapshot lock held for reading:
+// the next capture copies its chunk again
+static inline void dot_eaten(board_t* board, int index) {
+    __atomic_store_n(&board->dirty_chunks[index / SNAPSHOT_CHUNK_CELLS], board->capture_epoch, __ATOMIC_RELAXED);
+}
+
+// Helper private function for move_pacman, with the snapshot lock held for reading
+static int pacman_step(board_t* board, int pacman_index, command_t* command) {
     if (pacman_index < 0 || !board->pacmans[pacman_index].alive) {
         return DEAD_PACMAN; // Invalid or dead pacman
     }
@@ -60,7 +145,7 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
 
     if (direction == 'R') {
         char directions[] = {'W', 'S', 'A', 'D'};
-        direction = directions[rand() % 4];
+        direction = directions[rng_below(&pac->rng, 4)];
     }
 
     // Calculate new position based on direction
@@ -84,6 +169,10 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
             }
             else command->turns_left -= 1;
             return VALID_MOVE;
+        case 'G': // Backup and restore, done by the server around the move
+        case 'L':
+            pac->current_move += 1;
+            return VALID_MOVE;
         default:
             return INVALID_MOVE; // Invalid direction
     }
@@ -98,144 +187,97 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
 
     int new_index = get_board_index(board, new_x, new_y);
     int old_index = get_board_index(board, pac->pos_x, pac->pos_y);
-    char target_content = board->board[new_index].content;
-
-    pthread_rwlock_rdlock(&board->board[new_index].lock);
-    if (board->board[new_index].has_portal) {
-        pthread_rwlock_unlock(&board->board[new_index].lock);
-        pthread_rwlock_wrlock(&board->board[old_index].lock);
-        board->board[old_index].content = ' ';
-        pthread_rwlock_unlock(&board->board[old_index].lock);
-        pthread_rwlock_wrlock(&board->board[new_index].lock);
-        board->board[new_index].content = 'P';
-        pthread_rwlock_unlock(&board->board[new_index].lock);
-        return REACHED_PORTAL;
-    } else pthread_rwlock_unlock(&board->board[new_index].lock);
+    board_pos_t* target = &board->board[new_index];
 
-    // Check for walls
-    if (target_content == 'W') {
+    // Check for walls, they never move
+    if (target->content == 'W') {
         return INVALID_MOVE;
     }
 
-    // Check for ghosts
-    if (target_content == 'M') {
-        kill_pacman(board, pacman_index);
-        return DEAD_PACMAN;
+    int result = VALID_MOVE;
+    lock_pair(board, old_index, new_index);
+    if (!pac->alive) {
+        result = DEAD_PACMAN; // A ghost got it while it was choosing its move
+    } else if (target->has_portal) {
+        put_occupant(board, old_index, NO_OCCUPANT);
+        put_occupant(board, new_index, OCCUPANT_PACMAN(pacman_index));
+        result = REACHED_PORTAL;
+    } else if (IS_GHOST(target->occupant)) {
+        kill_pacman_locked(board, pacman_index, old_index);
+        result = DEAD_PACMAN;
+    } else if (IS_PACMAN(target->occupant)) {
+        result = INVALID_MOVE; // Another player's pacman
+    } else {
+        // Collect points
+        if (target->has_dot) {
+            __atomic_store_n(&target->has_dot, 0, __ATOMIC_RELAXED); // read by a capture copying the board
+            pac->points++;
+            dot_eaten(board, new_index);
+        }
+        put_occupant(board, old_index, NO_OCCUPANT);
+        pac->pos_x = new_x;
+        pac->pos_y = new_y;
+        put_occupant(board, new_index, OCCUPANT_PACMAN(pacman_index));
     }
+    unlock_pair(board, old_index, new_index);
 
-    // Collect points
-    pthread_rwlock_rdlock(&board->board[new_index].lock);
-    if (board->board[new_index].has_dot) {
-        pthread_rwlock_unlock(&board->board[new_index].lock);
-        pac->points++;
-        pthread_rwlock_wrlock(&board->board[new_index].lock);
-        board->board[new_index].has_dot = 0;
-        pthread_rwlock_unlock(&board->board[new_index].lock);
-    } else pthread_rwlock_unlock(&board->board[new_index].lock);
+    if (result == VALID_MOVE && board->pursuit[pacman_index] != NULL) {
+        pursuit_target_moved(board->pursuit[pacman_index], new_x, new_y);
+    }
 
-    pthread_rwlock_wrlock(&board->board[old_index].lock);
-    board->board[old_index].content = ' ';
-    pthread_rwlock_unlock(&board->board[old_index].lock);
-    pac->pos_x = new_x;
-    pac->pos_y = new_y;
-    pthread_rwlock_wrlock(&board->board[new_index].lock);
-    board->board[new_index].content = 'P';
-    pthread_rwlock_unlock(&board->board[new_index].lock);
+    return result;
+}
 
-    return VALID_MOVE;
+int move_pacman(board_t* board, int pacman_index, command_t* command) {
+    pthread_rwlock_rdlock(&board->snapshot_lock);
+    int result = pacman_step(board, pacman_index, command);
+    pthread_rwlock_unlock(&board->snapshot_lock);
+    return result;
 }
 
-// Helper private function for charged ghost movement in one direction
+// Helper private function for charged ghost movement in one direction: the ray index gives the
+// first wall or entity on the way, only the cell of an entity it runs into is read; the target is
+// checked again when the ghost moves, under the locks of the move
 static int move_ghost_charged_direction(board_t* board, ghost_t* ghost, char direction, int* new_x, int* new_y) {
     int x = ghost->pos_x;
     int y = ghost->pos_y;
     *new_x = x;
     *new_y = y;
-    
-    switch (direction) {
-        case 'W': // Up
-            if (y == 0) return INVALID_MOVE;
-            *new_y = 0; // In case there is no colision
-            for (int i = y - 1; i >= 0; i--) {
-                int index = get_board_index(board, x, i);
-                pthread_rwlock_rdlock(&board->board[index].lock);
-                char target_content = board->board[index].content;
-                pthread_rwlock_unlock(&board->board[index].lock);
-                if (target_content == 'W' || target_content == 'M') {
-                    *new_y = i + 1; // stop before colision
-                    return VALID_MOVE;
-                }
-                else if (target_content == 'P') {
-                    *new_y = i;
-                    return find_and_kill_pacman(board, *new_x, *new_y);
-                }
-            }
-            break;
 
-        case 'S': // Down
-            if (y == board->height - 1) return INVALID_MOVE;
-            *new_y = board->height - 1; // In case there is no colision
-            for (int i = y + 1; i < board->height; i++) {
-                int index = get_board_index(board, x, i);
-                pthread_rwlock_rdlock(&board->board[index].lock);
-                char target_content = board->board[index].content;
-                pthread_rwlock_unlock(&board->board[index].lock);
-                if (target_content == 'W' || target_content == 'M') {
-                    *new_y = i - 1; // stop before colision
-                    return VALID_MOVE;
-                }
-                if (target_content == 'P') {
-                    *new_y = i;
-                    return find_and_kill_pacman(board, *new_x, *new_y);
-                }
-            }
-            break;
-
-        case 'A': // Left
-            if (x == 0) return INVALID_MOVE;
-            *new_x = 0; // In case there is no colision
-            for (int j = x - 1; j >= 0; j--) {
-                int index = get_board_index(board, j, y);
-                pthread_rwlock_rdlock(&board->board[index].lock);
-                char target_content = board->board[index].content;
-                pthread_rwlock_unlock(&board->board[index].lock);
-                if (target_content == 'W' || target_content == 'M') {
-                    *new_x = j + 1; // stop before colision
-                    return VALID_MOVE;
-                }
-                if (target_content == 'P') {
-                    *new_x = j;
-                    return find_and_kill_pacman(board, *new_x, *new_y);
-                }
-            }
-            break;
-
-        case 'D': // Right
-            if (x == board->width - 1) return INVALID_MOVE;
-            *new_x = board->width - 1; // In case there is no colision
-            for (int j = x + 1; j < board->width; j++) {
-                int index = get_board_index(board, j, y);
-                pthread_rwlock_rdlock(&board->board[index].lock);
-                char target_content = board->board[index].content;
-                pthread_rwlock_unlock(&board->board[index].lock);
-                if (target_content == 'W' || target_content == 'M') {
-                    *new_x = j - 1; // stop before colision
-                    return VALID_MOVE;
-                }
-                if (target_content == 'P') {
-                    *new_x = j;
-                    return find_and_kill_pacman(board, *new_x, *new_y);
-                }
-            }
-            break;
+    int dx = 0, dy = 0;
+    switch (direction) {
+        case 'W': dy = -1; break; // Up
+        case 'S': dy = 1; break;  // Down
+        case 'A': dx = -1; break; // Left
+        case 'D': dx = 1; break;  // Right
         default:
-            debug("DEFAULT CHARGED MOVE - direction = %c\n", direction);
+            log_trace("DEFAULT CHARGED MOVE - direction = %c\n", direction);
             return INVALID_MOVE;
     }
+
+    int free_cells;
+    ray_stop_t stop = ray_cast(board->rays, x, y, direction, &free_cells);
+    if (stop == RAY_EDGE && free_cells == 0) {
+        return INVALID_MOVE; // Already against the edge
+    }
+    if (stop == RAY_OCCUPANT) {
+        int hit_x = x + dx * (free_cells + 1);
+        int hit_y = y + dy * (free_cells + 1);
+        int occupant = read_occupant(board, get_board_index(board, hit_x, hit_y));
+        if (IS_PACMAN(occupant)) {
+            *new_x = hit_x;
+            *new_y = hit_y;
+            return DEAD_PACMAN;
+        }
+        // A ghost, or an entity that left meanwhile: stop before the cell as for a ghost
+    }
+    *new_x = x + dx * free_cells; // stop before colision, or at the edge
+    *new_y = y + dy * free_cells;
     return VALID_MOVE;
-}   
+}
 
-int move_ghost_charged(board_t* board, int ghost_index, char direction) {
+// Helper private function for move_ghost_charged, with the snapshot lock held for reading
+static int ghost_charge(board_t* board, int ghost_index, char direction) {
     ghost_t* ghost = &board->ghosts[ghost_index];
     int x = ghost->pos_x;
     int y = ghost->pos_y;
@@ -243,31 +285,66 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
     int new_y = y;
 
     ghost->charged = 0; //uncharge
+    TRACE_BEGIN(scan_span);
     int result = move_ghost_charged_direction(board, ghost, direction, &new_x, &new_y);
+    TRACE_END(scan_span, "charged scan");
     if (result == INVALID_MOVE) {
-        debug("DEFAULT CHARGED MOVE - direction = %c\n", direction);
+        log_trace("DEFAULT CHARGED MOVE - direction = %c\n", direction);
         return INVALID_MOVE;
     }
 
     // Get board indices
     int old_index = get_board_index(board, ghost->pos_x, ghost->pos_y);
     int new_index = get_board_index(board, new_x, new_y);
+    if (new_index == old_index) {
+        return VALID_MOVE; // Blocked right away
+    }
 
-    // Update board - clear old position (restore what was there)
-    pthread_rwlock_wrlock(&board->board[old_index].lock);
-    board->board[old_index].content = ' '; // Or restore the dot if ghost was on one
-    pthread_rwlock_unlock(&board->board[old_index].lock);
-    // Update ghost position
-    ghost->pos_x = new_x;
-    ghost->pos_y = new_y;
-    // Update board - set new position
-    pthread_rwlock_wrlock(&board->board[new_index].lock);
-    board->board[new_index].content = 'M';
-    pthread_rwlock_unlock(&board->board[new_index].lock);
+    lock_pair(board, old_index, new_index);
+    // The way was free when the ray was cast, the target may have changed since
+    int target_occupant = board->board[new_index].occupant;
+    if (IS_GHOST(target_occupant)) {
+        result = INVALID_MOVE;
+    } else {
+        result = VALID_MOVE;
+        if (IS_PACMAN(target_occupant)) {
+            kill_pacman_locked(board, PACMAN_INDEX(target_occupant), new_index);
+            result = DEAD_PACMAN;
+        }
+        put_occupant(board, old_index, NO_OCCUPANT);
+        ghost->pos_x = new_x;
+        ghost->pos_y = new_y;
+        put_occupant(board, new_index, OCCUPANT_GHOST(ghost_index));
+    }
+    unlock_pair(board, old_index, new_index);
     return result;
 }
 
-int move_ghost(board_t* board, int ghost_index, command_t* command) {
+int move_ghost_charged(board_t* board, int ghost_index, char direction) {
+    pthread_rwlock_rdlock(&board->snapshot_lock);
+    int result = ghost_charge(board, ghost_index, direction);
+    pthread_rwlock_unlock(&board->snapshot_lock);
+    return result;
+}
+
+// Helper private function for the F move: a step towards the nearest pacman alive, 0 if none can be reached
+static char pursue(board_t* board, ghost_t* ghost) {
+    struct pursuit *nearest = NULL;
+    int nearest_distance = PURSUIT_UNREACHABLE;
+    int n_pacmans = __atomic_load_n(&board->n_pacmans, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n_pacmans; i++) {
+        if (!__atomic_load_n(&board->pacmans[i].alive, __ATOMIC_ACQUIRE) || board->pursuit[i] == NULL) continue;
+        int distance = pursuit_distance(board->pursuit[i], ghost->pos_x, ghost->pos_y);
+        if (distance < nearest_distance) {
+            nearest = board->pursuit[i];
+            nearest_distance = distance;
+        }
+    }
+    return nearest != NULL ? pursuit_direction(nearest, ghost->pos_x, ghost->pos_y, &ghost->rng) : 0;
+}
+
+// Helper private function for move_ghost, with the snapshot lock held for reading
+static int ghost_step(board_t* board, int ghost_index, command_t* command) {
     ghost_t* ghost = &board->ghosts[ghost_index];
     int new_x = ghost->pos_x;
     int new_y = ghost->pos_y;
@@ -280,10 +357,16 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
     ghost->waiting = ghost->passo;
 
     char direction = command->command;
+
+    if (direction == 'F') {
+        // Pursuit, wandering when no pacman can be reached
+        direction = pursue(board, ghost);
+        if (direction == 0) direction = 'R';
+    }
     
     if (direction == 'R') {
         char directions[] = {'W', 'S', 'A', 'D'};
-        direction = directions[rand() % 4];
+        direction = directions[rng_below(&ghost->rng, 4)];
     }
 
     // Calculate new position based on direction
@@ -318,7 +401,7 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
     // Logic for the WASD movement
     ghost->current_move++;
     if (ghost->charged)
-        return move_ghost_charged(board, ghost_index, direction);
+        return ghost_charge(board, ghost_index, direction);
 
     // Check boundaries
     if (!is_valid_position(board, new_x, new_y)) {
@@ -328,54 +411,132 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
     // Check board position
     int new_index = get_board_index(board, new_x, new_y);
     int old_index = get_board_index(board, ghost->pos_x, ghost->pos_y);
-    pthread_rwlock_rdlock(&board->board[new_index].lock);
-    char target_content = board->board[new_index].content;
-    pthread_rwlock_unlock(&board->board[new_index].lock);
 
-    // Check for walls and ghosts
-    if (target_content == 'W' || target_content == 'M') {
+    // Check for walls
+    if (board->board[new_index].content == 'W') {
         return INVALID_MOVE;
     }
 
     int result = VALID_MOVE;
-    // Check for pacman
-    if (target_content == 'P') {
-        result = find_and_kill_pacman(board, new_x, new_y);
+    lock_pair(board, old_index, new_index);
+    int target_occupant = board->board[new_index].occupant;
+    if (IS_GHOST(target_occupant)) {
+        result = INVALID_MOVE;
+    } else {
+        // Check for pacman
+        if (IS_PACMAN(target_occupant)) {
+            kill_pacman_locked(board, PACMAN_INDEX(target_occupant), new_index);
+            result = DEAD_PACMAN;
+        }
+        put_occupant(board, old_index, NO_OCCUPANT);
+        ghost->pos_x = new_x;
+        ghost->pos_y = new_y;
+        put_occupant(board, new_index, OCCUPANT_GHOST(ghost_index));
     }
+    unlock_pair(board, old_index, new_index);
+    return result;
+}
 
-    // Update board - clear old position (restore what was there)
-    pthread_rwlock_wrlock(&board->board[old_index].lock);
-    board->board[old_index].content = ' '; // Or restore the dot if ghost was on one
-    pthread_rwlock_unlock(&board->board[old_index].lock);
-
-    // Update ghost position
-    ghost->pos_x = new_x;
-    ghost->pos_y = new_y;
-
-    // Update board - set new position
-    pthread_rwlock_wrlock(&board->board[new_index].lock);
-    board->board[new_index].content = 'M';
-    pthread_rwlock_unlock(&board->board[new_index].lock);
+int move_ghost(board_t* board, int ghost_index, command_t* command) {
+    pthread_rwlock_rdlock(&board->snapshot_lock);
+    int result = ghost_step(board, ghost_index, command);
+    pthread_rwlock_unlock(&board->snapshot_lock);
     return result;
 }
 
 void kill_pacman(board_t* board, int pacman_index) {
+    pthread_rwlock_rdlock(&board->snapshot_lock);
     pacman_t* pac = &board->pacmans[pacman_index];
     int index = pac->pos_y * board->width + pac->pos_x;
 
     // Remove pacman from the board
-    pthread_rwlock_wrlock(&board->board[index].lock);
-    board->board[index].content = ' ';
-    pthread_rwlock_unlock(&board->board[index].lock);
+    cell_wrlock(board, index);
+    kill_pacman_locked(board, pacman_index, index);
+    cell_unlock(board, index);
+    pthread_rwlock_unlock(&board->snapshot_lock);
+}
+
+// Helper private function for add_pacman, with the snapshot lock held for reading
+static int place_pacman(board_t* board, int pacman_index, int points) {
+    if (pacman_index <= 0 || pacman_index >= MAX_PACMANS ||
+        __atomic_load_n(&board->pacmans[pacman_index].alive, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    int n_cells = board->width * board->height;
+    int *queue = malloc(n_cells * sizeof(int));
+    char *seen = calloc(n_cells, 1);
+    if (queue == NULL || seen == NULL) {
+        free(queue);
+        free(seen);
+        return -1;
+    }
 
-    // Mark pacman as dead
-    pac->alive = 0;
+    pacman_t* pac = &board->pacmans[pacman_index];
+    memset(pac, 0, sizeof(pacman_t));
+    pac->points = points;
+    // Derived without advancing the seed, the stream does not depend on when the player joined
+    rng_seed(&pac->rng, rng_derive(board->rng_seed, (uint64_t)pacman_index));
+
+    // BFS over the open cells from the start of the level, the first free one is taken under its lock
+    int head = 0, tail = 0;
+    int start = get_board_index(board, board->spawn_x, board->spawn_y);
+    int placed = -1;
+    seen[start] = 1;
+    queue[tail++] = start;
+    while (head < tail && placed < 0) {
+        int index = queue[head++];
+        int x = index % board->width, y = index / board->width;
+        if (!board->board[index].has_portal) {
+            cell_wrlock(board, index);
+            if (board->board[index].occupant == NO_OCCUPANT) {
+                pac->pos_x = x;
+                pac->pos_y = y;
+                if (board->has_pursuers) {
+                    // The field must exist before the pacman is seen alive by the pursuers
+                    if (board->pursuit[pacman_index] == NULL) {
+                        board->pursuit[pacman_index] = pursuit_new(board, x, y);
+                    } else {
+                        pursuit_target_moved(board->pursuit[pacman_index], x, y);
+                    }
+                }
+                put_occupant(board, index, OCCUPANT_PACMAN(pacman_index));
+                __atomic_store_n(&pac->alive, 1, __ATOMIC_RELEASE);
+                placed = index;
+            }
+            cell_unlock(board, index);
+        }
+        int neighbours[4][2] = {{x, y - 1}, {x, y + 1}, {x - 1, y}, {x + 1, y}};
+        for (int d = 0; d < 4; d++) {
+            int nx = neighbours[d][0], ny = neighbours[d][1];
+            if (!is_valid_position(board, nx, ny)) continue;
+            int next = get_board_index(board, nx, ny);
+            if (seen[next] || board->board[next].content == 'W') continue;
+            seen[next] = 1;
+            queue[tail++] = next;
+        }
+    }
+    free(queue);
+    free(seen);
+    if (placed < 0) {
+        return -1;
+    }
+    if (pacman_index >= __atomic_load_n(&board->n_pacmans, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&board->n_pacmans, pacman_index + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int add_pacman(board_t* board, int pacman_index, int points) {
+    pthread_rwlock_rdlock(&board->snapshot_lock);
+    int result = place_pacman(board, pacman_index, points);
+    pthread_rwlock_unlock(&board->snapshot_lock);
+    return result;
 }
 
 // Static Loading
 int load_pacman(board_t* board, int points, level_info *info) {
     if (info->has_pacman == 1) {
-        board->board[info->pacman_info.pos_y * board->width + info->pacman_info.pos_x].content = 'P'; // Pacman
+        board->board[info->pacman_info.pos_y * board->width + info->pacman_info.pos_x].occupant = OCCUPANT_PACMAN(0);
         board->pacmans[0].pos_x = info->pacman_info.pos_x;
         board->pacmans[0].pos_y = info->pacman_info.pos_y;
         board->pacmans[0].alive = 1;
@@ -388,7 +549,7 @@ int load_pacman(board_t* board, int points, level_info *info) {
             board->pacmans[0].moves[j] = info->pacman_info.moves[j];
         }
     } else {
-        board->board[1 * board->width + 1].content = 'P'; // Pacman
+        board->board[1 * board->width + 1].occupant = OCCUPANT_PACMAN(0);
         board->pacmans[0].pos_x = 1;
         board->pacmans[0].pos_y = 1;
         board->pacmans[0].alive = 1;
@@ -401,7 +562,7 @@ int load_pacman(board_t* board, int points, level_info *info) {
 // Static Loading
 int load_ghost(board_t* board, pac_ghost_info *info) {
     for (int i = 0; i < board->n_ghosts; i++) {
-        board->board[info[i].pos_y * board->width + info[i].pos_x].content = 'M'; // Monster
+        board->board[info[i].pos_y * board->width + info[i].pos_x].occupant = OCCUPANT_GHOST(i);
         board->ghosts[i].pos_x = info[i].pos_x;
         board->ghosts[i].pos_y = info[i].pos_y;
         board->ghosts[i].passo = info[i].passo;
@@ -430,7 +591,7 @@ int load_level(board_t *board, int points, level_info *info) {
 
     if (info->has_pacman) strcpy(board->pacman_file, info->pacman_file);
 
-    board->pacmans = calloc(board->n_pacmans, sizeof(pacman_t));
+    board->pacmans = calloc(MAX_PACMANS, sizeof(pacman_t));
     board->ghosts = calloc(board->n_ghosts, sizeof(ghost_t));
 
     strcpy(board->level_name, info->file_name);
@@ -443,40 +604,119 @@ int load_level(board_t *board, int points, level_info *info) {
     // Copy content from info->board
     memcpy(board->board, info->board, board->width * board->height * sizeof(board_pos_t));
 
-    for (int i = 0; i < board->width * board->height; i++) {
-        pthread_rwlock_init(&board->board[i].lock, NULL);
+    int n_cells = board->width * board->height;
+    board->n_locks = n_cells < CELL_LOCK_STRIPES ? (n_cells > 0 ? n_cells : 1) : CELL_LOCK_STRIPES;
+    board->locks = malloc(board->n_locks * sizeof(pthread_rwlock_t));
+    if (!board->locks) {
+        perror("Failed to allocate memory for cell locks");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < board->n_locks; i++) {
+        pthread_rwlock_init(&board->locks[i], NULL);
     }
+    // Nothing was eaten before the first capture, epoch 1
+    pthread_rwlock_init(&board->snapshot_lock, NULL);
+    board->dirty_chunks = calloc((n_cells + SNAPSHOT_CHUNK_CELLS - 1) / SNAPSHOT_CHUNK_CELLS + 1, sizeof(unsigned int));
+    if (!board->dirty_chunks) {
+        perror("Failed to allocate memory for snapshot chunks");
+        exit(EXIT_FAILURE);
+    }
+    board->capture_epoch = 1;
+    board->level_serial = __atomic_add_fetch(&levels_loaded, 1, __ATOMIC_RELAXED);
+#ifdef PROFILE_LOCKS
+    board->lock_profile = lockprof_new(board->width, board->height, board->level_name);
+#endif
 
     load_ghost(board, info->ghosts_info);
     load_pacman(board, points, info);
+    board->spawn_x = board->pacmans[0].pos_x;
+    board->spawn_y = board->pacmans[0].pos_y;
+    board->rays = ray_index_new(board);
+    if (!board->rays) {
+        perror("Failed to allocate memory for ray index");
+        exit(EXIT_FAILURE);
+    }
+
+    // Random moves only depend on the session seed and the order of each entity's own moves,
+    // not on how the threads interleave
+    for (int i = 0; i < board->n_pacmans; i++) {
+        rng_seed(&board->pacmans[i].rng, rng_split(&board->rng_seed));
+    }
+    for (int i = 0; i < board->n_ghosts; i++) {
+        rng_seed(&board->ghosts[i].rng, rng_split(&board->rng_seed));
+    }
+
+    // One distance field per pacman shared by all the pursuers, only levels with some pay for it;
+    // the pacmans added later get theirs in add_pacman
+    board->has_pursuers = 0;
+    for (int i = 0; i < board->n_ghosts && !board->has_pursuers; i++) {
+        for (int j = 0; j < board->ghosts[i].n_moves; j++) {
+            if (board->ghosts[i].moves[j].command == 'F') {
+                board->has_pursuers = 1;
+                break;
+            }
+        }
+    }
+    memset(board->pursuit, 0, sizeof(board->pursuit));
+    if (board->has_pursuers) {
+        board->pursuit[0] = pursuit_new(board, board->pacmans[0].pos_x, board->pacmans[0].pos_y);
+    }
 
     return 0;
 }
 
 void unload_level(board_t * board) {
-    for (int i = 0; i < board->width * board->height; i++) {
-        pthread_rwlock_destroy(&board->board[i].lock);
+#ifdef PROFILE_LOCKS
+    lockprof_report_level(board->lock_profile);
+    board->lock_profile = NULL;
+#endif
+    for (int i = 0; i < board->n_locks; i++) {
+        pthread_rwlock_destroy(&board->locks[i]);
     }
+    free(board->locks);
+    board->locks = NULL;
+    pthread_rwlock_destroy(&board->snapshot_lock);
+    free(board->dirty_chunks);
+    board->dirty_chunks = NULL;
     free(board->board);
     free(board->pacmans);
     free(board->ghosts);
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        pursuit_free(board->pursuit[i]);
+        board->pursuit[i] = NULL;
+    }
+    ray_index_free(board->rays);
+    board->rays = NULL;
 }
 
-void open_debug_file(char *filename) {
-    debugfile = fopen(filename, "w");
-}
-
-void close_debug_file() {
-    fclose(debugfile);
+// Helper private function for board_state_hash, FNV-1a
+static unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return hash;
 }
 
-void debug(const char * format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(debugfile, format, args);
-    va_end(args);
-
-    fflush(debugfile);
+unsigned long long board_state_hash(board_t *board) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < board->width * board->height; i++) {
+        cell_rdlock(board, i);
+        char cell[3] = {cell_char(&board->board[i]), (char)board->board[i].has_dot, (char)board->board[i].has_portal};
+        cell_unlock(board, i);
+        hash = hash_bytes(hash, cell, sizeof(cell));
+    }
+    for (int i = 0; i < board->n_pacmans; i++) {
+        pacman_t *pac = &board->pacmans[i];
+        int fields[4] = {pac->pos_x, pac->pos_y, pac->alive, pac->points};
+        hash = hash_bytes(hash, fields, sizeof(fields));
+    }
+    for (int i = 0; i < board->n_ghosts; i++) {
+        ghost_t *ghost = &board->ghosts[i];
+        int fields[4] = {ghost->pos_x, ghost->pos_y, ghost->charged, ghost->current_move};
+        hash = hash_bytes(hash, fields, sizeof(fields));
+    }
+    return hash;
 }
 
 void print_board(board_t *board) {
@@ -510,7 +750,7 @@ void print_board(board_t *board) {
         for (int x = 0; x < board->width; x++) {
             int idx = y * board->width + x;
             if (offset < sizeof(buffer) - 2) {
-                buffer[offset++] = board->board[idx].content;
+                buffer[offset++] = cell_char(&board->board[idx]);
             }
         }
         if (offset < sizeof(buffer) - 2) {
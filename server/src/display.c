@@ -74,17 +74,9 @@ void draw_board(board_t* board, int mode) {
     for (int y = 0; y < board->height; y++) {
         for (int x = 0; x < board->width; x++) {
             int index = y * board->width + x;
-            char ch = board->board[index].content;
-            int ghost_charged = 0;
-
-            for (int g = 0; g < board->n_ghosts; g++) {
-                ghost_t* ghost = &board->ghosts[g];
-                if (ghost->pos_x == x && ghost->pos_y == y) {
-                    if (ghost->charged)
-                        ghost_charged = 1;
-                    break;
-                }
-            }
+            int occupant = board->board[index].occupant;
+            char ch = cell_char(&board->board[index]);
+            int ghost_charged = IS_GHOST(occupant) && board->ghosts[occupant].charged;
 
             // Move cursor to position
             move(start_row + y, x);
@@ -0,0 +1,436 @@
+#include "frame.h"
+#include "board.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+// Header of an OP_CODE_BOARD frame: op code, seven ints, the server timestamp
+// and the last applied input (sequence number and apply time)
+#define FRAME_HEADER_SIZE (1 + 8 * sizeof(int) + 2 * sizeof(long long))
+// An OP_CODE_VIEW frame adds the origin and size of the window and the number of changes
+#define VIEW_HEADER_SIZE (FRAME_HEADER_SIZE + 5 * sizeof(int))
+// Bytes of one changed cell: its index in the window and its character
+#define VIEW_CHANGE_SIZE (sizeof(int) + 1)
+
+// How long a subscriber may take to drain the rest of a frame that was partially written
+#define PARTIAL_WRITE_TIMEOUT_MS 100
+
+// Helper private function for the character of a cell in frames, with the cell's lock held;
+// every pacman is 'C', the frames of each player tell its own pacman apart afterwards
+static inline char frame_cell(const board_pos_t *pos) {
+    char ch = cell_char(pos);
+    if (ch == ' ') {
+        if (pos->has_dot) {
+            ch = '.';
+        }
+        if (pos->has_portal) {
+            ch = '@';
+        }
+    }
+    if (ch == 'W') ch = '#';
+    if (ch == 'P') ch = 'C';
+    if (ch == 'G') ch = 'M';
+    return ch;
+}
+
+// Helper private function for the last input applied to a pacman, written by its thread while the
+// screen thread reads it: the time read after the acquire of seq is at least the one of that seq
+static int read_input_echo(pacman_t *pacman, long long *apply_us) {
+    int seq = __atomic_load_n(&pacman->input_seq, __ATOMIC_ACQUIRE);
+    *apply_us = __atomic_load_n(&pacman->input_apply_us, __ATOMIC_RELAXED);
+    return seq;
+}
+
+void process_board_header(board_t* game_board, int victory, int game_over, Board *board_data) {
+    board_data->width = game_board->width;
+    board_data->height = game_board->height;
+    board_data->tempo = game_board->tempo;
+    board_data->victory = victory;
+    board_data->game_over = game_over;
+    board_data->accumulated_points = game_board->pacmans[0].points;
+    board_data->input_seq = read_input_echo(&game_board->pacmans[0], &board_data->input_apply_us);
+}
+
+int process_board_to_api(board_t* game_board, int victory, int game_over, Board *board_data) {
+    if (board_data_reserve(board_data, game_board->width, game_board->height) < 0) {
+        return -1;
+    }
+    process_board_header(game_board, victory, game_over, board_data);
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        board_data->pacman_cells[i] = -1;
+    }
+
+    size_t data_size = (size_t)(board_data->width * board_data->height);
+    for (int i = 0; i < game_board->height; i++) {
+        for (int j = 0; j < game_board->width; j++) {
+            int index = i * game_board->width + j;
+            cell_rdlock(game_board, index);
+            board_pos_t *pos = &game_board->board[index];
+            char ch = frame_cell(pos);
+            if (IS_PACMAN(pos->occupant)) {
+                board_data->pacman_cells[PACMAN_INDEX(pos->occupant)] = index;
+            }
+            board_data->data[index] = ch;
+            cell_unlock(game_board, index);
+        }
+    }
+    board_data->data[data_size] = '\0';
+
+    return 0;
+}
+
+// Helper private function that makes sure frame can hold needed bytes
+static int frame_reserve(frame_buffer_t *frame, size_t needed) {
+    if (frame->capacity < needed) {
+        char *buf = realloc(frame->buf, needed);
+        if (buf == NULL) {
+            debug("Error allocating encoded frame of %zu bytes\n", needed);
+            return -1;
+        }
+        frame->buf = buf;
+        frame->capacity = needed;
+    }
+    return 0;
+}
+
+// Helper private function that writes the header shared by OP_CODE_BOARD and OP_CODE_VIEW frames
+static void encode_header(char *p, char op_code, Board *board) {
+    *p++ = op_code;
+    int header[7] = {board->width, board->height, board->tempo,
+                     board->victory, board->game_over, board->accumulated_points, board->tick};
+    memcpy(p, header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, &board->server_time_us, sizeof(long long));
+    p += sizeof(long long);
+    memcpy(p, &board->input_seq, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, &board->input_apply_us, sizeof(long long));
+}
+
+// Helper private function that puts the points and the last applied input of a player's pacman
+// in an encoded header
+static void patch_player(char *buf, pacman_t *pacman) {
+    char *p = buf + 1;
+    int points = pacman->points;
+    memcpy(p + 5 * sizeof(int), &points, sizeof(int));
+    p += 7 * sizeof(int) + sizeof(long long);
+    long long input_apply_us;
+    int input_seq = read_input_echo(pacman, &input_apply_us);
+    memcpy(p, &input_seq, sizeof(int));
+    memcpy(p + sizeof(int), &input_apply_us, sizeof(long long));
+}
+
+int encode_board_frame(Board *board, frame_buffer_t *frame) {
+    size_t data_size = (size_t)board->width * (size_t)board->height;
+    size_t needed = FRAME_HEADER_SIZE + data_size;
+    if (frame_reserve(frame, needed) < 0) {
+        return -1;
+    }
+    encode_header(frame->buf, OP_CODE_BOARD, board);
+    memcpy(frame->buf + FRAME_HEADER_SIZE, board->data, data_size);
+    frame->len = needed;
+    return 0;
+}
+
+void personalize_frame(Board *board, frame_buffer_t *frame, board_t *game_board, int pacman_index) {
+    patch_player(frame->buf, &game_board->pacmans[pacman_index]);
+    char *data = frame->buf + FRAME_HEADER_SIZE;
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        if (board->pacman_cells[i] >= 0) {
+            data[board->pacman_cells[i]] = i == pacman_index ? 'C' : 'c';
+        }
+    }
+}
+
+int frame_buffer_copy(frame_buffer_t *dst, const frame_buffer_t *src) {
+    if (frame_reserve(dst, src->len) < 0) {
+        return -1;
+    }
+    memcpy(dst->buf, src->buf, src->len);
+    dst->len = src->len;
+    return 0;
+}
+
+void frame_buffer_release(frame_buffer_t *frame) {
+    free(frame->buf);
+    frame->buf = NULL;
+    frame->len = 0;
+    frame->capacity = 0;
+}
+
+void view_resize(view_t *view, int width, int height) {
+    view->width = width < MAX_VIEW_SIDE ? width : MAX_VIEW_SIDE;
+    view->height = height < MAX_VIEW_SIDE ? height : MAX_VIEW_SIDE;
+    view->sent_width = view->sent_height = 0;
+}
+
+// Helper private function for the pacman a window follows, -1 if none is alive
+static int view_target(board_t *game_board, int pacman_index) {
+    if (pacman_index >= 0) {
+        return __atomic_load_n(&game_board->pacmans[pacman_index].alive, __ATOMIC_ACQUIRE) ? pacman_index : -1;
+    }
+    int n_pacmans = __atomic_load_n(&game_board->n_pacmans, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n_pacmans; i++) {
+        if (__atomic_load_n(&game_board->pacmans[i].alive, __ATOMIC_ACQUIRE)) return i;
+    }
+    return -1;
+}
+
+int encode_view_frame(board_t *game_board, Board *header, view_t *view, int pacman_index, int keyframe) {
+    int width = view->width < game_board->width ? view->width : game_board->width;
+    int height = view->height < game_board->height ? view->height : game_board->height;
+    size_t n_cells = (size_t)width * (size_t)height;
+    if (view->capacity < n_cells) {
+        char *cells = realloc(view->cells, n_cells);
+        if (cells != NULL) view->cells = cells;
+        char *scratch = realloc(view->scratch, n_cells);
+        if (scratch != NULL) view->scratch = scratch;
+        if (cells == NULL || scratch == NULL) {
+            debug("Error allocating view of %zu cells\n", n_cells);
+            return -1;
+        }
+        view->capacity = n_cells;
+        view->sent_width = view->sent_height = 0;
+    }
+    if (frame_reserve(&view->wire, VIEW_HEADER_SIZE + n_cells * VIEW_CHANGE_SIZE) < 0) {
+        return -1;
+    }
+
+    int x = view->x, y = view->y;
+    int target = view_target(game_board, pacman_index);
+    if (target >= 0) {
+        x = game_board->pacmans[target].pos_x - width / 2;
+        y = game_board->pacmans[target].pos_y - height / 2;
+    }
+    if (x > game_board->width - width) x = game_board->width - width;
+    if (y > game_board->height - height) y = game_board->height - height;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+
+    char *scratch = view->scratch;
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            int index = (y + row) * game_board->width + x + col;
+            cell_rdlock(game_board, index);
+            board_pos_t *pos = &game_board->board[index];
+            char ch = frame_cell(pos);
+            if (pacman_index >= 0 && IS_PACMAN(pos->occupant) && PACMAN_INDEX(pos->occupant) != pacman_index) {
+                ch = 'c';
+            }
+            scratch[row * width + col] = ch;
+            cell_unlock(game_board, index);
+        }
+    }
+
+    // The client moves what it has by the change of origin, only the cells that differ from it go
+    int dx = x - view->x, dy = y - view->y;
+    keyframe = keyframe || view->sent_width != width || view->sent_height != height ||
+               abs(dx) >= width || abs(dy) >= height;
+    char *changes = view->wire.buf + VIEW_HEADER_SIZE;
+    int n_changes = 0;
+    for (int row = 0; row < height && !keyframe; row++) {
+        int old_row = row + dy;
+        for (int col = 0; col < width; col++) {
+            int old_col = col + dx;
+            int i = row * width + col;
+            if (old_row >= 0 && old_row < height && old_col >= 0 && old_col < width &&
+                view->cells[old_row * width + old_col] == scratch[i]) {
+                continue;
+            }
+            memcpy(changes, &i, sizeof(int));
+            changes[sizeof(int)] = scratch[i];
+            changes += VIEW_CHANGE_SIZE;
+            n_changes++;
+        }
+    }
+    if (keyframe || (size_t)n_changes * VIEW_CHANGE_SIZE >= n_cells) {
+        memcpy(view->wire.buf + VIEW_HEADER_SIZE, scratch, n_cells);
+        n_changes = -1;
+    }
+
+    encode_header(view->wire.buf, OP_CODE_VIEW, header);
+    if (pacman_index >= 0) {
+        patch_player(view->wire.buf, &game_board->pacmans[pacman_index]);
+    }
+    int window[5] = {x, y, width, height, n_changes};
+    memcpy(view->wire.buf + FRAME_HEADER_SIZE, window, sizeof(window));
+    view->wire.len = VIEW_HEADER_SIZE + (n_changes < 0 ? n_cells : (size_t)n_changes * VIEW_CHANGE_SIZE);
+
+    view->scratch = view->cells;
+    view->cells = scratch;
+    view->x = x;
+    view->y = y;
+    view->sent_width = width;
+    view->sent_height = height;
+    return 0;
+}
+
+void view_release(view_t *view) {
+    free(view->cells);
+    free(view->scratch);
+    frame_buffer_release(&view->wire);
+    memset(view, 0, sizeof(view_t));
+}
+
+int write_frame(int fd, frame_buffer_t *frame) {
+    size_t written = 0;
+    while (written < frame->len) {
+        ssize_t n = write(fd, frame->buf + written, frame->len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    return 0;
+}
+
+void subscribers_init(subscriber_list_t *list) {
+    list->n_subs = 0;
+    list->open = 0;
+    pthread_mutex_init(&list->lock, NULL);
+}
+
+void subscribers_destroy(subscriber_list_t *list) {
+    subscribers_close_all(list);
+    pthread_mutex_destroy(&list->lock);
+}
+
+void subscribers_open(subscriber_list_t *list) {
+    pthread_mutex_lock(&list->lock);
+    list->open = 1;
+    pthread_mutex_unlock(&list->lock);
+}
+
+int subscribers_add(subscriber_list_t *list, int fd, int policy) {
+    pthread_mutex_lock(&list->lock);
+    if (!list->open || list->n_subs >= MAX_SUBSCRIBERS) {
+        pthread_mutex_unlock(&list->lock);
+        return -1;
+    }
+    // Acknowledge under the lock so no frame can reach the pipe before the response
+    char response[2] = {OP_CODE_CONNECT, 0};
+    if (write(fd, response, sizeof(response)) != sizeof(response)) {
+        pthread_mutex_unlock(&list->lock);
+        return -1;
+    }
+    subscriber_t *sub = &list->subs[list->n_subs++];
+    sub->fd = fd;
+    sub->policy = policy;
+    sub->dropped = 0;
+    sub->consecutive_drops = 0;
+    pthread_mutex_unlock(&list->lock);
+    return 0;
+}
+
+// Helper private function to finish a frame the subscriber only took part of,
+// otherwise the next frame would start in the middle of this one
+static int finish_partial_write(int fd, frame_buffer_t *frame, size_t written, int timeout_ms) {
+    while (written < frame->len) {
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            return -1;
+        }
+        ssize_t n = write(fd, frame->buf + written, frame->len - written);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    return 0;
+}
+
+// Helper private function to detach subscriber i, the caller holds the list lock
+static void evict_subscriber(subscriber_list_t *list, int i) {
+    debug("Evicting subscriber fd %d after %d dropped frames\n", list->subs[i].fd, list->subs[i].dropped);
+    metrics_add(METRIC_SUBSCRIBERS_EVICTED, 1);
+    close(list->subs[i].fd);
+    list->subs[i] = list->subs[--list->n_subs];
+}
+
+int subscribers_count(subscriber_list_t *list) {
+    pthread_mutex_lock(&list->lock);
+    int n_subs = list->n_subs;
+    pthread_mutex_unlock(&list->lock);
+    return n_subs;
+}
+
+int deliver_frame(subscriber_t *sub, frame_buffer_t *frame) {
+    ssize_t n = write(sub->fd, frame->buf, frame->len);
+    if (n < 0 && errno == EAGAIN && sub->policy == SUB_POLICY_WAIT &&
+        finish_partial_write(sub->fd, frame, 0, LAST_FRAME_TIMEOUT_MS) == 0) {
+        // Nothing comes after this frame, so it is waited for instead of dropped
+        sub->consecutive_drops = 0;
+        return 1;
+    }
+    if (n == (ssize_t)frame->len ||
+        (n > 0 && finish_partial_write(sub->fd, frame, (size_t)n, PARTIAL_WRITE_TIMEOUT_MS) == 0)) {
+        sub->consecutive_drops = 0;
+        return 1;
+    }
+    sub->dropped++;
+    if (n < 0 && errno == EAGAIN && sub->policy == SUB_POLICY_DROP &&
+        sub->consecutive_drops < MAX_CONSECUTIVE_DROPS) {
+        // Pipe is full, this subscriber simply misses the frame
+        sub->consecutive_drops++;
+        return 0;
+    }
+    // EPIPE, a subscriber that exited, is detached at once like any other error
+    return -1;
+}
+
+int broadcast_frame(subscriber_list_t *list, frame_buffer_t *frame, int last_frame, int *dropped) {
+    // Written from a copy, so a slow subscriber never holds the lock attach_spectator takes;
+    // only the thread sending the session's frames detaches or closes subscribers, the copied
+    // pipes stay open meanwhile
+    subscriber_t subs[MAX_SUBSCRIBERS];
+    int results[MAX_SUBSCRIBERS];
+    pthread_mutex_lock(&list->lock);
+    int n_subs = list->n_subs;
+    memcpy(subs, list->subs, (size_t)n_subs * sizeof(subscriber_t));
+    pthread_mutex_unlock(&list->lock);
+
+    int delivered = 0;
+    *dropped = 0;
+    for (int i = 0; i < n_subs; i++) {
+        if (last_frame) subs[i].policy = SUB_POLICY_WAIT; // only in the copy
+        results[i] = deliver_frame(&subs[i], frame);
+        if (results[i] > 0) {
+            delivered++;
+        } else {
+            (*dropped)++;
+        }
+    }
+
+    pthread_mutex_lock(&list->lock);
+    for (int i = 0; i < n_subs; i++) {
+        for (int j = 0; j < list->n_subs; j++) {
+            if (list->subs[j].fd != subs[i].fd) continue;
+            list->subs[j].dropped = subs[i].dropped;
+            list->subs[j].consecutive_drops = subs[i].consecutive_drops;
+            if (results[i] < 0) {
+                evict_subscriber(list, j);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&list->lock);
+    if (*dropped > 0) {
+        metrics_add(METRIC_FRAMES_DROPPED, (unsigned long long)*dropped);
+    }
+    return delivered;
+}
+
+void subscribers_close_all(subscriber_list_t *list) {
+    pthread_mutex_lock(&list->lock);
+    for (int i = 0; i < list->n_subs; i++) {
+        close(list->subs[i].fd);
+    }
+    list->n_subs = 0;
+    list->open = 0;
+    pthread_mutex_unlock(&list->lock);
+}
@@ -2,6 +2,15 @@
 #include "display.h"
 #include "threads.h"
 #include "api.h"
+#include "frame.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "leaderboard.h"
+#include "level.h"
+#include "replay.h"
+#include "sim.h"
+#include "snapshot.h"
+#include "store.h"
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
@@ -24,52 +33,227 @@
 
 volatile sig_atomic_t sigusr1_received = 0;
 volatile sig_atomic_t sigint_received = 0;
+volatile sig_atomic_t sigusr2_received = 0;
+
+#define METRICS_FILE "metrics.prom"
+
+// Sessions whose client did not choose a seed are seeded from this and the number of sessions before them
+static uint64_t server_seed = 0;
+static uint64_t sessions_started = 0;
+
+static uint64_t session_seed(void) {
+    uint64_t n = __atomic_fetch_add(&sessions_started, 1, __ATOMIC_RELAXED);
+    return rng_derive(server_seed, n);
+}
 
 void handle_sigusr1(int signo) {
     (void)signo; 
     sigusr1_received = 1;
 }
 
+void handle_sigusr2(int signo) {
+    (void)signo;
+    sigusr2_received = 1;
+}
+
 void handle_sigint(int signo) {
     (void)signo;
     sigint_received = 1;
 }
 
-Board process_board_to_api(board_t* game_board, int victory, int game_over) {
-    Board board_data;
-    board_data.width = game_board->width;
-    board_data.height = game_board->height;
-    board_data.tempo = game_board->tempo;
-    board_data.victory = victory;
-    board_data.game_over = game_over;
-    board_data.accumulated_points = game_board->pacmans[0].points;
-
-    size_t data_size = (size_t)(board_data.width * board_data.height);
-    board_data.data = malloc(data_size + 1); 
-    for (int i = 0; i < game_board->height; i++) {
-        for (int j = 0; j < game_board->width; j++) {
-            int index = i * game_board->width + j;
-            pthread_rwlock_rdlock(&game_board->board[index].lock);
-            board_pos_t *pos = &game_board->board[index];
-            char ch = pos->content;
-            if (ch == ' ') {
-                if (pos->has_dot) {
-                    ch = '.';
-                }
-                if (pos->has_portal) {
-                    ch = '@';
-                }
+// Helper private function, whether a player gets whole frames: it declared no window and the
+// board is small enough
+static int wants_whole_frames(player_t *player, board_t *game_board) {
+    return player->view_width == 0 && game_board->width * game_board->height <= FULL_FRAME_MAX_CELLS;
+}
+
+// Encodes the board once and sends the same bytes to every spectator, then to every player
+// with its own points, last input and pacman patched in. Players with a window, and everyone on a
+// board too big for whole frames, get their window instead, and the board is then not walked
+int send_board_frame(board_t *game_board, int victory, int game_over, Board *board_data, frame_buffer_t *wire,
+                     game_state_t *game, int *tick, session_metrics_t *metrics) {
+    TRACE_BEGIN(tick_span);
+    long long start = now_us();
+    int small_board = game_board->width * game_board->height <= FULL_FRAME_MAX_CELLS;
+    int n_spectators = subscribers_count(&game->spectators);
+    int whole_frame = small_board && n_spectators > 0;
+    pthread_mutex_lock(&game->players_lock);
+    for (int i = 0; i < MAX_PACMANS && !whole_frame; i++) {
+        player_t *player = &game->players[i];
+        whole_frame = player->connected && !player->left && wants_whole_frames(player, game_board);
+    }
+    pthread_mutex_unlock(&game->players_lock);
+    if (whole_frame) {
+        if (process_board_to_api(game_board, victory, game_over, board_data) < 0) {
+            return -1;
+        }
+    } else {
+        process_board_header(game_board, victory, game_over, board_data);
+    }
+    // Clients pace their input on this tick number and timestamp
+    board_data->tick = (*tick)++;
+    board_data->server_time_us = now_us();
+    if (whole_frame && encode_board_frame(board_data, wire) < 0) {
+        return -1;
+    }
+    metrics_observe(METRIC_ENCODE_US, now_us() - start);
+    TRACE_END(tick_span, "frame encode");
+
+    TRACE_BEGIN(write_span);
+    int dropped = 0;
+    int delivered = 0;
+    unsigned long long bytes = 0;
+    if (n_spectators > 0) {
+        // Spectators may miss frames, a window is only sent to them as keyframes
+        frame_buffer_t *spectator_frame = wire;
+        if (!small_board) {
+            if (game->spectator_view.width == 0) {
+                view_resize(&game->spectator_view, DEFAULT_VIEW_WIDTH, DEFAULT_VIEW_HEIGHT);
             }
-            if (ch == 'W') ch = '#';
-            if (ch == 'P') ch = 'C';
-            if (ch == 'G') ch = 'M';
-            board_data.data[index] = ch;
-            pthread_rwlock_unlock(&game_board->board[index].lock);
+            spectator_frame = encode_view_frame(game_board, board_data, &game->spectator_view, -1, 1) == 0
+                            ? &game->spectator_view.wire : NULL;
+        }
+        if (spectator_frame != NULL) {
+            delivered = broadcast_frame(&game->spectators, spectator_frame, game_over, &dropped);
+            bytes += (unsigned long long)delivered * spectator_frame->len;
         }
     }
-    board_data.data[data_size] = '\0'; 
+    // Every player's frame is made under players_lock and written once it is released, so a
+    // player that stops reading only misses its own frames. Only the thread sending the frames
+    // closes player pipes, with the level over, the copied ones stay open meanwhile
+    subscriber_t targets[MAX_PACMANS];
+    frame_buffer_t *frames[MAX_PACMANS];
+    int indices[MAX_PACMANS];
+    int n_targets = 0;
+    pthread_mutex_lock(&game->players_lock);
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        player_t *player = &game->players[i];
+        if (!player->connected || player->left) continue;
+        frame_buffer_t *frame = &player->frame;
+        if (wants_whole_frames(player, game_board)) {
+            if (!whole_frame) continue; // joined since the board was walked, from the next tick
+            personalize_frame(board_data, wire, game_board, i);
+            if (frame_buffer_copy(frame, wire) < 0) {
+                continue;
+            }
+        } else {
+            int width = player->view_width > 0 ? player->view_width : DEFAULT_VIEW_WIDTH;
+            int height = player->view_height > 0 ? player->view_height : DEFAULT_VIEW_HEIGHT;
+            if (player->view.width != width || player->view.height != height) {
+                view_resize(&player->view, width, height);
+            }
+            if (encode_view_frame(game_board, board_data, &player->view, i, 0) < 0) {
+                continue;
+            }
+            frame = &player->view.wire;
+        }
+        // The last frame, with the outcome, is waited for
+        targets[n_targets] = (subscriber_t){.fd = player->notif_fd, .policy = game_over ? SUB_POLICY_WAIT : SUB_POLICY_DROP,
+                                            .consecutive_drops = player->consecutive_drops};
+        frames[n_targets] = frame;
+        indices[n_targets++] = i;
+    }
+    pthread_mutex_unlock(&game->players_lock);
+
+    int results[MAX_PACMANS];
+    int player_drops = 0;
+    for (int k = 0; k < n_targets; k++) {
+        results[k] = deliver_frame(&targets[k], frames[k]);
+        if (results[k] > 0) {
+            delivered++;
+            bytes += frames[k]->len;
+        } else {
+            player_drops++;
+        }
+    }
+    if (player_drops > 0) {
+        metrics_add(METRIC_FRAMES_DROPPED, (unsigned long long)player_drops);
+        dropped += player_drops;
+    }
+    // A player whose pipe stayed full for MAX_CONSECUTIVE_DROPS frames, or whose client is gone,
+    // leaves the session like a player that quit
+    int evicted[MAX_PACMANS];
+    int n_evicted = 0;
+    pthread_mutex_lock(&game->players_lock);
+    for (int k = 0; k < n_targets; k++) {
+        player_t *player = &game->players[indices[k]];
+        player->consecutive_drops = targets[k].consecutive_drops;
+        if (results[k] < 0 && !player->left) {
+            player->left = 1;
+            store_player_gone(game->region, indices[k]);
+            if (player->on_board) evicted[n_evicted++] = indices[k];
+        }
+    }
+    pthread_mutex_unlock(&game->players_lock);
+    for (int k = 0; k < n_evicted; k++) {
+        debug("Player %d of game %d stopped reading its frames, it leaves\n", evicted[k], game_board->game_id);
+        recorded_remove_pacman(game_board, evicted[k]);
+    }
+    TRACE_END(write_span, "pipe write");
+
+    metrics_add(METRIC_FRAMES_SENT, (unsigned long long)delivered);
+    metrics_add(METRIC_BYTES_SENT, bytes);
+    metrics_observe(METRIC_TICK_US, now_us() - start);
+    session_metrics_add(&metrics->ticks, 1);
+    session_metrics_add(&metrics->frames_sent, (unsigned long long)delivered);
+    session_metrics_add(&metrics->bytes_sent, bytes);
+    session_metrics_add(&metrics->frames_dropped, (unsigned long long)dropped);
+    TRACE_END(tick_span, "tick");
+    return 0;
+}
 
-    return board_data;
+void *pacman_thread(void *arg);
+
+// Puts the players that are not on the board yet on it, each with its own pacman thread; the
+// host's pacman is put there by load_level, the others next to it. A player that finds no room
+// is tried again on the next tick
+// @return how many players are on the board
+static int admit_players(game_state_t *game, board_t *game_board, pacman_thread_args_t *pacman_args) {
+    int on_board = 0;
+    pthread_mutex_lock(&game->players_lock);
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        player_t *player = &game->players[i];
+        // A pacman still alive on the board is a player's of a backup that was loaded
+        if (player->connected && !player->left && !player->on_board &&
+            (i == 0 || game_board->pacmans[i].alive || recorded_add_pacman(game_board, i, player->points) == 0)) {
+            pacman_args[i].req_pipe_fd = player->req_fd;
+            if (pthread_create(&player->tid, NULL, pacman_thread, &pacman_args[i]) != 0) {
+                perror("pthread_create");
+                exit(EXIT_FAILURE);
+            }
+            player->on_board = 1;
+            if (i > 0) debug("Player %d joined game %d\n", i, game_board->game_id);
+        }
+        on_board += player->on_board;
+    }
+    pthread_mutex_unlock(&game->players_lock);
+    return on_board;
+}
+
+// Waits for the pacman threads of a level that ended, keeps every player's points for the next
+// level and frees the slots of the players that left
+static void players_end_level(game_state_t *game, board_t *game_board) {
+    // Only the screen thread, already joined, admits players: on_board and tid are stable
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        player_t *player = &game->players[i];
+        if (!player->on_board) continue;
+        pthread_join(player->tid, NULL);
+        player->points = game_board->pacmans[i].points;
+    }
+    pthread_mutex_lock(&game->players_lock);
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        player_t *player = &game->players[i];
+        if (player->on_board) store_player_points(game->region, i, player->points);
+        player->on_board = 0;
+        if (player->connected && player->left) {
+            close(player->req_fd);
+            close(player->notif_fd);
+            view_release(&player->view);
+            frame_buffer_release(&player->frame);
+            memset(player, 0, sizeof(player_t));
+        }
+    }
+    pthread_mutex_unlock(&game->players_lock);
 }
 
 void *screen_thread(void *arg) {
@@ -78,19 +262,22 @@ void *screen_thread(void *arg) {
     int *leave_thread = args->leave_thread;
     int tempo = args->game_board->tempo;
     int *victory = args->victory;
-    int notif_fd = args->notif_fd;
     int *game_over = args->game_over;
+    Board *board_data = args->frame;
+    frame_buffer_t *wire = args->wire;
+    TRACE_THREAD("screen", -1, game_board->game_id);
     debug("SCREEN THREAD STARTED\n");
     debug("Victory: %d\nGame Over: %d\n", *victory, *game_over);
 
     while (*leave_thread == 0) {
-        Board board_data = process_board_to_api(game_board, *victory, *game_over);
-        if (writeBoardChanges(notif_fd, board_data) < 0) {
-            debug("Error writing to notification pipe: %s\n", strerror(errno));
-            free(board_data.data);
+        // Players that joined since the last tick enter the board with this frame
+        admit_players(args->game_state, game_board, args->pacman_args);
+        if (send_board_frame(game_board, *victory, *game_over, board_data, wire, args->game_state, args->tick, args->metrics) < 0) {
+            debug("Error encoding frame\n");
             break;
         }
-        free(board_data.data);
+        checkpoint_session(game_board, &args->game_state->checkpoint);
+        store_tick(args->game_state->region, game_board, *args->tick - 1);
         sleep_ms(tempo);
     }
     return NULL; 
@@ -103,31 +290,237 @@ void *ghost_thread(void *arg) {
     int *leave_thread = args->leave_thread;
 
     ghost_t* ghost = &game_board->ghosts[ghost_index];
+    TRACE_THREAD("ghost", ghost_index, game_board->game_id);
     while (*leave_thread == 0) {
-        move_ghost(game_board, ghost_index, &ghost->moves[ghost->current_move % ghost->n_moves]);
+        TRACE_BEGIN(move_span);
+        recorded_move_ghost(game_board, ghost_index, &ghost->moves[ghost->current_move % ghost->n_moves]);
+        TRACE_END(move_span, "ghost move");
 
         sleep_ms(game_board->tempo);
     }
     return NULL; 
 }
 
+// Helper private function, whether a pacman is still alive on the board
+static int any_pacman_alive(board_t *game_board) {
+    int n_pacmans = __atomic_load_n(&game_board->n_pacmans, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n_pacmans; i++) {
+        if (__atomic_load_n(&game_board->pacmans[i].alive, __ATOMIC_ACQUIRE)) return 1;
+    }
+    return 0;
+}
+
+// Helper private function that sums the points of every pacman, the score of a shared session
+static int session_points(board_t *game_board) {
+    int points = 0;
+    int n_pacmans = __atomic_load_n(&game_board->n_pacmans, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n_pacmans; i++) {
+        points += game_board->pacmans[i].points;
+    }
+    return points;
+}
+
+// Helper private function for a pacman thread that stops: a portal or a backup loaded ends the
+// level for every player, a death or a player leaving only ends it when no pacman is left
+static void pacman_level_done(pacman_thread_args_t *args, int outcome) {
+    PROFILED_WRLOCK(LOCK_SITE_SESSION, args->lock);
+    if (*args->leave_thread == 0 && (outcome != QUIT_GAME || !any_pacman_alive(args->game_board))) {
+        *args->result = outcome;
+        *args->leave_thread = true;
+    }
+    pthread_rwlock_unlock(args->lock);
+}
+
+// Helper private function for a player that quit or disconnected: its pacman leaves the board
+// and its pipes are closed when the level ends
+static void player_leaves(pacman_thread_args_t *args) {
+    game_state_t *game = args->game_state;
+    pthread_mutex_lock(&game->players_lock);
+    game->players[args->pacman_index].left = 1;
+    store_player_gone(game->region, args->pacman_index);
+    pthread_mutex_unlock(&game->players_lock);
+    // A dead pacman is no longer on the board, its last cell may be another entity's
+    if (__atomic_load_n(&args->game_board->pacmans[args->pacman_index].alive, __ATOMIC_ACQUIRE)) {
+        recorded_remove_pacman(args->game_board, args->pacman_index);
+    }
+    debug("Player %d left game %d\n", args->pacman_index, args->game_board->game_id);
+}
+
+// Helper private function for an OP_CODE_VIEWPORT request: the window the player's frames show
+// from now on, not a move
+static void apply_view_request(pacman_thread_args_t *args, const play_request_t *input) {
+    game_state_t *game = args->game_state;
+    pthread_mutex_lock(&game->players_lock);
+    game->players[args->pacman_index].view_width = input->view_width;
+    game->players[args->pacman_index].view_height = input->view_height;
+    store_player_view(game->region, args->pacman_index, input->view_width, input->view_height);
+    pthread_mutex_unlock(&game->players_lock);
+}
+
+// Helper private function for a G: the session's backup is captured again, the game goes on
+static void create_backup(game_state_t *game, board_t *game_board) {
+    pthread_mutex_lock(&game->backup_lock);
+    long long start = now_us();
+    if (snapshot_capture(game_board, &game->backup) < 0) {
+        debug("Error capturing the backup of game %d\n", game_board->game_id);
+    } else {
+        debug("Game %d backed up level %s in %lld us\n", game_board->game_id, game_board->level_name, now_us() - start);
+    }
+    pthread_mutex_unlock(&game->backup_lock);
+}
+
+// Helper private function, whether a G captured a backup in this session
+static int has_backup(game_state_t *game) {
+    pthread_mutex_lock(&game->backup_lock);
+    int captured = game->backup.level_name[0] != '\0';
+    pthread_mutex_unlock(&game->backup_lock);
+    return captured;
+}
+
+// Helper private function for the level a snapshot was captured from
+// @return its index in levels, -1 if nothing was captured or the server has no such level, of
+// the snapshot's size
+static int snapshot_level(const snapshot_t *snap, level_info *levels, int n_levels) {
+    int level = -1;
+    for (int i = 0; i < n_levels && snap->level_name[0] != '\0'; i++) {
+        if (strcmp(levels[i].file_name, snap->level_name) == 0 && levels[i].width == snap->width &&
+            levels[i].height == snap->height) {
+            level = i;
+        }
+    }
+    return level;
+}
+
+// Helper private function for the level of the session's backup
+// @return its index in levels, -1 if there is no backup or the server has no such level
+static int backup_level(game_state_t *game, level_info *levels, int n_levels) {
+    pthread_mutex_lock(&game->backup_lock);
+    int level = snapshot_level(&game->backup, levels, n_levels);
+    pthread_mutex_unlock(&game->backup_lock);
+    return level;
+}
+
+// Helper private function that puts the loaded level back in the state of snap, its threads
+// stopped: the pacmans of players that are gone since leave the board, the players that
+// joined since are put on it by admit_players
+// @return 0, -1 if snap is not of this level
+static int load_snapshot(game_state_t *game, board_t *game_board, const snapshot_t *snap) {
+    if (recorded_restore(game_board, snap) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < game_board->n_pacmans; i++) {
+        pthread_mutex_lock(&game->players_lock);
+        int gone = !game->players[i].connected || game->players[i].left;
+        pthread_mutex_unlock(&game->players_lock);
+        if (gone && game_board->pacmans[i].alive) {
+            recorded_remove_pacman(game_board, i);
+        }
+    }
+    return 0;
+}
+
+// Helper private function that loads the session's backup on the level it was captured from
+static void load_backup(game_state_t *game, board_t *game_board) {
+    pthread_mutex_lock(&game->backup_lock);
+    long long start = now_us();
+    int restored = load_snapshot(game, game_board, &game->backup) == 0;
+    pthread_mutex_unlock(&game->backup_lock);
+    if (!restored) {
+        debug("Game %d could not load its backup\n", game_board->game_id);
+        return;
+    }
+    debug("Game %d loaded its backup of level %s in %lld us\n", game_board->game_id, game_board->level_name, now_us() - start);
+}
+
+// Helper private function that reopens the pipes of the players of a session the last server
+// left in the store as their clients come back, waiting at most REATTACH_TIMEOUT_MS for them;
+// the others are gone. Runs before the session accepts players, no join takes their slots
+// @return how many players came back
+static int reattach_players(game_state_t *game, session_region_t *region) {
+    int waiting[MAX_PACMANS];
+    int n_waiting = 0;
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        waiting[i] = region->players[i].connected;
+        n_waiting += waiting[i];
+    }
+    int n_back = 0;
+    long long deadline = now_us() + REATTACH_TIMEOUT_MS * 1000LL;
+    while (n_waiting > 0 && now_us() < deadline) {
+        for (int i = 0; i < MAX_PACMANS; i++) {
+            stored_player_t *stored = &region->players[i];
+            int listening_fd = waiting[i] ? client_listening(stored->notif_pipe) : -1;
+            if (listening_fd < 0) continue;
+            waiting[i] = 0;
+            n_waiting--;
+            int req_fd, notif_fd;
+            int opened = open_client_pipes(stored->req_pipe, stored->notif_pipe, &req_fd, &notif_fd) == 0;
+            // Closed only now, a client woken by the last writer leaving would read the end of file
+            close(listening_fd);
+            pthread_mutex_lock(&game->players_lock);
+            if (!opened) {
+                store_player_gone(region, i);
+            } else {
+                game->players[i] = (player_t){.connected = 1, .req_fd = req_fd, .notif_fd = notif_fd, .points = stored->points,
+                                              .view_width = stored->view_width, .view_height = stored->view_height};
+                n_back++;
+            }
+            pthread_mutex_unlock(&game->players_lock);
+        }
+        if (n_waiting > 0) sleep_ms(REATTACH_POLL_MS);
+    }
+    pthread_mutex_lock(&game->players_lock);
+    for (int i = 0; i < MAX_PACMANS; i++) {
+        if (waiting[i]) store_player_gone(region, i);
+    }
+    pthread_mutex_unlock(&game->players_lock);
+    return n_back;
+}
+
 void *pacman_thread(void *arg) {
     debug("PACMAN THREAD STARTED\n");
     pacman_thread_args_t *args = (pacman_thread_args_t *)arg;
     board_t *game_board = args->game_board;
-    pacman_t *pacman = &game_board->pacmans[0];
+    pacman_t *pacman = &game_board->pacmans[args->pacman_index];
     int *result = args->result;
     int *leave_thread = args->leave_thread;
     int req_pipe_fd = args->req_pipe_fd;
     pthread_rwlock_t *lock = args->lock;
+    TRACE_THREAD("pacman", args->pacman_index, game_board->game_id);
+    int last_points = pacman->points; // already in the leaderboard
 
-    while (pacman->alive) {
+    int dead_reported = 0; // the level was told the pacman died
+    while (*leave_thread == 0) {
         command_t *play;
         command_t c;
+        play_request_t input = {0};
+
+        // The player's requests are read whatever moves its pacman, and once it died until the
+        // level ends: a new window applies at once
+        char request = get_input_non_blocking(req_pipe_fd, &input);
+        if (request == 'V') {
+            apply_view_request(args, &input);
+            continue;
+        }
+        if (!pacman->alive) {
+            if (!dead_reported) {
+                pacman_level_done(args, QUIT_GAME);
+                dead_reported = 1;
+            }
+            if (request == 'Q') {
+                player_leaves(args);
+                break;
+            }
+            if (request == '\0') {
+                wait_for_input(req_pipe_fd, game_board->tempo);
+            }
+            continue;
+        }
 
         if (pacman->n_moves == 0) { // Se for entrada do usuário
-            c.command = get_input_non_blocking(req_pipe_fd);
+            c.command = request;
             if (c.command == '\0') {
+                // Sleep until the client sends something instead of spinning, at most one tick
+                wait_for_input(req_pipe_fd, game_board->tempo);
                 continue; // Sem entrada, continua
             }
 
@@ -136,7 +529,7 @@ void *pacman_thread(void *arg) {
         } else { // Movimentos predefinidos
             c.command = get_input();
             if (c.command == 'Q'){
-                pthread_rwlock_wrlock(lock);
+                PROFILED_WRLOCK(LOCK_SITE_SESSION, lock);
                 *result = QUIT_GAME;
                 *leave_thread = true;
                 pthread_rwlock_unlock(lock);
@@ -144,287 +537,65 @@ void *pacman_thread(void *arg) {
                 
             }
             play = &pacman->moves[pacman->current_move % pacman->n_moves];
-            debug("MOVE %d - %c\n", pacman->current_move % pacman->n_moves, play->command);
+            log_trace("MOVE %d - %c\n", pacman->current_move % pacman->n_moves, play->command);
         }
 
         if (play->command == 'Q') {
-            pthread_rwlock_wrlock(lock);
-            *result = QUIT_GAME;
-            *leave_thread = true;
-            pthread_rwlock_unlock(lock);
+            player_leaves(args);
             break;
         }
 
-        int move = move_pacman(game_board, 0, play);
-        if (args->game_state != NULL) {
-            pthread_rwlock_wrlock(&args->game_state->lock);
-            args->game_state->score = pacman->points;
-            pthread_rwlock_unlock(&args->game_state->lock);
+        TRACE_BEGIN(move_span);
+        int move = recorded_move_pacman(game_board, args->pacman_index, play);
+        TRACE_END(move_span, "pacman move");
+        if (input.seq != 0) {
+            // Echoed in the player's next frames so the client can measure input latency; the
+            // screen thread reads seq first, see read_input_echo
+            __atomic_store_n(&pacman->input_apply_us, now_us(), __ATOMIC_RELAXED);
+            __atomic_store_n(&pacman->input_seq, input.seq, __ATOMIC_RELEASE);
+        }
+        if (args->game_state != NULL && pacman->points != last_points) {
+            last_points = pacman->points;
+            leaderboard_update(args->game_state->client_id, session_points(game_board));
+        }
+
+        // G and L only took the pacman's turn, the backup is the session's
+        if (play->command == 'G' && args->game_state != NULL) {
+            create_backup(args->game_state, game_board);
+        }
+        if (play->command == 'L' && args->game_state != NULL && has_backup(args->game_state)) {
+            pacman_level_done(args, LOAD_BACKUP);
+            break;
         }
 
         if (move == REACHED_PORTAL) {
-            pthread_rwlock_wrlock(lock);
-            *result = NEXT_LEVEL;
-            *leave_thread = true;
-            pthread_rwlock_unlock(lock);
+            pacman_level_done(args, NEXT_LEVEL);
             break; // Pacman venceu
         }
 
         if (move == DEAD_PACMAN) {
-            pthread_rwlock_wrlock(lock);
-            *result = QUIT_GAME;
-            *leave_thread = true;
-            pthread_rwlock_unlock(lock);
-            break; // Pacman morreu
+            continue; // Pacman morreu
         }
 
         sleep_ms(game_board->tempo); // Aguarda o tempo definido
     }
-    if (!pacman->alive) {
-        pthread_rwlock_wrlock(lock);
-        *result = QUIT_GAME;
-        *leave_thread = true;
-        pthread_rwlock_unlock(lock);
+    // A living pacman that left is gone from the board too
+    if (!pacman->alive && !dead_reported) {
+        pacman_level_done(args, QUIT_GAME);
     }
 
     return NULL;
 }
 
 
-void process_board(board_pos_t *board, char *board_str, int height, int width) {
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            int index = i * width + j;
-            char ch = board_str[index];
-            pthread_rwlock_init(&board[index].lock, NULL);
-            switch (ch) {
-                case 'X': // Wall
-                    board[index].content = 'W';
-                    board[index].has_dot = 0;
-                    board[index].has_portal = 0;
-                    break;
-                case 'o': // Free space
-                    board[index].content = ' ';
-                    board[index].has_dot = 1;
-                    board[index].has_portal = 0;
-                    break;
-                case '@': // Portal
-                    board[index].content = ' ';
-                    board[index].has_dot = 0;
-                    board[index].has_portal = 1;
-                    break;
-            }
-
-        }
-    }
-}
-
-char* readFile (char *file) {
-    int f = open(file, O_RDONLY);
-    if (f < 0) {
-        exit(EXIT_FAILURE);
-    }
-    ssize_t bytes_read;
-    char buffer[1024];
-    size_t fileSize = 0;
-    char *fileContent = NULL;
-    while ((bytes_read = read(f, buffer, sizeof(buffer)-1)) > 0) {
-        buffer[bytes_read] = '\0'; // Garante que o buffer seja uma string válida
-
-        fileContent = realloc(fileContent, fileSize + bytes_read + 1);
-        if (fileContent == NULL) {
-            close(f);
-            exit(EXIT_FAILURE);
-        }
-
-        memcpy(fileContent + fileSize, buffer, bytes_read + 1);
-        fileSize += bytes_read;
-    }
-    close(f);
-    return fileContent;
-}
-
-void build_command(command_t *command, char *line) {
-    sscanf(line, "%c", &command->command);
-    if (command->command == 'T') {
-        sscanf(line, "T %d", &command->turns_left);
-    }
-    command->turns = 1;
-}
-
-char* getFileName(char *file) {
-    char *filename = strrchr(file, '/');
-    if (filename != NULL) {
-        return filename + 1;
-    }
-    return file;
-}
-
-pac_ghost_info getPacGhostInfo(char *file) { //esqueceu se de atribuir nmoves
-    pac_ghost_info info;
-    char *fileInfo = readFile(file);
-    strncpy(info.file_name, getFileName(file), MAX_FILENAME - 1);
-    char *saveptr_line; // Estado para strtok_r
-    char *line = strtok_r(fileInfo, "\n", &saveptr_line);
-    while (line != NULL) {
-        if (strncmp(line, "#", 1) == 0) {
-            line = strtok_r(NULL, "\n", &saveptr_line);
-            continue;
-        } else if (strncmp(line, "PASSO", 5) == 0) {
-            sscanf(line, "PASSO %d", &info.passo);
-        } else if (strncmp(line, "POS", 3) == 0) {
-            sscanf(line, "POS %d %d", &info.pos_x, &info.pos_y);
-        } else {
-            int n_moves = 0;
-            while (line != NULL && n_moves < MAX_MOVES) {
-                build_command(&info.moves[n_moves], line);
-                n_moves++;
-                line = strtok_r(NULL, "\n", &saveptr_line);
-            }
-            info.n_moves = n_moves;
-            break;
-        }
-        line = strtok_r(NULL, "\n", &saveptr_line);
-    }
-    free(fileInfo);
-    return info;
-}
-
-char* getPath(char *base_path, char *file_name) {
-    char *last_slash = strrchr(base_path, '/');
-    char *path;
-    if (last_slash != NULL) {
-        size_t dir_length = last_slash - base_path + 1; // +1 para incluir a barra
-        path = malloc(dir_length + strlen(file_name) + 1); // +1 para o terminador nulo
-        strncpy(path, base_path, dir_length);
-        path[dir_length] = '\0'; // Adiciona o terminador nulo
-        strcat(path, file_name);
-    } else {
-        path = malloc(strlen(file_name) + 1);
-        strcpy(path, file_name);
-    }
-    return path;
-}
-
-level_info getLevelInfo(char *level_file) {
-    level_info info;
-    info.has_pacman = 0;
-    char* fileInfo = readFile(level_file);
-    strncpy(info.file_name, getFileName(level_file), MAX_FILENAME - 1);
-    char *board = NULL;
-    char *saveptr_line; // Estado para strtok_r
-    char *line = strtok_r(fileInfo, "\n", &saveptr_line);
-    while (line != NULL) {
-        if (strncmp(line, "DIM", 3) == 0) {
-            sscanf(line, "DIM %d %d", &info.width, &info.height);
-            info.board = malloc(sizeof(board_pos_t) * (info.width * info.height + 1));
-            board = malloc(info.width * info.height + 1);
-            board[0] = '\0';
-        } else if (strncmp(line, "TEMPO", 5) == 0) {
-            sscanf(line, "TEMPO %d", &info.tempo);
-        } else if (strncmp(line, "PAC", 3) == 0) {
-            sscanf(line, "PAC %s", info.pacman_file);
-            char *path = getPath(level_file, info.pacman_file);
-            info.pacman_info = getPacGhostInfo(path);
-            free(path);
-            info.has_pacman = 1;
-        } else if (strncmp(line, "MON", 3) == 0) {
-            int ghost_index = 0;
-            char *saveptr_token; // Estado para strtok_r dentro da linha
-            char *token = strtok_r(line + 4, " ", &saveptr_token);
-            while (token != NULL) {
-                if (ghost_index >= MAX_GHOSTS) { 
-                    break;
-                }
-                strncpy(info.ghost_files[ghost_index], token, MAX_FILENAME - 1);
-                info.ghost_files[ghost_index][MAX_FILENAME - 1] = '\0'; 
-                char *path = getPath(level_file, info.ghost_files[ghost_index]);
-                info.ghosts_info[ghost_index] = getPacGhostInfo(path);
-                free(path);
-                ghost_index++;
-                token = strtok_r(NULL, " ", &saveptr_token);
-            }
-            info.n_ghosts = ghost_index;
-        } else if (strncmp(line, "#", 1) == 0) {
-            line = strtok_r(NULL, "\n", &saveptr_line);
-            continue;
-        } else {
-            strcat(board, line);
-            line = strtok_r(NULL, "\n", &saveptr_line);
-            while (line != NULL) {
-                strcat(board, line);
-                line = strtok_r(NULL, "\n", &saveptr_line);
-            }
-            process_board(info.board, board, info.height, info.width);
-            free(board);
-            break;
-            
-        }
-        line = strtok_r(NULL, "\n", &saveptr_line);
-        
-    }
-    free(fileInfo);
-    return info;
-}
-
-void *read_file_thread(void *arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-
-    *(args->level_info) = getLevelInfo(args->path);
-
-    free(args);
-    return NULL;
-}
-
-int read_dir(char *argv, level_info *level_info) {
-    DIR *dir = opendir(argv);
-    if (dir == NULL) {
-        return 1;
-    }
-    struct dirent *entry;
-    int x = 0;
-
-    pthread_t threads[MAX_LEVELS];
-    int thread_count = 0;
-
-    while ((entry = readdir(dir)) != NULL) { // Lê cada ficheiro na diretoria
-        const char *dot = strrchr(entry->d_name, '.');
-        char extension[4] = "";
-        if (dot != NULL && *(dot + 1) != '\0') {
-            strncpy(extension, dot + 1, sizeof(extension) - 1); 
-            extension[sizeof(extension) - 1] = '\0';
-        }
-        if (extension[0] == 'l') {
-            thread_args_t *args = malloc(sizeof(thread_args_t));
-            sprintf(args->path, "%s/%s", argv, entry->d_name);
-            args->level_info = &level_info[x];
-            
-            if (pthread_create(&threads[thread_count], NULL, read_file_thread, args) != 0) {
-                perror("pthread_create");
-                free(args);
-                continue;
-            }
-            thread_count++;
-            x++;
-        }
-        
-    }
-    
-    for (int j = 0; j < thread_count; j++) {
-        pthread_join(threads[j], NULL);
-    }
-    
-    closedir(dir);
-    return x;
-}
-
-void pacman_thread_args_init(pacman_thread_args_t *args, board_t *game_board, int *result, int *leave_thread, pthread_rwlock_t *lock, int req_pipe_fd, game_state_t *game_state) {
+void pacman_thread_args_init(pacman_thread_args_t *args, board_t *game_board, int *result, int *leave_thread, pthread_rwlock_t *lock, int req_pipe_fd, game_state_t *game_state, int pacman_index) {
     args->game_board = game_board;
     args->result = result;
     args->leave_thread = leave_thread;
     args->lock = lock;
     args->req_pipe_fd = req_pipe_fd;
     args->game_state = game_state;
+    args->pacman_index = pacman_index;
 }
 
 void ghost_thread_args_init(ghost_thread_args_t *args, board_t *game_board, int ghost_index, int *leave_thread) {
@@ -442,6 +613,7 @@ connect_request_t queue_pop(Queue *head) {
     connect_request_t request = first_node->request;
     head->next = first_node->next;
     free(first_node);
+    metrics_gauge_add(METRIC_QUEUE_DEPTH, -1);
     return request;
 }
 
@@ -454,66 +626,163 @@ void *worker_thread(void *arg) {
     sem_t *sem_items = args->sem_items;
     pthread_mutex_t *mutex_queue = args->mutex_queue;
     args->game_state->client_id = thread_id;
+    // Frame buffers owned by this worker, reused by every session it serves
+    Board frame = {0};
+    frame_buffer_t wire = {0};
+    game_state_t *game_state = args->game_state;
+    subscriber_list_t *spectators = &game_state->spectators;
+    session_metrics_t *metrics = args->game_state->metrics;
+    TRACE_THREAD("worker", -1, thread_id + 1);
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
     int s = pthread_sigmask(SIG_BLOCK, &set, NULL);
-    if (s != 0) debug("Erro ao mascarar SIGUSR1 na worker thread\n");
+    if (s != 0) debug("Erro ao mascarar SIGUSR1/SIGUSR2 na worker thread\n");
+    session_region_t *region = store_region(thread_id + 1);
+    game_state->region = region;
+    // A session the last server left on this slot goes on before any request is served
+    int resume = store_resumable(region);
 
     while (true) {
         int client_req_fd = -1;
         int client_notif_fd = -1;
-        sem_wait(sem_items);
-        debug("Worker thread %d woke up, checking queue\n", thread_id);
-        pthread_mutex_lock(mutex_queue);
+        connect_request_t request = {0};
+        int lvl = 0;
+        if (resume) {
+            lvl = snapshot_level(store_snapshot(region), level_info, n_levels);
+            if (lvl < 0) {
+                debug("Game %d can not resume its session, the server has no level %s\n", thread_id + 1, store_snapshot(region)->level_name);
+                store_session_end(region);
+                resume = 0;
+                lvl = 0;
+            }
+        }
+        if (!resume) {
+            sem_wait(sem_items);
+            log_trace("Worker thread %d woke up, checking queue\n", thread_id);
+            PROFILED_MUTEX_LOCK(LOCK_SITE_QUEUE, mutex_queue);
 
-        connect_request_t request = queue_pop(queue);
-        pthread_mutex_unlock(mutex_queue);
+            request = queue_pop(queue);
+            pthread_mutex_unlock(mutex_queue);
 
-        debug("Worker thread %d processing request: %d %s %s\n", thread_id, request.op_code, request.rep_pipe, request.notif_pipe);
+            debug("Worker thread %d processing request: %d %s %s\n", thread_id, request.op_code, request.rep_pipe, request.notif_pipe);
 
-        if (open_client_pipes(request.rep_pipe, request.notif_pipe, &client_req_fd, &client_notif_fd) < 0) {
-            debug("Error opening client pipes\n");
-            continue;
+            if (open_client_pipes(request.rep_pipe, request.notif_pipe, &client_req_fd, &client_notif_fd) < 0) {
+                debug("Error opening client pipes\n");
+                continue;
+            }
         }
 
         int accumulated_points = 0;
         int end_game = 0;
         board_t game_board = {0};
-        int lvl = 0;
+        game_board.game_id = thread_id + 1;
+        game_board.rng_seed = resume ? region->seed : request.seeded ? request.seed : session_seed();
+        uint64_t seed = game_board.rng_seed;
+        game_board.recorder = recorder_open(game_board.game_id, seed);
+        if (resume) {
+            log_info("Game %d resumes its session seeded with %llu at tick %d\n", game_board.game_id, (unsigned long long)seed, region->tick);
+        } else {
+            log_info("Game %d seeded with %llu%s\n", game_board.game_id, (unsigned long long)seed,
+                     request.seeded ? " by the client" : "");
+        }
         int result;
         int leave_thread = 0;
         int victory = 0;
         pthread_rwlock_t l = PTHREAD_RWLOCK_INITIALIZER;
 
-        pacman_thread_args_t pacman_args;
-        pthread_rwlock_wrlock(&args->game_state->lock);
-        args->game_state->is_active = 1;
-        args->game_state->score = 0;
-        pthread_rwlock_unlock(&args->game_state->lock);
-        pacman_thread_args_init(&pacman_args, &game_board, &result, &leave_thread, &l, client_req_fd, args->game_state);
-        pthread_t pacman_tid;
+        pacman_thread_args_t pacman_args[MAX_PACMANS];
+        PROFILED_WRLOCK(LOCK_SITE_GAME_STATE, &game_state->lock);
+        game_state->is_active = 1;
+        pthread_rwlock_unlock(&game_state->lock);
+        leaderboard_start(thread_id);
+        for (int i = 0; i < MAX_PACMANS; i++) {
+            pacman_thread_args_init(&pacman_args[i], &game_board, &result, &leave_thread, &l, -1, game_state, i);
+        }
+        int tick = 0;
+        if (resume) {
+            // Its frames go on from the tick the last server sent
+            int n_back = reattach_players(game_state, region);
+            debug("Game %d got %d player(s) back\n", game_board.game_id, n_back);
+            tick = region->tick + 1;
+        }
+        // The client that asked for the session is player 0, others join with OP_CODE_JOIN
+        pthread_mutex_lock(&game_state->players_lock);
+        if (!resume) {
+            game_state->players[0] = (player_t){.connected = 1, .req_fd = client_req_fd, .notif_fd = client_notif_fd};
+            store_session_start(region, seed);
+            store_player(region, 0, request.rep_pipe, request.notif_pipe);
+        }
+        game_state->accepting_players = 1;
+        game_state->session_id++;
+        pthread_mutex_unlock(&game_state->players_lock);
 
         screen_thread_args_t screen_thread_args;
         screen_thread_args.game_board = &game_board;
         screen_thread_args.leave_thread = &leave_thread;
         screen_thread_args.victory = &victory;
-        screen_thread_args.notif_fd = client_notif_fd;
         screen_thread_args.game_over = &end_game;
+        screen_thread_args.frame = &frame;
+        screen_thread_args.wire = &wire;
+        screen_thread_args.game_state = game_state;
+        screen_thread_args.pacman_args = pacman_args;
+        screen_thread_args.tick = &tick;
+        screen_thread_args.metrics = metrics;
+        subscribers_open(spectators);
+        session_metrics_set_active(metrics, 1);
+        metrics_add(METRIC_SESSIONS_STARTED, 1);
         pthread_t screen_tid;
 
         ghost_thread_args_t ghost_args[MAX_GHOSTS];
         pthread_t ghost_tids[MAX_GHOSTS];
+        int restore_pending = 0; // the backup of level lvl is loaded once it is
+        // A session the last server stopped before it ended left its checkpoint, this one goes on from it
+        int checkpoint_pending = 0;
+        if (!resume && checkpoint_load(game_board.game_id, &game_state->checkpoint) == 0) {
+            int checkpoint_lvl = snapshot_level(&game_state->checkpoint, level_info, n_levels);
+            if (checkpoint_lvl >= 0) {
+                lvl = checkpoint_lvl;
+                checkpoint_pending = 1;
+            } else {
+                debug("Game %d ignores its checkpoint, the server has no level %s of that size\n", thread_id + 1, game_state->checkpoint.level_name);
+            }
+        }
 
         while (!end_game) {
             load_level(&game_board, accumulated_points, &level_info[lvl]);
+            recorder_level_start(game_board.recorder, game_board.level_name, accumulated_points);
+            pthread_mutex_lock(&game_state->players_lock);
+            int host_left = !game_state->players[0].connected || game_state->players[0].left;
+            pthread_mutex_unlock(&game_state->players_lock);
+            if (host_left) {
+                recorded_remove_pacman(&game_board, 0);
+            }
+            if (restore_pending) {
+                load_backup(game_state, &game_board);
+                restore_pending = 0;
+            }
+            if (checkpoint_pending) {
+                if (load_snapshot(game_state, &game_board, &game_state->checkpoint) < 0) {
+                    debug("Game %d could not restore level %s from its checkpoint\n", game_board.game_id, game_board.level_name);
+                }
+                checkpoint_pending = 0;
+            }
+            if (resume) {
+                // Where the last server left the session, without the players that did not come back
+                if (load_snapshot(game_state, &game_board, store_snapshot(region)) < 0) {
+                    debug("Game %d could not restore level %s from the session store\n", game_board.game_id, game_board.level_name);
+                }
+                resume = 0;
+            }
             for (int i = 0; i < game_board.n_ghosts; i++) {
                 ghost_thread_args_init(&ghost_args[i], &game_board, i, &leave_thread);
             }
             while(true) {
-                if (pthread_create(&pacman_tid, NULL, pacman_thread, &pacman_args) != 0) {
-                    perror("pthread_create");
-                    exit(EXIT_FAILURE);
+                if (admit_players(game_state, &game_board, pacman_args) == 0) {
+                    // Every player left during the last level
+                    result = QUIT_GAME;
+                    leave_thread = true;
                 }
                 for (int i = 0; i < game_board.n_ghosts; i++) {
                     if (pthread_create(&ghost_tids[i], NULL, ghost_thread, &ghost_args[i]) != 0) {
@@ -525,11 +794,12 @@ void *worker_thread(void *arg) {
                     perror("pthread_create");
                     exit(EXIT_FAILURE);
                 }
-                pthread_join(pacman_tid, NULL);
+                // The screen thread admits the players that join, it stops first
+                pthread_join(screen_tid, NULL);
+                players_end_level(game_state, &game_board);
                 for (int i = 0; i < game_board.n_ghosts; i++) {
                     pthread_join(ghost_tids[i], NULL);
                 }
-                pthread_join(screen_tid, NULL);
                 leave_thread = false;
                 if(result == NEXT_LEVEL) {
                     debug("LEVEL COMPLETED\n");
@@ -537,12 +807,11 @@ void *worker_thread(void *arg) {
                     if (lvl >= n_levels) {
                         victory = 1;
                         end_game = 1;
-                        Board board_data = process_board_to_api(&game_board, victory, end_game);
-                        if (writeBoardChanges(client_notif_fd, board_data) < 0) {
-                            debug("Error writing to notification pipe: %s\n", strerror(errno));
+                        if (send_board_frame(&game_board, victory, end_game, &frame, &wire, game_state, &tick, metrics) < 0) {
+                            debug("Error encoding frame\n");
                         }
                     }
-                    accumulated_points = game_board.pacmans[0].points;
+                    accumulated_points = game_state->players[0].points;
                     sleep_ms(game_board.tempo);
                     break;
                 }
@@ -550,89 +819,208 @@ void *worker_thread(void *arg) {
                     sleep_ms(game_board.tempo);
                     end_game = 1;
 
-                    Board board_data = process_board_to_api(&game_board, victory, end_game);
-                    if (writeBoardChanges(client_notif_fd, board_data) < 0) {
-                        debug("Error writing to notification pipe: %s\n", strerror(errno));
+                    if (send_board_frame(&game_board, victory, end_game, &frame, &wire, game_state, &tick, metrics) < 0) {
+                        debug("Error encoding frame\n");
                     }
-                    free(board_data.data);
 
                     break;
                 }  
+                if (result == LOAD_BACKUP) {
+                    // Loaded on this level right away, another level is loaded first
+                    int backup_lvl = backup_level(game_state, level_info, n_levels);
+                    if (backup_lvl == lvl) {
+                        load_backup(game_state, &game_board);
+                    } else if (backup_lvl >= 0) {
+                        lvl = backup_lvl;
+                        restore_pending = 1;
+                        break;
+                    }
+                }
             }
+            recorder_level_end(game_board.recorder, &game_board, result);
             unload_level(&game_board);
         }
-        pthread_rwlock_wrlock(&args->game_state->lock);
-        args->game_state->is_active = 0;
-        pthread_rwlock_unlock(&args->game_state->lock);
-        close(client_req_fd);
-        close(client_notif_fd);
+        recorder_close(game_board.recorder, victory);
+        store_session_end(region);
+        checkpoint_clear(game_board.game_id);
+        PROFILED_WRLOCK(LOCK_SITE_GAME_STATE, &game_state->lock);
+        game_state->is_active = 0;
+        pthread_rwlock_unlock(&game_state->lock);
+        leaderboard_finish(thread_id, lvl, victory, seed);
+        session_metrics_set_active(metrics, 0);
+        metrics_add(METRIC_SESSIONS_FINISHED, 1);
+        subscribers_close_all(spectators);
+        pthread_mutex_lock(&game_state->players_lock);
+        game_state->accepting_players = 0;
+        for (int i = 0; i < MAX_PACMANS; i++) {
+            player_t *player = &game_state->players[i];
+            if (player->connected) {
+                close(player->req_fd);
+                close(player->notif_fd);
+            }
+            view_release(&player->view);
+            frame_buffer_release(&player->frame);
+            memset(player, 0, sizeof(player_t));
+        }
+        pthread_mutex_unlock(&game_state->players_lock);
+        view_release(&game_state->spectator_view);
+        pthread_mutex_lock(&game_state->backup_lock);
+        snapshot_release(&game_state->backup);
+        pthread_mutex_unlock(&game_state->backup_lock);
+        snapshot_release(&game_state->checkpoint);
     }
 
+    board_data_release(&frame);
+    frame_buffer_release(&wire);
     return NULL;
 }
 
-void queue_push(Queue *head, connect_request_t request) {
+// Appends a batch of requests with a single walk to the tail of the queue
+void queue_push_batch(Queue *head, connect_request_t *requests, int n_requests) {
     if (head == NULL) return;
 
-    Queue *new_node = (Queue *)malloc(sizeof(Queue));
-    new_node->request = request;
-    new_node->next = NULL;
-
     Queue *current = head;
     while (current->next != NULL) {
         current = current->next;
     }
-    current->next = new_node;
-}
-
-int compare_scores(const void *a, const void *b) {
-    game_state_t *gameA = (game_state_t *)a;
-    game_state_t *gameB = (game_state_t *)b;
-    return gameB->score - gameA->score;
+    for (int i = 0; i < n_requests; i++) {
+        Queue *new_node = (Queue *)malloc(sizeof(Queue));
+        new_node->request = requests[i];
+        new_node->next = NULL;
+        current->next = new_node;
+        current = new_node;
+    }
+    metrics_gauge_add(METRIC_QUEUE_DEPTH, n_requests);
 }
 
-void generate_top5_file(game_state_t *games, int max_games) {
-    game_state_t *temp_games = malloc(sizeof(game_state_t) * max_games);
-    if (!temp_games) return;
+// Attaches a spectator's notification pipe to a running game, the game id travels in the rep_pipe field
+void attach_spectator(game_state_t *games, int max_games, connect_request_t *request) {
+    char *policy_str = NULL;
+    long game_id = strtol(request->rep_pipe, &policy_str, 10);
+    int policy = SUB_POLICY_DROP;
+    if (strcmp(policy_str, ":evict") == 0) {
+        policy = SUB_POLICY_EVICT;
+    }
 
-    int active_count = 0;
-    for (int i = 0; i < max_games; i++) {
-        pthread_rwlock_rdlock(&games[i].lock);
-        if (games[i].is_active) {
-            temp_games[active_count] = games[i];
-            active_count++;
-        }
-        pthread_rwlock_unlock(&games[i].lock);
+    // Write-only, so a spectator that exits makes the next write fail with EPIPE and is evicted
+    // right away; ENXIO here means nobody reads the pipe anymore
+    int fd = open(request->notif_pipe, O_WRONLY | O_NONBLOCK);
+    if (fd < 0) {
+        debug("Error opening spectator pipe %s: %s\n", request->notif_pipe, strerror(errno));
+        return;
     }
-    int fd = open("top5.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (active_count == 0) {
-        write(fd, "No active games.\n", 17);
+    if (game_id < 1 || game_id > max_games) {
+        debug("Spectator asked for unknown game %ld\n", game_id);
+        send_error_response(fd);
         close(fd);
-        free(temp_games);
         return;
     }
 
-    qsort(temp_games, active_count, sizeof(game_state_t), compare_scores);
+    if (subscribers_add(&games[game_id - 1].spectators, fd, policy) < 0) {
+        debug("Game %ld is not accepting spectators\n", game_id);
+        send_error_response(fd);
+        close(fd);
+        return;
+    }
+    debug("Spectator %s attached to game %ld\n", request->notif_pipe, game_id);
+}
 
-    if (fd >= 0) {
-        char buffer[128];
-        int limit = active_count < 5 ? active_count : 5;
-        
-        for (int i = 0; i < limit; i++) {
-            int len = sprintf(buffer, "Client ID: %d, Score: %d\n", 
-                            temp_games[i].client_id+1, temp_games[i].score);
-            write(fd, buffer, len);
+// Helper private function that reserves a free player slot of a running session
+// @return the slot, -1 if the game has no session or is full
+static int reserve_player(game_state_t *game, int *session_id) {
+    int slot = -1;
+    pthread_mutex_lock(&game->players_lock);
+    for (int i = 1; i < MAX_PACMANS && game->accepting_players && slot < 0; i++) {
+        if (!game->players[i].connected && !game->players[i].reserved) slot = i;
+    }
+    if (slot > 0) {
+        game->players[slot].reserved = 1;
+        *session_id = game->session_id;
+    }
+    pthread_mutex_unlock(&game->players_lock);
+    return slot;
+}
+
+// Opens the pipes of a client joining a running game and hands it to that game's session, whose
+// screen thread puts its pacman on the board; off the main thread, opening the request pipe
+// waits for the client
+void *join_thread(void *arg) {
+    join_thread_args_t *args = (join_thread_args_t *)arg;
+    connect_request_t *request = &args->request;
+    int game_id = request->game_id;
+    int slot = -1, session_id = 0;
+    if (game_id >= 1 && game_id <= args->max_games) {
+        slot = reserve_player(&args->games[game_id - 1], &session_id);
+    }
+    if (slot < 0) {
+        debug("Game %d can not be joined\n", game_id);
+        int fd = open(request->notif_pipe, O_WRONLY | O_NONBLOCK);
+        if (fd >= 0) {
+            send_error_response(fd);
+            close(fd);
         }
-        close(fd);
+        free(args);
+        return NULL;
     }
-    
-    free(temp_games);
+    game_state_t *game = &args->games[game_id - 1];
+
+    int req_fd, notif_fd;
+    int opened = open_client_pipes(request->rep_pipe, request->notif_pipe, &req_fd, &notif_fd) == 0;
+    pthread_mutex_lock(&game->players_lock);
+    // The reservation is gone if the session ended while the pipes were opened
+    int joined = opened && game->accepting_players && game->session_id == session_id;
+    if (joined) {
+        game->players[slot] = (player_t){.connected = 1, .req_fd = req_fd, .notif_fd = notif_fd};
+        store_player(game->region, slot, request->rep_pipe, request->notif_pipe);
+    } else if (game->session_id == session_id) {
+        game->players[slot].reserved = 0;
+    }
+    pthread_mutex_unlock(&game->players_lock);
+    if (!opened) {
+        debug("Error opening joining client pipes\n");
+    } else if (!joined) {
+        debug("Game %d ended before player %s could join\n", game_id, request->notif_pipe);
+        close(req_fd);
+        close(notif_fd);
+    } else {
+        debug("Player %s will join game %d as player %d\n", request->notif_pipe, game_id, slot);
+    }
+    free(args);
+    return NULL;
 }
 
+// Starts a detached join_thread for a join request
+void join_game(game_state_t *games, int max_games, connect_request_t *request) {
+    join_thread_args_t *args = malloc(sizeof(join_thread_args_t));
+    if (args == NULL) {
+        return;
+    }
+    args->games = games;
+    args->max_games = max_games;
+    args->request = *request;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, join_thread, args) != 0) {
+        perror("pthread_create");
+        free(args);
+    }
+    pthread_attr_destroy(&attr);
+}
 
 int main(int argc, char** argv) {
+    if (argc == 4 && strcmp(argv[1], "--replay") == 0) {
+        return replay_session(argv[2], argv[3]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--headless") == 0) {
+        return simulate_main(argc - 1, argv + 1);
+    }
     if (argc != 4) {
-        printf("Usage: %s <level_directory> <max_games> <register_fifo_path>\n", argv[0]);
+        printf("Usage: %s <level_directory> <max_games> <register_fifo_path>\n"
+               "       %s --replay <level_directory> <recording>\n"
+               "       %s --headless [-g games] [-s seed] [-t max_ticks] [-j threads] <level_directory>\n",
+               argv[0], argv[0], argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -645,19 +1033,42 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
+    sa.sa_handler = handle_sigusr2;
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        perror("sigaction SIGUSR2");
+        return EXIT_FAILURE;
+    }
+
     sa.sa_handler = handle_sigint;
     if (sigaction(SIGINT, &sa, NULL) == -1) {
         perror("sigaction SIGINT");
         return EXIT_FAILURE;
     }
 
+    // A client gone while its pipe is written is reported by EPIPE
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction SIGPIPE");
+        return EXIT_FAILURE;
+    }
+
     open_debug_file("debug.log");
+    TRACE_INIT();
     level_info level_info[MAX_LEVELS];
     int n_levels = read_dir(argv[1], level_info);
     int max_games = atoi(argv[2]);
     char *register_fifo_path = argv[3];
-    // Random seed for any random movements
-    srand((unsigned int)time(NULL));
+    // Seed of every session's random moves, see session_seed
+    struct timespec seed_time;
+    clock_gettime(CLOCK_REALTIME, &seed_time);
+    server_seed = rng_derive((uint64_t)seed_time.tv_sec * 1000000000ULL + (uint64_t)seed_time.tv_nsec, (uint64_t)getpid());
+    log_info("Server seed %llu\n", (unsigned long long)server_seed);
+    recorder_init();
+    checkpoint_init();
+    if (store_init(max_games, level_info, n_levels) < 0) {
+        fprintf(stderr, "Failed to map the session store\n");
+        return EXIT_FAILURE;
+    }
 
     sem_t sem_items;
     pthread_mutex_t mutex_queue;
@@ -666,40 +1077,32 @@ int main(int argc, char** argv) {
     pthread_mutex_init(&mutex_queue, NULL);
 
     game_state_t *game_state = calloc(max_games, sizeof(game_state_t));
+    session_metrics_t *session_metrics = metrics_init(max_games);
+    if (game_state == NULL || session_metrics == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    if (leaderboard_init(max_games) < 0) {
+        perror("leaderboard_init");
+        return EXIT_FAILURE;
+    }
     for (int i = 0; i < max_games; i++) {
+        game_state[i].metrics = &session_metrics[i];
         if (pthread_rwlock_init(&game_state[i].lock, NULL) != 0) {
             perror("pthread_rwlock_init");
             return EXIT_FAILURE;
         }
+        subscribers_init(&game_state[i].spectators);
+        pthread_mutex_init(&game_state[i].players_lock, NULL);
+        pthread_mutex_init(&game_state[i].backup_lock, NULL);
     }
 
-    int reg_pipe_fd;
-    while(1) {
-        reg_pipe_fd = create_and_open_reg_fifo(register_fifo_path);
-        if (reg_pipe_fd < 0) {
-            if (errno == EINTR) {
-                if (sigint_received) {
-                    unlink(register_fifo_path);
-                    close_debug_file();
-                    return EXIT_SUCCESS;
-                } else if (sigusr1_received) {
-                    generate_top5_file(game_state, max_games);
-                    sigusr1_received = 0; 
-                }
-                continue;
-            }
-            close_debug_file();
-            return EXIT_FAILURE;
-        }
-        break;
-    }
-
+    // Workers start before the register FIFO is opened, which waits for a first client: the
+    // sessions left in the session store go on right away
     Queue *head = (Queue*)malloc(sizeof(Queue));
     head->request = (connect_request_t){0};
     head->next = NULL;
 
-    
-
     pthread_t worker_tid;
     for (int i = 0; i<max_games; i++){
         debug("Creating worker thread %d\n", i);
@@ -717,8 +1120,39 @@ int main(int argc, char** argv) {
             continue;
         }
     }
+
+    int reg_pipe_fd;
+    while(1) {
+        reg_pipe_fd = create_and_open_reg_fifo(register_fifo_path);
+        if (reg_pipe_fd < 0) {
+            if (errno == EINTR) {
+                if (sigint_received) {
+                    unlink(register_fifo_path);
+                    recorder_shutdown();
+                    store_sync();
+                    close_debug_file();
+                    return EXIT_SUCCESS;
+                } else if (sigusr1_received) {
+                    leaderboard_request_dump();
+                    sigusr1_received = 0; 
+                } else if (sigusr2_received) {
+                    metrics_dump(METRICS_FILE);
+                    sigusr2_received = 0;
+                }
+                continue;
+            }
+            close_debug_file();
+            return EXIT_FAILURE;
+        }
+        break;
+    }
+
     debug("Server is running and waiting for clients...\n");
 
+    reg_reader_t reg_reader;
+    reg_reader_init(&reg_reader);
+    connect_request_t requests[REG_BATCH_REQUESTS];
+
     while (1) {
         if (sigint_received) {
             debug("SIGINT received, shutting down server...\n");
@@ -726,31 +1160,70 @@ int main(int argc, char** argv) {
         }
 
         if (sigusr1_received) {
-            generate_top5_file(game_state, max_games);
+            leaderboard_request_dump();
             sigusr1_received = 0; 
         }
+
+        if (sigusr2_received) {
+            metrics_dump(METRICS_FILE);
+            sigusr2_received = 0;
+        }
         
-        connect_request_t request;
-        if (read_connect_request(reg_pipe_fd, &request) < 0) {
+        int n_requests = read_connect_requests(reg_pipe_fd, &reg_reader, requests, REG_BATCH_REQUESTS);
+        if (n_requests < 0) {
             if (errno == EINTR) {
                 continue; 
             }
             debug("Error reading connect request\n");
             continue;
         }
-        debug("Received connection request: rep_pipe=%s, notif_pipe=%s\n", request.rep_pipe, request.notif_pipe);
-        pthread_mutex_lock(&mutex_queue);
-        queue_push(head, request);
-        debug("request: %d %s %s\n", head->request.op_code, head->request.rep_pipe, head->request.notif_pipe);
+        if (n_requests == 0) {
+            continue;
+        }
+        // Spectators are attached right away, players joining a game are handed to it, new
+        // sessions are queued for a worker
+        int n_players = 0;
+        for (int i = 0; i < n_requests; i++) {
+            if (requests[i].op_code == OP_CODE_SPECTATE) {
+                attach_spectator(game_state, max_games, &requests[i]);
+                continue;
+            }
+            if (requests[i].op_code == OP_CODE_JOIN) {
+                join_game(game_state, max_games, &requests[i]);
+                continue;
+            }
+            debug("Received connection request: rep_pipe=%s, notif_pipe=%s\n", requests[i].rep_pipe, requests[i].notif_pipe);
+            requests[n_players++] = requests[i];
+        }
+        if (n_players == 0) {
+            continue;
+        }
+        PROFILED_MUTEX_LOCK(LOCK_SITE_QUEUE, &mutex_queue);
+        queue_push_batch(head, requests, n_players);
         pthread_mutex_unlock(&mutex_queue);
-        sem_post(&sem_items);
-        debug("Client added to the queue\n");
+        for (int i = 0; i < n_players; i++) {
+            sem_post(&sem_items);
+        }
+        debug("%d client(s) added to the queue\n", n_players);
     }
+    // Sessions still running are left in the store for the next server, their recordings end
+    // where they stopped
+    recorder_shutdown();
+    store_sync();
     for (int i = 0; i < max_games; i++) {
         pthread_rwlock_destroy(&game_state[i].lock);
+        subscribers_destroy(&game_state[i].spectators);
+        pthread_mutex_destroy(&game_state[i].players_lock);
+        pthread_mutex_destroy(&game_state[i].backup_lock);
     }
     free(game_state);
     close(reg_pipe_fd);
+    leaderboard_shutdown();
+    checkpoint_shutdown();
+#ifdef PROFILE_LOCKS
+    lockprof_report_sites();
+#endif
+    TRACE_EXPORT();
     close_debug_file();
 
     return 0;
@@ -0,0 +1,321 @@
+#include "leaderboard.h"
+#include "board.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+
+// A finished game waiting for the writer thread
+typedef struct history_record {
+    int slot;
+    int score;
+    int levels;
+    int victory;
+    unsigned long long seed;
+    long long ended;    // seconds since the epoch
+    struct history_record *next;
+} history_record_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+// Max-heap of the running slots by score, with the position of every slot to update it in place
+static int n_slots = 0;
+static int *heap = NULL;
+static int *pos = NULL;         // index of each slot in heap, -1 when it is not running
+static int *scores = NULL;
+static int heap_size = 0;
+
+static history_record_t **reserved = NULL;  // record of each running slot, allocated when its game starts
+static history_record_t *pending_head = NULL;
+static history_record_t *pending_tail = NULL;
+static int dump_requested = 0;
+static int stopping = 0;
+static pthread_t writer;
+
+// Best finished games ever, best first, only touched by the writer thread after init
+static leaderboard_entry_t best_ever[LEADERBOARD_TOP];
+static int n_best_ever = 0;
+
+// Helper private function that tells whether slot a ranks above slot b
+static inline int ranks_above(int a, int b) {
+    return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+}
+
+static void heap_swap(int i, int j) {
+    int tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    pos[heap[i]] = i;
+    pos[heap[j]] = j;
+}
+
+static void sift_up(int i) {
+    while (i > 0 && ranks_above(heap[i], heap[(i - 1) / 2])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(int i) {
+    while (1) {
+        int best = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap_size && ranks_above(heap[left], heap[best])) best = left;
+        if (right < heap_size && ranks_above(heap[right], heap[best])) best = right;
+        if (best == i) return;
+        heap_swap(i, best);
+        i = best;
+    }
+}
+
+// Helper private function that keeps best_ever sorted, dropping whatever falls off the end
+static void record_best_ever(int slot, int score) {
+    int i = n_best_ever < LEADERBOARD_TOP ? n_best_ever++ : LEADERBOARD_TOP;
+    while (i > 0 && best_ever[i - 1].score < score) {
+        if (i < LEADERBOARD_TOP) best_ever[i] = best_ever[i - 1];
+        i--;
+    }
+    if (i < LEADERBOARD_TOP) best_ever[i] = (leaderboard_entry_t){slot, score};
+}
+
+// Helper private function that replays the history of previous runs into best_ever
+static void load_history(void) {
+    FILE *fp = fopen(HISTORY_FILE, "r");
+    if (fp == NULL) {
+        return;
+    }
+    char line[256];
+    int client, score;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "client %d score %d", &client, &score) == 2) {
+            record_best_ever(client - 1, score);
+        }
+    }
+    fclose(fp);
+}
+
+// Helper private function that replaces path with the given entries in the top5.txt format
+static void write_top_file(const char *path, leaderboard_entry_t *entries, int n, const char *empty) {
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        debug("Error opening %s\n", tmp_path);
+        return;
+    }
+    char buffer[64 * LEADERBOARD_TOP + 64];
+    int len = 0;
+    if (n == 0) {
+        len = snprintf(buffer, sizeof(buffer), "%s", empty);
+    }
+    for (int i = 0; i < n; i++) {
+        len += snprintf(buffer + len, sizeof(buffer) - len, "Client ID: %d, Score: %d\n",
+                        entries[i].slot + 1, entries[i].score);
+    }
+    if (write(fd, buffer, len) != len) {
+        debug("Error writing %s\n", tmp_path);
+    }
+    close(fd);
+    rename(tmp_path, path);
+}
+
+// Helper private function that appends finished games to the history file
+static void append_history(history_record_t *records) {
+    int fd = open(HISTORY_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        debug("Error opening %s\n", HISTORY_FILE);
+    }
+    while (records != NULL) {
+        history_record_t *record = records;
+        records = record->next;
+        if (fd >= 0) {
+            char line[128];
+            int len = snprintf(line, sizeof(line), "client %d score %d levels %d victory %d ended %lld seed %llu\n",
+                               record->slot + 1, record->score, record->levels, record->victory, record->ended,
+                               record->seed);
+            if (write(fd, line, len) != len) {
+                debug("Error writing %s\n", HISTORY_FILE);
+            }
+        }
+        record_best_ever(record->slot, record->score);
+        free(record);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Helper private function for leaderboard_top, the caller holds the lock
+static int top_locked(leaderboard_entry_t *out, int k) {
+    // The k best are within the first k levels of the heap: expand from the root, always
+    // taking the best candidate and adding its children
+    int candidates[2 * LEADERBOARD_TOP + 1];
+    int n_candidates = 0;
+    int n = 0;
+    if (k > LEADERBOARD_TOP) k = LEADERBOARD_TOP;
+    if (heap_size > 0) candidates[n_candidates++] = 0;
+    while (n < k && n_candidates > 0) {
+        int best = 0;
+        for (int i = 1; i < n_candidates; i++) {
+            if (ranks_above(heap[candidates[i]], heap[candidates[best]])) best = i;
+        }
+        int index = candidates[best];
+        candidates[best] = candidates[--n_candidates];
+        out[n++] = (leaderboard_entry_t){heap[index], scores[heap[index]]};
+        for (int child = 2 * index + 1; child <= 2 * index + 2 && child < heap_size; child++) {
+            candidates[n_candidates++] = child;
+        }
+    }
+    return n;
+}
+
+static void *writer_thread(void *arg) {
+    (void)arg;
+    // Signals are handled by the accept loop
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!dump_requested && pending_head == NULL && !stopping) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        history_record_t *records = pending_head;
+        pending_head = pending_tail = NULL;
+        int dump = dump_requested;
+        dump_requested = 0;
+        leaderboard_entry_t live[LEADERBOARD_TOP];
+        int n_live = dump ? top_locked(live, LEADERBOARD_TOP) : 0;
+        int stop = stopping && records == NULL;
+        pthread_mutex_unlock(&lock);
+
+        // Files are written without the lock, sessions keep updating their scores meanwhile
+        append_history(records);
+        if (dump) {
+            write_top_file(TOP5_FILE, live, n_live, "No active games.\n");
+            write_top_file(HISTORY_TOP5_FILE, best_ever, n_best_ever, "No finished games.\n");
+        }
+
+        pthread_mutex_lock(&lock);
+        if (stop) break;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int leaderboard_init(int count) {
+    heap = malloc(count * sizeof(int));
+    pos = malloc(count * sizeof(int));
+    scores = calloc(count, sizeof(int));
+    reserved = calloc(count, sizeof(history_record_t *));
+    if (heap == NULL || pos == NULL || scores == NULL || reserved == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        pos[i] = -1;
+    }
+    n_slots = count;
+    load_history();
+    if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void leaderboard_start(int slot) {
+    if (slot < 0 || slot >= n_slots) return;
+    // The record is allocated now, a game that ends can always be kept in the history
+    history_record_t *record = malloc(sizeof(history_record_t));
+    if (record == NULL) {
+        debug("Out of memory, the game of client %d will not be kept in %s\n", slot + 1, HISTORY_FILE);
+    }
+    pthread_mutex_lock(&lock);
+    if (pos[slot] < 0) {
+        scores[slot] = 0;
+        heap[heap_size] = slot;
+        pos[slot] = heap_size++;
+        sift_up(pos[slot]);
+        free(reserved[slot]);
+        reserved[slot] = record;
+        record = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    free(record);
+}
+
+void leaderboard_update(int slot, int score) {
+    if (slot < 0 || slot >= n_slots) return;
+    pthread_mutex_lock(&lock);
+    if (pos[slot] >= 0 && scores[slot] != score) {
+        int up = score > scores[slot];
+        scores[slot] = score;
+        if (up) sift_up(pos[slot]);
+        else sift_down(pos[slot]);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void leaderboard_finish(int slot, int levels, int victory, unsigned long long seed) {
+    if (slot < 0 || slot >= n_slots) return;
+    pthread_mutex_lock(&lock);
+    int i = pos[slot];
+    if (i < 0) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    history_record_t *record = reserved[slot];
+    reserved[slot] = NULL;
+    int score = scores[slot];
+    // Move the last slot into the hole and restore the heap from there
+    heap_swap(i, heap_size - 1);
+    heap_size--;
+    pos[slot] = -1;
+    if (i < heap_size) {
+        int moved = heap[i];
+        sift_up(i);
+        sift_down(pos[moved]);
+    }
+    if (record != NULL) {
+        *record = (history_record_t){slot, score, levels, victory, seed, (long long)time(NULL), NULL};
+        if (pending_tail != NULL) pending_tail->next = record;
+        else pending_head = record;
+        pending_tail = record;
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    if (record == NULL) {
+        debug("Game of client %d with score %d not kept in %s, its record could not be allocated\n", slot + 1, score, HISTORY_FILE);
+    }
+}
+
+int leaderboard_top(leaderboard_entry_t *out, int k) {
+    pthread_mutex_lock(&lock);
+    int n = top_locked(out, k);
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void leaderboard_request_dump(void) {
+    pthread_mutex_lock(&lock);
+    dump_requested = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+void leaderboard_shutdown(void) {
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+}
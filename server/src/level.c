@@ -0,0 +1,260 @@
+#include "level.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+
+typedef struct {
+    char path[1024];
+    level_info *level_info;
+} thread_args_t;
+
+static void process_board(board_pos_t *board, char *board_str, int height, int width) {
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            int index = i * width + j;
+            char ch = board_str[index];
+            board[index].occupant = NO_OCCUPANT;
+            switch (ch) {
+                case 'X': // Wall
+                    board[index].content = 'W';
+                    board[index].has_dot = 0;
+                    board[index].has_portal = 0;
+                    break;
+                case 'o': // Free space
+                    board[index].content = ' ';
+                    board[index].has_dot = 1;
+                    board[index].has_portal = 0;
+                    break;
+                case '@': // Portal
+                    board[index].content = ' ';
+                    board[index].has_dot = 0;
+                    board[index].has_portal = 1;
+                    break;
+            }
+
+        }
+    }
+}
+
+// The buffer doubles as the file is read, a level of a few million cells is copied a few times
+// instead of once per kilobyte
+static char* readFile (char *file) {
+    int f = open(file, O_RDONLY);
+    if (f < 0) {
+        exit(EXIT_FAILURE);
+    }
+    ssize_t bytes_read;
+    size_t fileSize = 0;
+    size_t capacity = 4096;
+    char *fileContent = malloc(capacity);
+    if (fileContent == NULL) {
+        close(f);
+        exit(EXIT_FAILURE);
+    }
+    while ((bytes_read = read(f, fileContent + fileSize, capacity - fileSize - 1)) > 0) {
+        fileSize += bytes_read;
+        if (capacity - fileSize - 1 == 0) {
+            capacity *= 2;
+            fileContent = realloc(fileContent, capacity);
+            if (fileContent == NULL) {
+                close(f);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    fileContent[fileSize] = '\0'; // Garante que o conteúdo seja uma string válida
+    close(f);
+    return fileContent;
+}
+
+// Helper private function that appends a row of the board to the cells read so far, without
+// going past the DIM of the level
+static void append_row(char *board, size_t *board_len, size_t board_size, const char *line) {
+    size_t len = strlen(line);
+    if (len > board_size - *board_len) {
+        len = board_size - *board_len;
+    }
+    memcpy(board + *board_len, line, len);
+    *board_len += len;
+}
+
+static void build_command(command_t *command, char *line) {
+    sscanf(line, "%c", &command->command);
+    if (command->command == 'T') {
+        sscanf(line, "T %d", &command->turns_left);
+    }
+    command->turns = 1;
+}
+
+static char* getFileName(char *file) {
+    char *filename = strrchr(file, '/');
+    if (filename != NULL) {
+        return filename + 1;
+    }
+    return file;
+}
+
+static pac_ghost_info getPacGhostInfo(char *file) { //esqueceu se de atribuir nmoves
+    pac_ghost_info info;
+    char *fileInfo = readFile(file);
+    strncpy(info.file_name, getFileName(file), MAX_FILENAME - 1);
+    char *saveptr_line; // Estado para strtok_r
+    char *line = strtok_r(fileInfo, "\n", &saveptr_line);
+    while (line != NULL) {
+        if (strncmp(line, "#", 1) == 0) {
+            line = strtok_r(NULL, "\n", &saveptr_line);
+            continue;
+        } else if (strncmp(line, "PASSO", 5) == 0) {
+            sscanf(line, "PASSO %d", &info.passo);
+        } else if (strncmp(line, "POS", 3) == 0) {
+            sscanf(line, "POS %d %d", &info.pos_x, &info.pos_y);
+        } else {
+            int n_moves = 0;
+            while (line != NULL && n_moves < MAX_MOVES) {
+                build_command(&info.moves[n_moves], line);
+                n_moves++;
+                line = strtok_r(NULL, "\n", &saveptr_line);
+            }
+            info.n_moves = n_moves;
+            break;
+        }
+        line = strtok_r(NULL, "\n", &saveptr_line);
+    }
+    free(fileInfo);
+    return info;
+}
+
+static char* getPath(char *base_path, char *file_name) {
+    char *last_slash = strrchr(base_path, '/');
+    char *path;
+    if (last_slash != NULL) {
+        size_t dir_length = last_slash - base_path + 1; // +1 para incluir a barra
+        path = malloc(dir_length + strlen(file_name) + 1); // +1 para o terminador nulo
+        strncpy(path, base_path, dir_length);
+        path[dir_length] = '\0'; // Adiciona o terminador nulo
+        strcat(path, file_name);
+    } else {
+        path = malloc(strlen(file_name) + 1);
+        strcpy(path, file_name);
+    }
+    return path;
+}
+
+level_info getLevelInfo(char *level_file) {
+    level_info info;
+    info.has_pacman = 0;
+    char* fileInfo = readFile(level_file);
+    strncpy(info.file_name, getFileName(level_file), MAX_FILENAME - 1);
+    char *board = NULL;
+    size_t board_len = 0, board_size = 0;
+    char *saveptr_line; // Estado para strtok_r
+    char *line = strtok_r(fileInfo, "\n", &saveptr_line);
+    while (line != NULL) {
+        if (strncmp(line, "DIM", 3) == 0) {
+            sscanf(line, "DIM %d %d", &info.width, &info.height);
+            info.board = malloc(sizeof(board_pos_t) * (info.width * info.height + 1));
+            board_size = (size_t)info.width * info.height;
+            board = malloc(board_size + 1);
+            memset(board, 'X', board_size); // rows missing from the file are walls
+        } else if (strncmp(line, "TEMPO", 5) == 0) {
+            sscanf(line, "TEMPO %d", &info.tempo);
+        } else if (strncmp(line, "PAC", 3) == 0) {
+            sscanf(line, "PAC %s", info.pacman_file);
+            char *path = getPath(level_file, info.pacman_file);
+            info.pacman_info = getPacGhostInfo(path);
+            free(path);
+            info.has_pacman = 1;
+        } else if (strncmp(line, "MON", 3) == 0) {
+            int ghost_index = 0;
+            char *saveptr_token; // Estado para strtok_r dentro da linha
+            char *token = strtok_r(line + 4, " ", &saveptr_token);
+            while (token != NULL) {
+                if (ghost_index >= MAX_GHOSTS) { 
+                    break;
+                }
+                strncpy(info.ghost_files[ghost_index], token, MAX_FILENAME - 1);
+                info.ghost_files[ghost_index][MAX_FILENAME - 1] = '\0'; 
+                char *path = getPath(level_file, info.ghost_files[ghost_index]);
+                info.ghosts_info[ghost_index] = getPacGhostInfo(path);
+                free(path);
+                ghost_index++;
+                token = strtok_r(NULL, " ", &saveptr_token);
+            }
+            info.n_ghosts = ghost_index;
+        } else if (strncmp(line, "#", 1) == 0) {
+            line = strtok_r(NULL, "\n", &saveptr_line);
+            continue;
+        } else {
+            // Rows are appended at the end of the cells read so far, without scanning them again
+            append_row(board, &board_len, board_size, line);
+            line = strtok_r(NULL, "\n", &saveptr_line);
+            while (line != NULL) {
+                append_row(board, &board_len, board_size, line);
+                line = strtok_r(NULL, "\n", &saveptr_line);
+            }
+            process_board(info.board, board, info.height, info.width);
+            free(board);
+            break;
+            
+        }
+        line = strtok_r(NULL, "\n", &saveptr_line);
+        
+    }
+    free(fileInfo);
+    return info;
+}
+
+static void *read_file_thread(void *arg) {
+    thread_args_t *args = (thread_args_t *)arg;
+
+    *(args->level_info) = getLevelInfo(args->path);
+
+    free(args);
+    return NULL;
+}
+
+int read_dir(char *argv, level_info *level_info) {
+    DIR *dir = opendir(argv);
+    if (dir == NULL) {
+        return 1;
+    }
+    struct dirent *entry;
+    int x = 0;
+
+    pthread_t threads[MAX_LEVELS];
+    int thread_count = 0;
+
+    while ((entry = readdir(dir)) != NULL) { // Lê cada ficheiro na diretoria
+        const char *dot = strrchr(entry->d_name, '.');
+        char extension[4] = "";
+        if (dot != NULL && *(dot + 1) != '\0') {
+            strncpy(extension, dot + 1, sizeof(extension) - 1); 
+            extension[sizeof(extension) - 1] = '\0';
+        }
+        if (extension[0] == 'l') {
+            thread_args_t *args = malloc(sizeof(thread_args_t));
+            sprintf(args->path, "%s/%s", argv, entry->d_name);
+            args->level_info = &level_info[x];
+            
+            if (pthread_create(&threads[thread_count], NULL, read_file_thread, args) != 0) {
+                perror("pthread_create");
+                free(args);
+                continue;
+            }
+            thread_count++;
+            x++;
+        }
+        
+    }
+    
+    for (int j = 0; j < thread_count; j++) {
+        pthread_join(threads[j], NULL);
+    }
+    
+    closedir(dir);
+    return x;
+}
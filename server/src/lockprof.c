@@ -0,0 +1,184 @@
+#include "lockprof.h"
+#include "board.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+static const char *site_names[LOCK_SITES] = {
+    "session", "game_state", "queue",
+};
+
+static lock_stats_t sites[LOCK_SITES];
+
+// Sessions end concurrently, their reports must not interleave
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper private function that adds one acquisition to stats shared between threads
+static void record(lock_stats_t *stats, int contended, long long wait_us) {
+    __atomic_fetch_add(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    if (!contended) {
+        return;
+    }
+    unsigned long long wait = wait_us > 0 ? (unsigned long long)wait_us : 0;
+    __atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->wait_us, wait, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&stats->max_wait_us, __ATOMIC_RELAXED);
+    while (wait > max &&
+           !__atomic_compare_exchange_n(&stats->max_wait_us, &max, wait, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+lock_profile_t *lockprof_new(int width, int height, const char *level_name) {
+    lock_profile_t *profile = malloc(sizeof(lock_profile_t));
+    if (profile == NULL) {
+        return NULL;
+    }
+    profile->cells = calloc((size_t)width * (size_t)height, sizeof(lock_stats_t));
+    if (profile->cells == NULL) {
+        free(profile);
+        return NULL;
+    }
+    profile->width = width;
+    profile->height = height;
+    snprintf(profile->level_name, sizeof(profile->level_name), "%s", level_name);
+    return profile;
+}
+
+void lockprof_cell(lock_profile_t *profile, int index, int contended, long long wait_us) {
+    if (profile == NULL) return;
+    record(&profile->cells[index], contended, wait_us);
+}
+
+// Helper private function that returns the number of significant bits of value
+static int bit_length(unsigned long long value) {
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+// Helper private function that writes a grid with one digit per cell, on a log scale of
+// value relative to the largest one: '.' for zero, 1 to 9 up to the maximum
+static void write_heatmap(FILE *fp, lock_profile_t *profile, const char *title, size_t offset) {
+    int n_cells = profile->width * profile->height;
+    unsigned long long max = 0;
+    for (int i = 0; i < n_cells; i++) {
+        unsigned long long value = *(unsigned long long *)((char *)&profile->cells[i] + offset);
+        if (value > max) max = value;
+    }
+    fprintf(fp, "%s (max %llu)\n", title, max);
+    for (int y = 0; y < profile->height; y++) {
+        for (int x = 0; x < profile->width; x++) {
+            unsigned long long value = *(unsigned long long *)((char *)&profile->cells[y * profile->width + x] + offset);
+            char c = '.';
+            if (value > 0) {
+                c = (char)('0' + 1 + 8 * bit_length(value) / bit_length(max));
+            }
+            fputc(c, fp);
+        }
+        fputc('\n', fp);
+    }
+}
+
+void lockprof_report_level(lock_profile_t *profile) {
+    if (profile == NULL) return;
+    int n_cells = profile->width * profile->height;
+
+    lock_stats_t total = {0};
+    for (int i = 0; i < n_cells; i++) {
+        total.acquisitions += profile->cells[i].acquisitions;
+        total.contended += profile->cells[i].contended;
+        total.wait_us += profile->cells[i].wait_us;
+        if (profile->cells[i].max_wait_us > total.max_wait_us) total.max_wait_us = profile->cells[i].max_wait_us;
+    }
+
+    // Indices of the cells that waited the most, by selection since there are only a few
+    int hot[LOCK_PROFILE_HOT_CELLS];
+    int n_hot = 0;
+    for (int i = 0; i < n_cells; i++) {
+        if (profile->cells[i].contended == 0) continue;
+        int pos = n_hot < LOCK_PROFILE_HOT_CELLS ? n_hot++ : LOCK_PROFILE_HOT_CELLS;
+        while (pos > 0 && profile->cells[hot[pos - 1]].wait_us < profile->cells[i].wait_us) {
+            if (pos < LOCK_PROFILE_HOT_CELLS) hot[pos] = hot[pos - 1];
+            pos--;
+        }
+        if (pos < LOCK_PROFILE_HOT_CELLS) hot[pos] = i;
+    }
+
+    pthread_mutex_lock(&report_lock);
+    FILE *fp = fopen(LOCK_PROFILE_FILE, "a");
+    if (fp == NULL) {
+        pthread_mutex_unlock(&report_lock);
+        debug("Error opening %s\n", LOCK_PROFILE_FILE);
+        free(profile->cells);
+        free(profile);
+        return;
+    }
+    fprintf(fp, "=== level %s (%d x %d) ===\n", profile->level_name, profile->width, profile->height);
+    fprintf(fp, "cell locks: %llu acquisitions, %llu contended, %llu us waited, max wait %llu us\n",
+            total.acquisitions, total.contended, total.wait_us, total.max_wait_us);
+    write_heatmap(fp, profile, "acquisitions", offsetof(lock_stats_t, acquisitions));
+    write_heatmap(fp, profile, "wait time (us)", offsetof(lock_stats_t, wait_us));
+    fprintf(fp, "hottest cells:%s\n", n_hot == 0 ? " none contended" : "");
+    for (int i = 0; i < n_hot; i++) {
+        lock_stats_t *cell = &profile->cells[hot[i]];
+        fprintf(fp, "  (%d, %d): %llu acquisitions, %llu contended, %llu us waited, max %llu us\n",
+                hot[i] % profile->width, hot[i] / profile->width,
+                cell->acquisitions, cell->contended, cell->wait_us, cell->max_wait_us);
+    }
+    fprintf(fp, "\n");
+    fclose(fp);
+    pthread_mutex_unlock(&report_lock);
+
+    free(profile->cells);
+    free(profile);
+}
+
+void lockprof_rwlock_rdlock(lock_site_t site, pthread_rwlock_t *lock) {
+    if (pthread_rwlock_tryrdlock(lock) == 0) {
+        record(&sites[site], 0, 0);
+        return;
+    }
+    long long start = now_us();
+    pthread_rwlock_rdlock(lock);
+    record(&sites[site], 1, now_us() - start);
+}
+
+void lockprof_rwlock_wrlock(lock_site_t site, pthread_rwlock_t *lock) {
+    if (pthread_rwlock_trywrlock(lock) == 0) {
+        record(&sites[site], 0, 0);
+        return;
+    }
+    long long start = now_us();
+    pthread_rwlock_wrlock(lock);
+    record(&sites[site], 1, now_us() - start);
+}
+
+void lockprof_mutex_lock(lock_site_t site, pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        record(&sites[site], 0, 0);
+        return;
+    }
+    long long start = now_us();
+    pthread_mutex_lock(mutex);
+    record(&sites[site], 1, now_us() - start);
+}
+
+void lockprof_report_sites(void) {
+    pthread_mutex_lock(&report_lock);
+    FILE *fp = fopen(LOCK_PROFILE_FILE, "a");
+    if (fp == NULL) {
+        pthread_mutex_unlock(&report_lock);
+        return;
+    }
+    fprintf(fp, "=== lock sites ===\n");
+    for (int i = 0; i < LOCK_SITES; i++) {
+        lock_stats_t *stats = &sites[i];
+        fprintf(fp, "%s: %llu acquisitions, %llu contended, %llu us waited, max wait %llu us\n",
+                site_names[i],
+                __atomic_load_n(&stats->acquisitions, __ATOMIC_RELAXED),
+                __atomic_load_n(&stats->contended, __ATOMIC_RELAXED),
+                __atomic_load_n(&stats->wait_us, __ATOMIC_RELAXED),
+                __atomic_load_n(&stats->max_wait_us, __ATOMIC_RELAXED));
+    }
+    fclose(fp);
+    pthread_mutex_unlock(&report_lock);
+}
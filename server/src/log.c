@@ -0,0 +1,313 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+// Fixed part of every record in a ring, the message follows it
+typedef struct {
+    long long time_us;
+    int thread;
+    int len;         // message bytes, -1 marks padding up to the end of the ring
+} log_record_t;
+
+#define RECORD_ALIGN 8
+#define RECORD_SIZE(len) ((sizeof(log_record_t) + (size_t)(len) + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1))
+
+// Single producer (the owning thread), single consumer (the flusher) ring
+typedef struct log_ring {
+    char data[LOG_RING_SIZE];
+    size_t head;                  // bytes ever written, only the owner advances it
+    size_t tail;                  // bytes ever consumed, only the flusher advances it
+    unsigned long long dropped;   // messages that did not fit, written by the owner
+    unsigned long long reported;  // drops already reported, flusher only
+    int thread;                   // id of the thread owning the ring
+    int released;                 // the owner exited, the ring can be reused once drained
+    int drain_released;           // released as seen by the current drain, flusher only
+    size_t drained_to;            // where the current drain stopped reading, flusher only
+    struct log_ring *next;        // every ring ever created
+    struct log_ring *next_free;   // drained rings of exited threads
+} log_ring_t;
+
+// A message found while draining, sorted by time before it is written
+typedef struct {
+    long long time_us;
+    int thread;
+    int len;
+    const char *text;
+} log_entry_t;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings = NULL;
+static log_ring_t *free_rings = NULL;
+static int next_thread = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local log_ring_t *local_ring = NULL;
+
+static int log_fd = -1;
+static int running = 0;
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+
+// Helper private function that marks the ring of an exiting thread, the flusher recycles it
+static void release_ring(void *arg) {
+    log_ring_t *ring = arg;
+    __atomic_store_n(&ring->released, 1, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+// Helper private function that returns the calling thread's ring, taking one on first use
+static log_ring_t *get_ring(void) {
+    if (local_ring != NULL) {
+        return local_ring;
+    }
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_mutex_lock(&rings_lock);
+    log_ring_t *ring = free_rings;
+    if (ring != NULL) {
+        free_rings = ring->next_free;
+    } else {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (ring == NULL) {
+            pthread_mutex_unlock(&rings_lock);
+            return NULL;
+        }
+        ring->next = rings;
+        rings = ring;
+    }
+    ring->thread = next_thread++;
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+void log_write(int level, const char *format, ...) {
+    (void)level;
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    log_ring_t *ring = get_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    static _Thread_local char message[LOG_MESSAGE_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    if (len >= LOG_MESSAGE_MAX) {
+        len = LOG_MESSAGE_MAX - 1;
+    }
+
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = head % LOG_RING_SIZE;
+    size_t needed = RECORD_SIZE(len);
+    size_t to_end = LOG_RING_SIZE - offset;
+    size_t padding = to_end < needed ? to_end : 0; // records never wrap around
+    if (LOG_RING_SIZE - (head - tail) < padding + needed) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&flusher_cond);
+        return;
+    }
+
+    if (padding > 0) {
+        if (padding >= sizeof(log_record_t)) {
+            log_record_t pad = {0, 0, -1};
+            memcpy(ring->data + offset, &pad, sizeof(pad));
+        }
+        head += padding;
+        offset = 0;
+    }
+    log_record_t record = {0, ring->thread, len};
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record.time_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    memcpy(ring->data + offset, &record, sizeof(record));
+    memcpy(ring->data + offset + sizeof(record), message, (size_t)len);
+    __atomic_store_n(&ring->head, head + needed, __ATOMIC_RELEASE);
+
+    // Wake the flusher early rather than dropping messages
+    if (head + needed - tail > LOG_RING_SIZE / 2) {
+        pthread_cond_signal(&flusher_cond);
+    }
+}
+
+// Helper private function that writes the whole buffer to the log file
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const log_entry_t *x = a;
+    const log_entry_t *y = b;
+    if (x->time_us != y->time_us) return x->time_us < y->time_us ? -1 : 1;
+    return x->thread - y->thread;
+}
+
+// Helper private function that writes every message queued so far
+static void drain_rings(log_entry_t **entries, size_t *capacity, char *out, size_t out_size) {
+    pthread_mutex_lock(&rings_lock);
+    log_ring_t *first = rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    // Rings are only ever prepended, so the list from first is stable without the lock
+    size_t n = 0;
+    size_t out_len = 0;
+    for (log_ring_t *ring = first; ring != NULL; ring = ring->next) {
+        // Loaded before head, so a released ring is seen with every message of its thread
+        ring->drain_released = __atomic_load_n(&ring->released, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail < head) {
+            size_t offset = tail % LOG_RING_SIZE;
+            size_t to_end = LOG_RING_SIZE - offset;
+            log_record_t record;
+            if (to_end < sizeof(record)) {
+                tail += to_end;
+                continue;
+            }
+            memcpy(&record, ring->data + offset, sizeof(record));
+            if (record.len < 0) {
+                tail += to_end;
+                continue;
+            }
+            if (n == *capacity) {
+                size_t new_capacity = *capacity ? *capacity * 2 : 1024;
+                log_entry_t *grown = realloc(*entries, new_capacity * sizeof(log_entry_t));
+                if (grown == NULL) break; // the rest waits for the next pass
+                *entries = grown;
+                *capacity = new_capacity;
+            }
+            (*entries)[n++] = (log_entry_t){record.time_us, record.thread, record.len,
+                                            ring->data + offset + sizeof(record)};
+            tail += RECORD_SIZE(record.len);
+        }
+        ring->drained_to = tail;
+
+        unsigned long long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped > ring->reported) {
+            out_len += (size_t)snprintf(out + out_len, out_size - out_len,
+                                        "[log] thread %d dropped %llu message(s)\n",
+                                        ring->thread, dropped - ring->reported);
+            ring->reported = dropped;
+            if (out_len + 128 > out_size) {
+                write_all(out, out_len);
+                out_len = 0;
+            }
+        }
+    }
+
+    // Threads log concurrently, put their messages back in time order
+    qsort(*entries, n, sizeof(log_entry_t), compare_entries);
+    for (size_t i = 0; i < n; i++) {
+        log_entry_t *entry = &(*entries)[i];
+        if (out_len + LOG_MESSAGE_MAX + 64 > out_size) {
+            write_all(out, out_len);
+            out_len = 0;
+        }
+        out_len += (size_t)snprintf(out + out_len, out_size - out_len, "[%lld.%06lld T%d] ",
+                                    entry->time_us / 1000000, entry->time_us % 1000000, entry->thread);
+        memcpy(out + out_len, entry->text, (size_t)entry->len);
+        out_len += (size_t)entry->len;
+    }
+    if (out_len > 0) {
+        write_all(out, out_len);
+    }
+
+    // Messages stay in their rings until written, only now can their owners reuse the space
+    for (log_ring_t *ring = first; ring != NULL; ring = ring->next) {
+        __atomic_store_n(&ring->tail, ring->drained_to, __ATOMIC_RELEASE);
+        if (ring->drain_released && ring->drained_to == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(&rings_lock);
+            ring->released = 0;
+            ring->dropped = 0;
+            ring->reported = 0;
+            ring->next_free = free_rings;
+            free_rings = ring;
+            pthread_mutex_unlock(&rings_lock);
+        }
+    }
+}
+
+static void *flusher_thread(void *arg) {
+    (void)arg;
+    size_t capacity = 0;
+    log_entry_t *entries = NULL;
+    size_t out_size = 4 * LOG_MESSAGE_MAX + 64 * 1024;
+    char *out = malloc(out_size);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&flusher_lock);
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flusher_cond, &flusher_lock, &deadline);
+        pthread_mutex_unlock(&flusher_lock);
+        drain_rings(&entries, &capacity, out, out_size);
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+
+    // Whatever was logged before close_debug_file
+    drain_rings(&entries, &capacity, out, out_size);
+    free(entries);
+    free(out);
+    return NULL;
+}
+
+void open_debug_file(char *filename) {
+    log_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log_fd < 0) {
+        return;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&flusher, NULL, flusher_thread, NULL) != 0) {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        close(log_fd);
+        log_fd = -1;
+    }
+}
+
+void close_debug_file() {
+    if (log_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&flusher_lock);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher, NULL);
+    close(log_fd);
+    log_fd = -1;
+}
@@ -0,0 +1,246 @@
+#include "metrics.h"
+#include "board.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef struct metrics_shard {
+    unsigned long long counters[METRIC_COUNTERS];
+    metric_hist_t histograms[METRIC_HISTOGRAMS];
+    struct metrics_shard *next;      // every shard ever created, walked by metrics_dump
+    struct metrics_shard *next_free; // shards left by threads that exited
+} metrics_shard_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+} metric_desc_t;
+
+static const metric_desc_t counter_desc[METRIC_COUNTERS] = {
+    {"pacman_frames_sent_total", "Frames written to players and spectators."},
+    {"pacman_bytes_sent_total", "Bytes of the frames written to players and spectators."},
+    {"pacman_frames_dropped_total", "Frames players and spectators missed because their pipe was full."},
+    {"pacman_subscribers_evicted_total", "Spectators detached for being too slow."},
+    {"pacman_sessions_started_total", "Game sessions started."},
+    {"pacman_sessions_finished_total", "Game sessions finished."},
+    {"pacman_lock_contended_total", "Cell lock acquisitions that had to wait."},
+};
+
+static const metric_desc_t histogram_desc[METRIC_HISTOGRAMS] = {
+    {"pacman_tick_duration_us", "Time spent producing and sending one frame, in microseconds."},
+    {"pacman_frame_encode_us", "Time spent taking and serializing one frame, in microseconds."},
+    {"pacman_lock_wait_us", "Time spent waiting for a contended cell lock, in microseconds."},
+};
+
+static const metric_desc_t gauge_desc[METRIC_GAUGES] = {
+    {"pacman_queue_depth", "Connection requests waiting for a worker."},
+};
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_shard_t *shards = NULL;
+static metrics_shard_t *free_shards = NULL;
+static pthread_key_t shard_key;
+static _Thread_local metrics_shard_t *local_shard = NULL;
+
+static long long gauges[METRIC_GAUGES];
+static session_metrics_t *sessions = NULL;
+static int n_sessions = 0;
+
+// Helper private function that gives the shard of an exiting thread to the next new one,
+// its totals stay in the sums since counters only grow
+static void release_shard(void *arg) {
+    metrics_shard_t *shard = arg;
+    pthread_mutex_lock(&shards_lock);
+    shard->next_free = free_shards;
+    free_shards = shard;
+    pthread_mutex_unlock(&shards_lock);
+}
+
+// Helper private function that returns the calling thread's shard, taking one on first use
+static metrics_shard_t *get_shard(void) {
+    if (local_shard != NULL) {
+        return local_shard;
+    }
+    pthread_mutex_lock(&shards_lock);
+    metrics_shard_t *shard = free_shards;
+    if (shard != NULL) {
+        free_shards = shard->next_free;
+    } else {
+        shard = calloc(1, sizeof(metrics_shard_t));
+        if (shard == NULL) {
+            pthread_mutex_unlock(&shards_lock);
+            return NULL;
+        }
+        shard->next = shards;
+        shards = shard;
+    }
+    pthread_mutex_unlock(&shards_lock);
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+// Helper private function for a single-writer add that readers can load without tearing
+static inline void bump(unsigned long long *value, unsigned long long delta) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long load(const unsigned long long *value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+// Helper private function that maps a value to its bucket
+static int bucket_of(long long value) {
+    if (value < METRIC_SUB_BUCKETS) {
+        return value < 0 ? 0 : (int)value;
+    }
+    int msb = 63 - __builtin_clzll((unsigned long long)value); // >= 4
+    int index = (msb - 3) * METRIC_SUB_BUCKETS + (int)((value >> (msb - 4)) & (METRIC_SUB_BUCKETS - 1));
+    return index < METRIC_BUCKETS ? index : METRIC_BUCKETS - 1;
+}
+
+// Helper private function that returns the largest value a bucket holds
+static long long bucket_upper(int index) {
+    if (index < METRIC_SUB_BUCKETS) {
+        return index;
+    }
+    int msb = index / METRIC_SUB_BUCKETS + 3;
+    long long sub = index % METRIC_SUB_BUCKETS;
+    return ((METRIC_SUB_BUCKETS + sub + 1) << (msb - 4)) - 1;
+}
+
+session_metrics_t *metrics_init(int count) {
+    pthread_key_create(&shard_key, release_shard);
+    sessions = calloc((size_t)count, sizeof(session_metrics_t));
+    n_sessions = sessions != NULL ? count : 0;
+    return sessions;
+}
+
+void metrics_add(metric_counter_t counter, unsigned long long value) {
+    metrics_shard_t *shard = get_shard();
+    if (shard == NULL) return;
+    bump(&shard->counters[counter], value);
+}
+
+void metrics_observe(metric_histogram_t histogram, long long value) {
+    metrics_shard_t *shard = get_shard();
+    if (shard == NULL) return;
+    metric_hist_t *hist = &shard->histograms[histogram];
+    bump(&hist->counts[bucket_of(value)], 1);
+    bump(&hist->sum, value > 0 ? (unsigned long long)value : 0);
+}
+
+void metrics_gauge_add(metric_gauge_t gauge, long long delta) {
+    __atomic_fetch_add(&gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+void session_metrics_add(unsigned long long *counter, unsigned long long value) {
+    bump(counter, value);
+}
+
+void session_metrics_set_active(session_metrics_t *session, int active) {
+    __atomic_store_n(&session->active, active, __ATOMIC_RELAXED);
+    if (active) {
+        bump(&session->sessions, 1);
+    }
+}
+
+// Helper private function to write the HELP and TYPE lines of a metric
+static void write_header(FILE *fp, const char *name, const char *help, const char *type) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Helper private function to write one per-session counter for every game slot
+static void write_session_counter(FILE *fp, const char *name, const char *help, size_t offset) {
+    write_header(fp, name, help, "counter");
+    for (int i = 0; i < n_sessions; i++) {
+        const unsigned long long *value = (const unsigned long long *)((const char *)&sessions[i] + offset);
+        fprintf(fp, "%s{game=\"%d\"} %llu\n", name, i + 1, load(value));
+    }
+}
+
+int metrics_dump(const char *path) {
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        debug("Error opening metrics file %s\n", tmp_path);
+        return -1;
+    }
+
+    // Totals over every shard, taken without stopping the threads that record them
+    unsigned long long counters[METRIC_COUNTERS] = {0};
+    metric_hist_t *histograms = calloc(METRIC_HISTOGRAMS, sizeof(metric_hist_t));
+    if (histograms == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    pthread_mutex_lock(&shards_lock);
+    for (metrics_shard_t *shard = shards; shard != NULL; shard = shard->next) {
+        for (int c = 0; c < METRIC_COUNTERS; c++) {
+            counters[c] += load(&shard->counters[c]);
+        }
+        for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+            for (int b = 0; b < METRIC_BUCKETS; b++) {
+                histograms[h].counts[b] += load(&shard->histograms[h].counts[b]);
+            }
+            histograms[h].sum += load(&shard->histograms[h].sum);
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        write_header(fp, counter_desc[c].name, counter_desc[c].help, "counter");
+        fprintf(fp, "%s %llu\n", counter_desc[c].name, counters[c]);
+    }
+
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+        const char *name = histogram_desc[h].name;
+        write_header(fp, name, histogram_desc[h].help, "histogram");
+        unsigned long long cumulative = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            if (histograms[h].counts[b] == 0) continue;
+            cumulative += histograms[h].counts[b];
+            fprintf(fp, "%s_bucket{le=\"%lld\"} %llu\n", name, bucket_upper(b), cumulative);
+        }
+        fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+        fprintf(fp, "%s_sum %llu\n", name, histograms[h].sum);
+        fprintf(fp, "%s_count %llu\n", name, cumulative);
+    }
+    free(histograms);
+
+    for (int g = 0; g < METRIC_GAUGES; g++) {
+        write_header(fp, gauge_desc[g].name, gauge_desc[g].help, "gauge");
+        fprintf(fp, "%s %lld\n", gauge_desc[g].name, __atomic_load_n(&gauges[g], __ATOMIC_RELAXED));
+    }
+
+    int active_games = 0;
+    for (int i = 0; i < n_sessions; i++) {
+        active_games += __atomic_load_n(&sessions[i].active, __ATOMIC_RELAXED);
+    }
+    write_header(fp, "pacman_active_games", "Game slots running a session.", "gauge");
+    fprintf(fp, "pacman_active_games %d\n", active_games);
+
+    write_header(fp, "pacman_session_active", "Whether the game slot is running a session.", "gauge");
+    for (int i = 0; i < n_sessions; i++) {
+        fprintf(fp, "pacman_session_active{game=\"%d\"} %d\n", i + 1, __atomic_load_n(&sessions[i].active, __ATOMIC_RELAXED));
+    }
+    write_session_counter(fp, "pacman_session_sessions_total", "Sessions the game slot has served.",
+                          offsetof(session_metrics_t, sessions));
+    write_session_counter(fp, "pacman_session_ticks_total", "Frames produced by the game slot.",
+                          offsetof(session_metrics_t, ticks));
+    write_session_counter(fp, "pacman_session_frames_sent_total", "Frames written to the slot's player and spectators.",
+                          offsetof(session_metrics_t, frames_sent));
+    write_session_counter(fp, "pacman_session_bytes_sent_total", "Bytes written to the slot's player and spectators.",
+                          offsetof(session_metrics_t, bytes_sent));
+    write_session_counter(fp, "pacman_session_frames_dropped_total", "Frames the slot's players and spectators missed.",
+                          offsetof(session_metrics_t, frames_dropped));
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        debug("Error writing metrics file %s\n", path);
+        return -1;
+    }
+    return 0;
+}
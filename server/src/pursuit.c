@@ -0,0 +1,165 @@
+#include "pursuit.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+The field is stored with a border of walls around the board, so the neighbours of a cell are
+at fixed offsets and the BFS never checks the edges of the board.
+*/
+
+struct pursuit {
+    int width, height;
+    int stride;             // width + 2, the border columns included
+    unsigned char *open;    // 1 for the cells that are not walls, fixed when the level is loaded
+    int *dist;              // distance to the target minus bias, PURSUIT_UNREACHABLE when there is no path
+    int bias;
+    int target;             // cell of the pacman, with the border
+    int *queue;             // BFS queue, one slot per cell
+    int offsets[4];         // to the W, S, A and D neighbours
+    pthread_rwlock_t lock;  // written by the pacman's moves, read by every pursuer
+};
+
+static const char step_command[4] = {'W', 'S', 'A', 'D'};
+
+// Helper private function for the index of board cell (x, y) in the field
+static inline int field_index(pursuit_t *pursuit, int x, int y) {
+    return (y + 1) * pursuit->stride + x + 1;
+}
+
+// Helper private function that computes the whole field with a BFS from the target
+static void pursuit_build(pursuit_t *pursuit) {
+    int n_cells = pursuit->stride * (pursuit->height + 2);
+    int *dist = pursuit->dist;
+    for (int i = 0; i < n_cells; i++) {
+        dist[i] = PURSUIT_UNREACHABLE;
+    }
+    pursuit->bias = 0;
+    int head = 0, tail = 0;
+    dist[pursuit->target] = 0;
+    pursuit->queue[tail++] = pursuit->target;
+    while (head < tail) {
+        int cell = pursuit->queue[head++];
+        for (int d = 0; d < 4; d++) {
+            int next = cell + pursuit->offsets[d];
+            if (!pursuit->open[next] || dist[next] != PURSUIT_UNREACHABLE) continue;
+            dist[next] = dist[cell] + 1;
+            pursuit->queue[tail++] = next;
+        }
+    }
+}
+
+pursuit_t *pursuit_new(board_t *board, int x, int y) {
+    pursuit_t *pursuit = calloc(1, sizeof(pursuit_t));
+    if (pursuit == NULL) {
+        return NULL;
+    }
+    pthread_rwlock_init(&pursuit->lock, NULL);
+    pursuit->width = board->width;
+    pursuit->height = board->height;
+    pursuit->stride = board->width + 2;
+    int n_cells = pursuit->stride * (board->height + 2);
+    pursuit->open = calloc(n_cells, 1);
+    pursuit->dist = malloc(n_cells * sizeof(int));
+    pursuit->queue = malloc(n_cells * sizeof(int));
+    if (pursuit->open == NULL || pursuit->dist == NULL || pursuit->queue == NULL) {
+        pursuit_free(pursuit);
+        return NULL;
+    }
+    pursuit->offsets[0] = -pursuit->stride;
+    pursuit->offsets[1] = pursuit->stride;
+    pursuit->offsets[2] = -1;
+    pursuit->offsets[3] = 1;
+    // Walls are fixed when the level is loaded, they can be read while the entities move
+    for (int y = 0; y < board->height; y++) {
+        for (int x = 0; x < board->width; x++) {
+            pursuit->open[field_index(pursuit, x, y)] = board->board[y * board->width + x].content != 'W';
+        }
+    }
+    pursuit->target = field_index(pursuit, x, y);
+    pursuit_build(pursuit);
+    return pursuit;
+}
+
+void pursuit_free(pursuit_t *pursuit) {
+    if (pursuit == NULL) return;
+    pthread_rwlock_destroy(&pursuit->lock);
+    free(pursuit->open);
+    free(pursuit->dist);
+    free(pursuit->queue);
+    free(pursuit);
+}
+
+// Helper private function for a target that moved to the neighbour cell target: every cell
+// gets one farther through the bias, then a BFS from the new target brings back the cells that
+// got one closer. Those are reached through each other, a cell is one of them when its old
+// distance is two more than the new distance of the cell it is reached from. A cell brought
+// back no longer passes that test, the BFS visits cells in order of distance
+static void pursuit_repair(pursuit_t *pursuit, int target) {
+    int *dist = pursuit->dist;
+    int old_bias = pursuit->bias;
+    int bias = ++pursuit->bias;
+    int head = 0, tail = 0;
+    dist[target] = -bias;
+    pursuit->queue[tail++] = target;
+    while (head < tail) {
+        int cell = pursuit->queue[head++];
+        // Old distance a closer neighbour had, as stored
+        int expected = dist[cell] + bias + 2 - old_bias;
+        for (int d = 0; d < 4; d++) {
+            int next = cell + pursuit->offsets[d];
+            if (dist[next] != expected || !pursuit->open[next]) continue;
+            dist[next] = expected - 2;
+            pursuit->queue[tail++] = next;
+        }
+    }
+}
+
+void pursuit_target_moved(pursuit_t *pursuit, int x, int y) {
+    int target = field_index(pursuit, x, y);
+    pthread_rwlock_wrlock(&pursuit->lock);
+    if (target != pursuit->target) {
+        int step = abs(target - pursuit->target);
+        int adjacent = step == 1 || step == pursuit->stride;
+        pursuit->target = target;
+        if (adjacent && pursuit->dist[target] != PURSUIT_UNREACHABLE && pursuit->bias < PURSUIT_MAX_BIAS) {
+            pursuit_repair(pursuit, target);
+        } else {
+            pursuit_build(pursuit);
+        }
+    }
+    pthread_rwlock_unlock(&pursuit->lock);
+}
+
+// Helper private function, the caller holds the lock
+static inline int distance_at(pursuit_t *pursuit, int index) {
+    int raw = pursuit->dist[index];
+    return raw == PURSUIT_UNREACHABLE ? PURSUIT_UNREACHABLE : raw + pursuit->bias;
+}
+
+int pursuit_distance(pursuit_t *pursuit, int x, int y) {
+    pthread_rwlock_rdlock(&pursuit->lock);
+    int distance = distance_at(pursuit, field_index(pursuit, x, y));
+    pthread_rwlock_unlock(&pursuit->lock);
+    return distance;
+}
+
+char pursuit_direction(pursuit_t *pursuit, int x, int y, rng_t *rng) {
+    char candidates[4];
+    int n_candidates = 0;
+    int cell = field_index(pursuit, x, y);
+    pthread_rwlock_rdlock(&pursuit->lock);
+    int distance = distance_at(pursuit, cell);
+    if (distance != PURSUIT_UNREACHABLE) {
+        for (int d = 0; d < 4; d++) {
+            int next = cell + pursuit->offsets[d];
+            if (pursuit->open[next] && distance_at(pursuit, next) == distance - 1) {
+                candidates[n_candidates++] = step_command[d];
+            }
+        }
+    }
+    pthread_rwlock_unlock(&pursuit->lock);
+    if (n_candidates == 0) {
+        return 0;
+    }
+    return n_candidates == 1 ? candidates[0] : candidates[rng_below(rng, (uint32_t)n_candidates)];
+}
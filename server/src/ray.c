@@ -0,0 +1,169 @@
+#include "ray.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct ray_index {
+    int width, height;
+    int row_words, col_words;   // 64-bit words per row and per column bitmap
+    unsigned long long *rows;   // bit x of row y is set when (x, y) is occupied
+    unsigned long long *cols;   // bit y of column x is set when (x, y) is occupied
+    int *wall_up;               // per cell, y of the first wall above, -1 if none
+    int *wall_down;             // y of the first wall below, height if none
+    int *wall_left;             // x of the first wall on the left, -1 if none
+    int *wall_right;            // x of the first wall on the right, width if none
+};
+
+// Helper private functions that find the lowest/highest set bit in [from, to), -1 if none;
+// bits are written by other threads, every word is read once, atomically
+static int lowest_set(const unsigned long long *bits, int from, int to) {
+    if (from >= to) return -1;
+    int w = from >> 6;
+    unsigned long long word = __atomic_load_n(&bits[w], __ATOMIC_ACQUIRE) & (~0ULL << (from & 63));
+    for (;;) {
+        if (word != 0) {
+            int bit = w * 64 + __builtin_ctzll(word);
+            return bit < to ? bit : -1;
+        }
+        if ((w + 1) * 64 >= to) return -1;
+        word = __atomic_load_n(&bits[++w], __ATOMIC_ACQUIRE);
+    }
+}
+
+static int highest_set(const unsigned long long *bits, int from, int to) {
+    if (from >= to) return -1;
+    int w = (to - 1) >> 6;
+    unsigned long long word = __atomic_load_n(&bits[w], __ATOMIC_ACQUIRE) & (~0ULL >> (63 - ((to - 1) & 63)));
+    for (;;) {
+        if (word != 0) {
+            int bit = w * 64 + 63 - __builtin_clzll(word);
+            return bit >= from ? bit : -1;
+        }
+        if (w * 64 <= from) return -1;
+        word = __atomic_load_n(&bits[--w], __ATOMIC_ACQUIRE);
+    }
+}
+
+// Helper private function that sweeps every row and column once for the first wall each way
+static void build_wall_tables(ray_index_t *rays, board_t *board) {
+    int width = rays->width, height = rays->height;
+    for (int y = 0; y < height; y++) {
+        int wall = -1;
+        for (int x = 0; x < width; x++) {
+            rays->wall_left[y * width + x] = wall;
+            if (board->board[y * width + x].content == 'W') wall = x;
+        }
+        wall = width;
+        for (int x = width - 1; x >= 0; x--) {
+            rays->wall_right[y * width + x] = wall;
+            if (board->board[y * width + x].content == 'W') wall = x;
+        }
+    }
+    for (int x = 0; x < width; x++) {
+        int wall = -1;
+        for (int y = 0; y < height; y++) {
+            rays->wall_up[y * width + x] = wall;
+            if (board->board[y * width + x].content == 'W') wall = y;
+        }
+        wall = height;
+        for (int y = height - 1; y >= 0; y--) {
+            rays->wall_down[y * width + x] = wall;
+            if (board->board[y * width + x].content == 'W') wall = y;
+        }
+    }
+}
+
+ray_index_t *ray_index_new(board_t *board) {
+    ray_index_t *rays = calloc(1, sizeof(ray_index_t));
+    if (rays == NULL) {
+        return NULL;
+    }
+    int n_cells = board->width * board->height;
+    rays->width = board->width;
+    rays->height = board->height;
+    rays->row_words = (board->width + 63) / 64;
+    rays->col_words = (board->height + 63) / 64;
+    rays->rows = calloc((size_t)board->height * rays->row_words, sizeof(unsigned long long));
+    rays->cols = calloc((size_t)board->width * rays->col_words, sizeof(unsigned long long));
+    rays->wall_up = malloc(n_cells * sizeof(int));
+    rays->wall_down = malloc(n_cells * sizeof(int));
+    rays->wall_left = malloc(n_cells * sizeof(int));
+    rays->wall_right = malloc(n_cells * sizeof(int));
+    if (rays->rows == NULL || rays->cols == NULL || rays->wall_up == NULL || rays->wall_down == NULL ||
+        rays->wall_left == NULL || rays->wall_right == NULL) {
+        ray_index_free(rays);
+        return NULL;
+    }
+    build_wall_tables(rays, board);
+    ray_index_sync(rays, board);
+    return rays;
+}
+
+void ray_index_free(ray_index_t *rays) {
+    if (rays == NULL) return;
+    free(rays->rows);
+    free(rays->cols);
+    free(rays->wall_up);
+    free(rays->wall_down);
+    free(rays->wall_left);
+    free(rays->wall_right);
+    free(rays);
+}
+
+void ray_mark(ray_index_t *rays, int x, int y, int occupied) {
+    unsigned long long *row_word = &rays->rows[y * rays->row_words + (x >> 6)];
+    unsigned long long *col_word = &rays->cols[x * rays->col_words + (y >> 6)];
+    if (occupied) {
+        __atomic_fetch_or(row_word, 1ULL << (x & 63), __ATOMIC_RELEASE);
+        __atomic_fetch_or(col_word, 1ULL << (y & 63), __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(row_word, ~(1ULL << (x & 63)), __ATOMIC_RELEASE);
+        __atomic_fetch_and(col_word, ~(1ULL << (y & 63)), __ATOMIC_RELEASE);
+    }
+}
+
+void ray_index_sync(ray_index_t *rays, board_t *board) {
+    memset(rays->rows, 0, (size_t)rays->height * rays->row_words * sizeof(unsigned long long));
+    memset(rays->cols, 0, (size_t)rays->width * rays->col_words * sizeof(unsigned long long));
+    for (int y = 0; y < rays->height; y++) {
+        for (int x = 0; x < rays->width; x++) {
+            if (board->board[y * rays->width + x].occupant != NO_OCCUPANT) {
+                ray_mark(rays, x, y, 1);
+            }
+        }
+    }
+}
+
+ray_stop_t ray_cast(ray_index_t *rays, int x, int y, char direction, int *free_cells) {
+    int cell = y * rays->width + x;
+    const unsigned long long *col = &rays->cols[x * rays->col_words];
+    const unsigned long long *row = &rays->rows[y * rays->row_words];
+    int wall, hit;
+    switch (direction) {
+        case 'W':
+            wall = rays->wall_up[cell];
+            hit = highest_set(col, wall + 1, y);
+            *free_cells = y - (hit >= 0 ? hit : wall) - 1;
+            break;
+        case 'S':
+            wall = rays->wall_down[cell];
+            hit = lowest_set(col, y + 1, wall);
+            *free_cells = (hit >= 0 ? hit : wall) - y - 1;
+            break;
+        case 'A':
+            wall = rays->wall_left[cell];
+            hit = highest_set(row, wall + 1, x);
+            *free_cells = x - (hit >= 0 ? hit : wall) - 1;
+            break;
+        case 'D':
+            wall = rays->wall_right[cell];
+            hit = lowest_set(row, x + 1, wall);
+            *free_cells = (hit >= 0 ? hit : wall) - x - 1;
+            break;
+        default:
+            *free_cells = 0;
+            return RAY_EDGE;
+    }
+    if (hit >= 0) return RAY_OCCUPANT;
+    int at_edge = wall < 0 || (direction == 'S' && wall == rays->height) || (direction == 'D' && wall == rays->width);
+    return at_edge ? RAY_EDGE : RAY_WALL;
+}
@@ -0,0 +1,453 @@
+#include "replay.h"
+#include "level.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct recorder {
+    FILE *fp;
+    pthread_mutex_t lock;   // held around every move, so moves are written in the order they ran
+    long long last_us;      // time of the previous record
+    int points;             // points at the end of the last level
+    recorder_t *prev, *next; // in the list of recordings in progress
+};
+
+static const char *record_dir = NULL;
+static int sessions_recorded = 0;
+static recorder_t *recorders = NULL; // recordings in progress, for recorder_shutdown
+static pthread_mutex_t recorders_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void recorder_init(void) {
+    record_dir = getenv("PACMAN_RECORD");
+    if (record_dir != NULL) {
+        debug("Recording sessions to %s\n", record_dir);
+    }
+}
+
+static void put_u8(FILE *fp, unsigned int value) {
+    putc((int)(value & 0xFF), fp);
+}
+
+static void put_u32(FILE *fp, unsigned int value) {
+    for (int i = 0; i < 4; i++) {
+        put_u8(fp, value >> (8 * i));
+    }
+}
+
+static void put_u64(FILE *fp, unsigned long long value) {
+    for (int i = 0; i < 8; i++) {
+        put_u8(fp, (unsigned int)(value >> (8 * i)));
+    }
+}
+
+static void put_varint(FILE *fp, unsigned long long value) {
+    while (value >= 0x80) {
+        put_u8(fp, (unsigned int)(value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    put_u8(fp, (unsigned int)value);
+}
+
+// Helper private function that starts a record, the caller holds the recorder's lock
+static void put_record(recorder_t *recorder, unsigned int type) {
+    long long now = now_us();
+    put_u8(recorder->fp, type);
+    put_varint(recorder->fp, (unsigned long long)(now - recorder->last_us));
+    recorder->last_us = now;
+}
+
+recorder_t *recorder_open(int game_id, uint64_t seed) {
+    if (record_dir == NULL) {
+        return NULL;
+    }
+    int session = __atomic_add_fetch(&sessions_recorded, 1, __ATOMIC_RELAXED);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/game%d-%d.rec", record_dir, game_id, session);
+    recorder_t *recorder = malloc(sizeof(recorder_t));
+    if (recorder == NULL) {
+        return NULL;
+    }
+    recorder->fp = fopen(path, "wb");
+    if (recorder->fp == NULL) {
+        debug("Error opening %s\n", path);
+        free(recorder);
+        return NULL;
+    }
+    setvbuf(recorder->fp, NULL, _IOFBF, RECORD_FILE_BUFFER);
+    pthread_mutex_init(&recorder->lock, NULL);
+    recorder->last_us = now_us();
+    recorder->points = 0;
+
+    fwrite(REPLAY_MAGIC, 1, 4, recorder->fp);
+    put_u8(recorder->fp, REPLAY_VERSION);
+    put_u64(recorder->fp, seed);
+    put_u32(recorder->fp, (unsigned int)game_id);
+
+    pthread_mutex_lock(&recorders_lock);
+    recorder->prev = NULL;
+    recorder->next = recorders;
+    if (recorders != NULL) recorders->prev = recorder;
+    recorders = recorder;
+    pthread_mutex_unlock(&recorders_lock);
+    debug("Recording game %d to %s\n", game_id, path);
+    return recorder;
+}
+
+void recorder_level_start(recorder_t *recorder, const char *level_name, int points) {
+    if (recorder == NULL) return;
+    size_t len = strlen(level_name);
+    if (len > 255) len = 255;
+    pthread_mutex_lock(&recorder->lock);
+    put_record(recorder, REC_LEVEL_START);
+    put_u8(recorder->fp, (unsigned int)len);
+    fwrite(level_name, 1, len, recorder->fp);
+    put_varint(recorder->fp, (unsigned long long)points);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+void recorder_level_end(recorder_t *recorder, board_t *board, int result) {
+    if (recorder == NULL) return;
+    pthread_mutex_lock(&recorder->lock);
+    recorder->points = board->pacmans[0].points;
+    put_record(recorder, REC_LEVEL_END);
+    put_u8(recorder->fp, (unsigned int)result);
+    put_varint(recorder->fp, (unsigned long long)recorder->points);
+    put_u64(recorder->fp, board_state_hash(board));
+    // A level is only kept in RECORD_FILE_BUFFER until it ends
+    fflush(recorder->fp);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+void recorder_close(recorder_t *recorder, int victory) {
+    if (recorder == NULL) return;
+    pthread_mutex_lock(&recorders_lock);
+    if (recorder->prev != NULL) recorder->prev->next = recorder->next;
+    else recorders = recorder->next;
+    if (recorder->next != NULL) recorder->next->prev = recorder->prev;
+    pthread_mutex_unlock(&recorders_lock);
+    // Waits for good when recorder_shutdown stopped the recording first
+    pthread_mutex_lock(&recorder->lock);
+    put_record(recorder, REC_SESSION_END);
+    put_varint(recorder->fp, (unsigned long long)recorder->points);
+    put_u8(recorder->fp, (unsigned int)victory);
+    fclose(recorder->fp);
+    pthread_mutex_unlock(&recorder->lock);
+    pthread_mutex_destroy(&recorder->lock);
+    free(recorder);
+}
+
+void recorder_shutdown(void) {
+    pthread_mutex_lock(&recorders_lock);
+    for (recorder_t *recorder = recorders; recorder != NULL; recorder = recorder->next) {
+        // Kept locked, the session's threads are not joined: its file ends on a whole record
+        pthread_mutex_lock(&recorder->lock);
+        fflush(recorder->fp);
+    }
+    pthread_mutex_unlock(&recorders_lock);
+}
+
+int recorded_move_pacman(board_t *board, int pacman_index, command_t *command) {
+    recorder_t *recorder = board->recorder;
+    if (recorder == NULL) {
+        return move_pacman(board, pacman_index, command);
+    }
+    pthread_mutex_lock(&recorder->lock);
+    char direction = command->command;
+    int result = move_pacman(board, pacman_index, command);
+    if (pacman_index == 0) {
+        put_record(recorder, REC_PACMAN);
+    } else {
+        put_record(recorder, REC_PLAYER_PACMAN);
+        put_u8(recorder->fp, (unsigned int)pacman_index);
+    }
+    put_u8(recorder->fp, (unsigned char)direction);
+    pthread_mutex_unlock(&recorder->lock);
+    return result;
+}
+
+int recorded_move_ghost(board_t *board, int ghost_index, command_t *command) {
+    recorder_t *recorder = board->recorder;
+    if (recorder == NULL) {
+        return move_ghost(board, ghost_index, command);
+    }
+    pthread_mutex_lock(&recorder->lock);
+    int result = move_ghost(board, ghost_index, command);
+    put_record(recorder, 1 + ghost_index);
+    pthread_mutex_unlock(&recorder->lock);
+    return result;
+}
+
+int recorded_add_pacman(board_t *board, int pacman_index, int points) {
+    recorder_t *recorder = board->recorder;
+    if (recorder == NULL) {
+        return add_pacman(board, pacman_index, points);
+    }
+    pthread_mutex_lock(&recorder->lock);
+    int result = add_pacman(board, pacman_index, points);
+    if (result == 0) {
+        put_record(recorder, REC_PLAYER_JOIN);
+        put_u8(recorder->fp, (unsigned int)pacman_index);
+        put_varint(recorder->fp, (unsigned long long)points);
+    }
+    pthread_mutex_unlock(&recorder->lock);
+    return result;
+}
+
+void recorded_remove_pacman(board_t *board, int pacman_index) {
+    recorder_t *recorder = board->recorder;
+    if (recorder == NULL) {
+        kill_pacman(board, pacman_index);
+        return;
+    }
+    pthread_mutex_lock(&recorder->lock);
+    kill_pacman(board, pacman_index);
+    put_record(recorder, REC_PLAYER_LEAVE);
+    put_u8(recorder->fp, (unsigned int)pacman_index);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+int recorded_restore(board_t *board, const snapshot_t *snap) {
+    recorder_t *recorder = board->recorder;
+    if (recorder == NULL) {
+        return snapshot_restore(board, snap);
+    }
+    pthread_mutex_lock(&recorder->lock);
+    int result = snapshot_restore(board, snap);
+    unsigned char *data = result == 0 ? malloc(snapshot_encoded_size(snap)) : NULL;
+    if (data != NULL) {
+        size_t len = snapshot_encode(snap, data);
+        put_record(recorder, REC_RESTORE);
+        put_varint(recorder->fp, len);
+        fwrite(data, 1, len, recorder->fp);
+        free(data);
+    } else if (result == 0) {
+        debug("Error recording the restore of game %d\n", board->game_id);
+    }
+    pthread_mutex_unlock(&recorder->lock);
+    return result;
+}
+
+// Helper private functions that read what the put_ functions wrote, -1 at the end of the file
+static int get_u8(FILE *fp, unsigned int *value) {
+    int c = getc(fp);
+    if (c == EOF) return -1;
+    *value = (unsigned int)c;
+    return 0;
+}
+
+static int get_u32(FILE *fp, unsigned int *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        unsigned int byte;
+        if (get_u8(fp, &byte) < 0) return -1;
+        *value |= byte << (8 * i);
+    }
+    return 0;
+}
+
+static int get_u64(FILE *fp, unsigned long long *value) {
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        unsigned int byte;
+        if (get_u8(fp, &byte) < 0) return -1;
+        *value |= (unsigned long long)byte << (8 * i);
+    }
+    return 0;
+}
+
+static int get_varint(FILE *fp, unsigned long long *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        unsigned int byte;
+        if (get_u8(fp, &byte) < 0) return -1;
+        *value |= (unsigned long long)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return 0;
+    }
+    return -1;
+}
+
+int replay_session(char *level_dir, const char *path) {
+    level_info *levels = calloc(MAX_LEVELS, sizeof(level_info));
+    if (levels == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    int n_levels = read_dir(level_dir, levels);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        free(levels);
+        return 1;
+    }
+    char magic[4];
+    unsigned int version, game_id;
+    unsigned long long seed;
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, REPLAY_MAGIC, 4) != 0 ||
+        get_u8(fp, &version) < 0 || version < REPLAY_MIN_VERSION || version > REPLAY_VERSION ||
+        get_u64(fp, &seed) < 0 || get_u32(fp, &game_id) < 0) {
+        fprintf(stderr, "%s is not a recording this server can replay\n", path);
+        fclose(fp);
+        free(levels);
+        return 1;
+    }
+    printf("replaying game %u, seed %llu\n", game_id, seed);
+
+    board_t board = {0};
+    snapshot_t snap = {0};
+    board.game_id = (int)game_id;
+    board.rng_seed = seed;
+    int loaded = 0;
+    int mismatches = 0;
+    int ended = 0;
+    int error = 0;
+    long long moves = 0;
+    unsigned long long recorded_us = 0;
+    long long start = now_us();
+
+    unsigned int type;
+    while (!ended && !error && get_u8(fp, &type) == 0) {
+        unsigned long long dt;
+        if (get_varint(fp, &dt) < 0) {
+            error = 1;
+            break;
+        }
+        recorded_us += dt;
+
+        if (type == REC_LEVEL_START) {
+            unsigned int len;
+            char name[256];
+            unsigned long long points;
+            if (get_u8(fp, &len) < 0 || fread(name, 1, len, fp) != len || get_varint(fp, &points) < 0) {
+                error = 1;
+                break;
+            }
+            name[len] = '\0';
+            level_info *info = NULL;
+            for (int i = 0; i < n_levels; i++) {
+                if (strcmp(levels[i].file_name, name) == 0) info = &levels[i];
+            }
+            if (info == NULL) {
+                fprintf(stderr, "level %s is not in %s\n", name, level_dir);
+                error = 1;
+                break;
+            }
+            if (loaded) unload_level(&board);
+            load_level(&board, (int)points, info);
+            loaded = 1;
+        } else if (type == REC_LEVEL_END) {
+            unsigned int result;
+            unsigned long long points, hash;
+            if (!loaded || get_u8(fp, &result) < 0 || get_varint(fp, &points) < 0 || get_u64(fp, &hash) < 0) {
+                error = 1;
+                break;
+            }
+            unsigned long long replayed_hash = board_state_hash(&board);
+            int match = replayed_hash == hash && (unsigned long long)board.pacmans[0].points == points;
+            mismatches += !match;
+            printf("level %s ended with result %u: points %d (recorded %llu), hash %016llx (recorded %016llx) %s\n",
+                   board.level_name, result, board.pacmans[0].points, points, replayed_hash, hash,
+                   match ? "ok" : "DIVERGED");
+            unload_level(&board);
+            loaded = 0;
+        } else if (type == REC_SESSION_END) {
+            unsigned long long points;
+            unsigned int victory;
+            if (get_varint(fp, &points) < 0 || get_u8(fp, &victory) < 0) {
+                error = 1;
+                break;
+            }
+            printf("session ended with %llu points, %s\n", points, victory ? "victory" : "game over");
+            ended = 1;
+        } else if (type == REC_PACMAN) {
+            unsigned int direction;
+            if (!loaded || get_u8(fp, &direction) < 0) {
+                error = 1;
+                break;
+            }
+            pacman_t *pacman = &board.pacmans[0];
+            command_t input = {(char)direction, 1, 1};
+            command_t *play = &input;
+            if (pacman->n_moves > 0) {
+                // Scripted pacmans replay their own script, the recorded command only checks it
+                play = &pacman->moves[pacman->current_move % pacman->n_moves];
+                if (play->command != (char)direction) {
+                    printf("move %lld: pacman played %c, recorded %c\n", moves, play->command, (char)direction);
+                    mismatches++;
+                }
+            }
+            move_pacman(&board, 0, play);
+            moves++;
+        } else if (type == REC_PLAYER_PACMAN) {
+            unsigned int index, direction;
+            if (!loaded || get_u8(fp, &index) < 0 || get_u8(fp, &direction) < 0 ||
+                index == 0 || index >= MAX_PACMANS) {
+                error = 1;
+                break;
+            }
+            command_t input = {(char)direction, 1, 1};
+            move_pacman(&board, (int)index, &input);
+            moves++;
+        } else if (type == REC_PLAYER_JOIN) {
+            unsigned int index;
+            unsigned long long points;
+            if (!loaded || get_u8(fp, &index) < 0 || get_varint(fp, &points) < 0 ||
+                add_pacman(&board, (int)index, (int)points) < 0) {
+                error = 1;
+                break;
+            }
+        } else if (type == REC_PLAYER_LEAVE) {
+            unsigned int index;
+            if (!loaded || get_u8(fp, &index) < 0 || index >= MAX_PACMANS) {
+                error = 1;
+                break;
+            }
+            kill_pacman(&board, (int)index);
+        } else if (type == REC_RESTORE) {
+            unsigned long long len;
+            if (!loaded || get_varint(fp, &len) < 0) {
+                error = 1;
+                break;
+            }
+            unsigned char *data = malloc(len > 0 ? len : 1);
+            if (data == NULL || fread(data, 1, len, fp) != len ||
+                snapshot_decode(&snap, data, len) < 0 || snapshot_restore(&board, &snap) < 0) {
+                free(data);
+                error = 1;
+                break;
+            }
+            free(data);
+        } else if (type >= 1 && (int)type <= MAX_GHOSTS) {
+            int index = (int)type - 1;
+            if (!loaded || index >= board.n_ghosts) {
+                error = 1;
+                break;
+            }
+            ghost_t *ghost = &board.ghosts[index];
+            move_ghost(&board, index, &ghost->moves[ghost->current_move % ghost->n_moves]);
+            moves++;
+        } else {
+            error = 1;
+        }
+    }
+    double elapsed_s = (double)(now_us() - start) / 1000000;
+    if (loaded) unload_level(&board);
+    snapshot_release(&snap);
+    fclose(fp);
+    for (int i = 0; i < n_levels; i++) {
+        free(levels[i].board);
+    }
+    free(levels);
+
+    if (error) {
+        fprintf(stderr, "%s is corrupted after %lld moves\n", path, moves);
+        return 1;
+    }
+    if (!ended) {
+        printf("recording stops before the end of the session\n");
+    }
+    printf("%lld moves replayed in %.3f s (recorded over %.1f s), %.0f moves/s\n",
+           moves, elapsed_s, (double)recorded_us / 1000000, elapsed_s > 0 ? moves / elapsed_s : 0);
+    printf("%s\n", mismatches == 0 ? "replay matches the recording" : "replay DIVERGED from the recording");
+    return mismatches == 0 ? 0 : 1;
+}
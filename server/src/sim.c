@@ -0,0 +1,157 @@
+#include "sim.h"
+#include "board.h"
+#include "level.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static const char *outcome_names[] = {"victory", "game over", "timeout"};
+
+typedef struct {
+    level_info *levels;
+    int n_levels;
+    int n_games;
+    uint64_t seed;
+    long long max_ticks;
+    int next_game;          // next game to simulate, shared by the threads
+    sim_result_t *results;
+} sim_args_t;
+
+// Helper private function that plays one whole game, level after level
+static sim_result_t simulate_game(level_info *levels, int n_levels, uint64_t seed, long long max_ticks) {
+    sim_result_t result = {SIM_TIMEOUT, 0, 0, 0, 0};
+    board_t board = {0};
+    board.rng_seed = seed;
+
+    for (int lvl = 0; lvl < n_levels; lvl++) {
+        load_level(&board, result.points, &levels[lvl]);
+        pacman_t *pacman = &board.pacmans[0];
+        int level_over = 0;
+
+        while (!level_over && result.ticks < max_ticks) {
+            result.ticks++;
+            // Without a script the pacman waits for input that never comes, like a silent client
+            if (pacman->n_moves > 0) {
+                int move = move_pacman(&board, 0, &pacman->moves[pacman->current_move % pacman->n_moves]);
+                result.moves++;
+                if (move == REACHED_PORTAL) {
+                    level_over = 1;
+                    result.levels++;
+                    break;
+                }
+            }
+            for (int i = 0; i < board.n_ghosts && pacman->alive; i++) {
+                ghost_t *ghost = &board.ghosts[i];
+                move_ghost(&board, i, &ghost->moves[ghost->current_move % ghost->n_moves]);
+                result.moves++;
+            }
+            if (!pacman->alive) {
+                result.outcome = SIM_GAME_OVER;
+                level_over = 1;
+            }
+        }
+        result.points = pacman->points;
+        unload_level(&board);
+        if (!level_over || result.outcome == SIM_GAME_OVER) {
+            return result;
+        }
+    }
+    result.outcome = SIM_VICTORY;
+    return result;
+}
+
+static void *sim_thread(void *arg) {
+    sim_args_t *args = arg;
+    int game;
+    while ((game = __atomic_fetch_add(&args->next_game, 1, __ATOMIC_RELAXED)) < args->n_games) {
+        // Same derivation as the server's sessions, game i of a seed is always the same game
+        uint64_t seed = rng_derive(args->seed, (uint64_t)game);
+        args->results[game] = simulate_game(args->levels, args->n_levels, seed, args->max_ticks);
+    }
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s --headless [-g games] [-s seed] [-t max_ticks] [-j threads] <level_directory>\n", name);
+}
+
+int simulate_main(int argc, char **argv) {
+    sim_args_t args = {0};
+    args.n_games = 1;
+    args.seed = 1;
+    args.max_ticks = SIM_DEFAULT_MAX_TICKS;
+    int n_threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "g:s:t:j:")) != -1) {
+        switch (opt) {
+            case 'g': args.n_games = atoi(optarg); break;
+            case 's': args.seed = strtoull(optarg, NULL, 10); break;
+            case 't': args.max_ticks = atoll(optarg); break;
+            case 'j': n_threads = atoi(optarg); break;
+            default: usage(argv[-1]); return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || args.n_games <= 0 || args.max_ticks <= 0 || n_threads <= 0) {
+        usage(argv[-1]);
+        return EXIT_FAILURE;
+    }
+
+    args.levels = calloc(MAX_LEVELS, sizeof(level_info));
+    args.results = calloc(args.n_games, sizeof(sim_result_t));
+    pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+    if (args.levels == NULL || args.results == NULL || threads == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    args.n_levels = read_dir(argv[optind], args.levels);
+    if (args.n_levels <= 0) {
+        fprintf(stderr, "No levels in %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    for (int l = 0; l < args.n_levels; l++) {
+        for (int i = 0; i < args.levels[l].n_ghosts; i++) {
+            if (args.levels[l].ghosts_info[i].n_moves == 0) {
+                fprintf(stderr, "Ghost %s of %s has no moves\n", args.levels[l].ghost_files[i], args.levels[l].file_name);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    long long start = now_us();
+    for (int i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, sim_thread, &args);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed_s = (double)(now_us() - start) / 1000000;
+
+    long long ticks = 0, moves = 0, points = 0;
+    int outcomes[3] = {0};
+    for (int i = 0; i < args.n_games; i++) {
+        sim_result_t *result = &args.results[i];
+        ticks += result->ticks;
+        moves += result->moves;
+        points += result->points;
+        outcomes[result->outcome]++;
+        if (args.n_games <= 16) {
+            printf("game %d: %s after %lld ticks, %d levels, %d points\n",
+                   i + 1, outcome_names[result->outcome], result->ticks, result->levels, result->points);
+        }
+    }
+    printf("%d games on %d levels with seed %llu: %d victories, %d game overs, %d timeouts, %.1f points on average\n",
+           args.n_games, args.n_levels, (unsigned long long)args.seed, outcomes[SIM_VICTORY], outcomes[SIM_GAME_OVER],
+           outcomes[SIM_TIMEOUT], (double)points / args.n_games);
+    printf("%lld ticks and %lld moves in %.3f s: %.0f ticks/s, %.0f moves/s\n",
+           ticks, moves, elapsed_s, elapsed_s > 0 ? ticks / elapsed_s : 0, elapsed_s > 0 ? moves / elapsed_s : 0);
+
+    for (int i = 0; i < args.n_levels; i++) {
+        free(args.levels[i].board);
+    }
+    free(args.levels);
+    free(args.results);
+    free(threads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,643 @@
+#include "snapshot.h"
+#include "pursuit.h"
+#include "ray.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define MAX_VARINT 10 // bytes of the longest varint, a u64
+
+// An encoded checkpoint waiting for the writer thread, or the removal of one when data is NULL
+typedef struct checkpoint_job {
+    int game_id;
+    unsigned char *data;
+    size_t len;
+    struct checkpoint_job *next;
+} checkpoint_job_t;
+
+static const char *checkpoint_dir = NULL;
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+static checkpoint_job_t *checkpoint_jobs = NULL;   // oldest first, at most one per game
+static int checkpoint_stopping = 0;
+static pthread_t checkpoint_writer;
+
+// Helper private functions that keep what changes of an entity, with the snapshot lock held for writing
+static void save_pacman(entity_state_t *state, pacman_t *pac) {
+    state->pos_x = pac->pos_x;
+    state->pos_y = pac->pos_y;
+    state->alive = __atomic_load_n(&pac->alive, __ATOMIC_ACQUIRE);
+    state->points = pac->points;
+    state->waiting = pac->waiting;
+    state->current_move = pac->current_move;
+    state->charged = 0;
+    state->rng = pac->rng;
+    state->n_moves = pac->n_moves;
+    for (int j = 0; j < pac->n_moves; j++) {
+        state->turns_left[j] = pac->moves[j].turns_left;
+    }
+}
+
+static void save_ghost(entity_state_t *state, ghost_t *ghost) {
+    state->pos_x = ghost->pos_x;
+    state->pos_y = ghost->pos_y;
+    state->alive = 1;
+    state->points = 0;
+    state->waiting = ghost->waiting;
+    state->current_move = ghost->current_move;
+    state->charged = ghost->charged;
+    state->rng = ghost->rng;
+    state->n_moves = ghost->n_moves;
+    for (int j = 0; j < ghost->n_moves; j++) {
+        state->turns_left[j] = ghost->moves[j].turns_left;
+    }
+}
+
+// Helper private function that copies the dots of a chunk into snap->dots, chunks are whole words;
+// dots are read atomically, a chunk copied while pacmans move is copied again under the lock
+static void copy_chunk(board_t *board, snapshot_t *snap, int chunk) {
+    int n_cells = board->width * board->height;
+    int first = chunk * SNAPSHOT_CHUNK_CELLS;
+    int last = first + SNAPSHOT_CHUNK_CELLS < n_cells ? first + SNAPSHOT_CHUNK_CELLS : n_cells;
+    for (int word = first / 64; word * 64 < last; word++) {
+        int end = word * 64 + 64 < last ? word * 64 + 64 : last;
+        uint64_t bits = 0;
+        for (int i = word * 64; i < end; i++) {
+            bits |= (uint64_t)(__atomic_load_n(&board->board[i].has_dot, __ATOMIC_RELAXED) != 0) << (i & 63);
+        }
+        snap->dots[word] = bits;
+    }
+}
+
+int snapshot_capture(board_t *board, snapshot_t *snap) {
+    int n_cells = board->width * board->height;
+    int n_words = (n_cells + 63) / 64;
+    // A snapshot of another level load is copied whole
+    int full = snap->level_serial != board->level_serial;
+    if (full && (snap->dots == NULL || n_words > snap->capacity)) {
+        uint64_t *dots = realloc(snap->dots, (n_words > 0 ? n_words : 1) * sizeof(uint64_t));
+        if (dots == NULL) {
+            return -1;
+        }
+        snap->dots = dots;
+        snap->capacity = n_words;
+    }
+    if (full) {
+        snap->n_words = n_words;
+    }
+
+    int n_chunks = (n_cells + SNAPSHOT_CHUNK_CELLS - 1) / SNAPSHOT_CHUNK_CELLS;
+    if (full) {
+        // The whole board is copied while the game goes on, from an epoch of its own: under the
+        // lock only the chunks where a dot was eaten meanwhile are copied again
+        pthread_rwlock_wrlock(&board->snapshot_lock);
+        snap->epoch = board->capture_epoch++;
+        pthread_rwlock_unlock(&board->snapshot_lock);
+        for (int c = 0; c < n_chunks; c++) {
+            copy_chunk(board, snap, c);
+        }
+    }
+
+    pthread_rwlock_wrlock(&board->snapshot_lock);
+    for (int c = 0; c < n_chunks; c++) {
+        if (board->dirty_chunks[c] > snap->epoch) {
+            copy_chunk(board, snap, c);
+        }
+    }
+    snap->n_pacmans = board->n_pacmans;
+    for (int i = 0; i < board->n_pacmans; i++) {
+        save_pacman(&snap->pacmans[i], &board->pacmans[i]);
+    }
+    snap->n_ghosts = board->n_ghosts;
+    for (int i = 0; i < board->n_ghosts; i++) {
+        save_ghost(&snap->ghosts[i], &board->ghosts[i]);
+    }
+    snap->rng_seed = board->rng_seed;
+    snap->level_serial = board->level_serial;
+    snap->epoch = board->capture_epoch++;
+    pthread_rwlock_unlock(&board->snapshot_lock);
+
+    strcpy(snap->level_name, board->level_name);
+    snap->width = board->width;
+    snap->height = board->height;
+    snap->captured_us = now_us();
+    return 0;
+}
+
+// Helper private function that takes whatever stands on (x, y) off the board
+static void clear_cell(board_t *board, int x, int y) {
+    board_pos_t *pos = &board->board[y * board->width + x];
+    if (pos->occupant != NO_OCCUPANT) {
+        pos->occupant = NO_OCCUPANT;
+        ray_mark(board->rays, x, y, 0);
+    }
+}
+
+// Helper private function that puts an entity on (x, y)
+static void place(board_t *board, int x, int y, int occupant) {
+    board->board[y * board->width + x].occupant = occupant;
+    ray_mark(board->rays, x, y, 1);
+}
+
+// Helper private function that puts the dots of a chunk back, stamping it when they changed
+static void restore_chunk(board_t *board, const snapshot_t *snap, int chunk) {
+    int n_cells = board->width * board->height;
+    int first = chunk * SNAPSHOT_CHUNK_CELLS;
+    int last = first + SNAPSHOT_CHUNK_CELLS < n_cells ? first + SNAPSHOT_CHUNK_CELLS : n_cells;
+    int changed = 0;
+    for (int i = first; i < last; i++) {
+        char has_dot = (char)((snap->dots[i / 64] >> (i & 63)) & 1);
+        if (board->board[i].has_dot != has_dot) {
+            board->board[i].has_dot = has_dot;
+            changed = 1;
+        }
+    }
+    if (changed) {
+        board->dirty_chunks[chunk] = board->capture_epoch;
+    }
+}
+
+// Helper private function, whether every script of the level has the length it had in snap
+static int same_scripts(board_t *board, const snapshot_t *snap) {
+    if (snap->n_ghosts != board->n_ghosts || snap->n_pacmans < 1 ||
+        snap->pacmans[0].n_moves != board->pacmans[0].n_moves) {
+        return 0;
+    }
+    for (int i = 0; i < board->n_ghosts; i++) {
+        if (snap->ghosts[i].n_moves != board->ghosts[i].n_moves) return 0;
+    }
+    for (int i = 1; i < snap->n_pacmans; i++) {
+        if (snap->pacmans[i].n_moves != 0) return 0; // players added by add_pacman have no script
+    }
+    return 1;
+}
+
+// Helper private function, whether every pacman and ghost of snap stands on a cell of a
+// width x height board
+static int entities_inside(const snapshot_t *snap, int width, int height) {
+    for (int i = 0; i < snap->n_pacmans + snap->n_ghosts; i++) {
+        const entity_state_t *state = i < snap->n_pacmans ? &snap->pacmans[i] : &snap->ghosts[i - snap->n_pacmans];
+        if (state->pos_x < 0 || state->pos_x >= width || state->pos_y < 0 || state->pos_y >= height) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int snapshot_restore(board_t *board, const snapshot_t *snap) {
+    // A snapshot of the store was never decoded, its positions are checked here too
+    if (strcmp(snap->level_name, board->level_name) != 0 || snap->width != board->width ||
+        snap->height != board->height || snap->n_pacmans > MAX_PACMANS || snap->n_ghosts > MAX_GHOSTS ||
+        !same_scripts(board, snap) || !entities_inside(snap, board->width, board->height)) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&board->snapshot_lock);
+    // Every entity leaves the board before any comes back, they may have swapped cells
+    for (int i = 0; i < board->n_pacmans; i++) {
+        pacman_t *pac = &board->pacmans[i];
+        if (pac->alive) clear_cell(board, pac->pos_x, pac->pos_y);
+        pac->alive = 0;
+    }
+    for (int i = 0; i < board->n_ghosts; i++) {
+        clear_cell(board, board->ghosts[i].pos_x, board->ghosts[i].pos_y);
+    }
+
+    // Only the chunks that changed since the capture can differ, all of them for another level load
+    int n_chunks = (board->width * board->height + SNAPSHOT_CHUNK_CELLS - 1) / SNAPSHOT_CHUNK_CELLS;
+    int same_load = snap->level_serial == board->level_serial;
+    for (int c = 0; c < n_chunks; c++) {
+        if (!same_load || board->dirty_chunks[c] > snap->epoch) {
+            restore_chunk(board, snap, c);
+        }
+    }
+
+    for (int i = 0; i < snap->n_pacmans; i++) {
+        const entity_state_t *state = &snap->pacmans[i];
+        pacman_t *pac = &board->pacmans[i];
+        pac->pos_x = state->pos_x;
+        pac->pos_y = state->pos_y;
+        pac->points = state->points;
+        pac->waiting = state->waiting;
+        pac->current_move = state->current_move;
+        pac->rng = state->rng;
+        for (int j = 0; j < state->n_moves; j++) {
+            pac->moves[j].turns_left = state->turns_left[j];
+        }
+        pac->alive = state->alive;
+        if (!state->alive) continue;
+        place(board, state->pos_x, state->pos_y, OCCUPANT_PACMAN(i));
+        if (board->has_pursuers) {
+            if (board->pursuit[i] == NULL) {
+                board->pursuit[i] = pursuit_new(board, state->pos_x, state->pos_y);
+            } else {
+                pursuit_target_moved(board->pursuit[i], state->pos_x, state->pos_y);
+            }
+        }
+    }
+    for (int i = 0; i < snap->n_ghosts; i++) {
+        const entity_state_t *state = &snap->ghosts[i];
+        ghost_t *ghost = &board->ghosts[i];
+        ghost->pos_x = state->pos_x;
+        ghost->pos_y = state->pos_y;
+        ghost->waiting = state->waiting;
+        ghost->current_move = state->current_move;
+        ghost->charged = state->charged;
+        ghost->rng = state->rng;
+        for (int j = 0; j < state->n_moves; j++) {
+            ghost->moves[j].turns_left = state->turns_left[j];
+        }
+        place(board, state->pos_x, state->pos_y, OCCUPANT_GHOST(i));
+    }
+    board->n_pacmans = snap->n_pacmans;
+    board->rng_seed = snap->rng_seed;
+    pthread_rwlock_unlock(&board->snapshot_lock);
+    return 0;
+}
+
+void snapshot_release(snapshot_t *snap) {
+    free(snap->dots);
+    memset(snap, 0, sizeof(snapshot_t));
+}
+
+size_t snapshot_encoded_size(const snapshot_t *snap) {
+    size_t size = 4 + 1 + 1 + strlen(snap->level_name) + 2 * MAX_VARINT + 8 + 2;
+    for (int i = 0; i < snap->n_pacmans + snap->n_ghosts; i++) {
+        const entity_state_t *state = i < snap->n_pacmans ? &snap->pacmans[i] : &snap->ghosts[i - snap->n_pacmans];
+        size += 5 * MAX_VARINT + 2 + 16 + 1 + (size_t)state->n_moves * MAX_VARINT;
+    }
+    return size + (size_t)snap->n_words * 8;
+}
+
+// Helper private functions that write the image, each returns the end of what it wrote
+static unsigned char *put_u32(unsigned char *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        *p++ = (unsigned char)(value >> (8 * i));
+    }
+    return p;
+}
+
+static unsigned char *put_u64(unsigned char *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        *p++ = (unsigned char)(value >> (8 * i));
+    }
+    return p;
+}
+
+static unsigned char *put_varint(unsigned char *p, unsigned long long value) {
+    while (value >= 0x80) {
+        *p++ = (unsigned char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+static unsigned char *put_entity(unsigned char *p, const entity_state_t *state) {
+    p = put_varint(p, (unsigned int)state->pos_x);
+    p = put_varint(p, (unsigned int)state->pos_y);
+    *p++ = (unsigned char)(state->alive != 0);
+    p = put_varint(p, (unsigned int)state->points);
+    p = put_varint(p, (unsigned int)state->waiting);
+    p = put_varint(p, (unsigned int)state->current_move);
+    *p++ = (unsigned char)(state->charged != 0);
+    for (int i = 0; i < 4; i++) {
+        p = put_u32(p, state->rng.s[i]);
+    }
+    *p++ = (unsigned char)state->n_moves;
+    for (int j = 0; j < state->n_moves; j++) {
+        p = put_varint(p, (unsigned int)state->turns_left[j]);
+    }
+    return p;
+}
+
+size_t snapshot_encode(const snapshot_t *snap, unsigned char *data) {
+    unsigned char *p = data;
+    memcpy(p, SNAPSHOT_MAGIC, 4);
+    p += 4;
+    *p++ = SNAPSHOT_VERSION;
+    size_t name_len = strlen(snap->level_name);
+    *p++ = (unsigned char)name_len;
+    memcpy(p, snap->level_name, name_len);
+    p += name_len;
+    p = put_varint(p, (unsigned int)snap->width);
+    p = put_varint(p, (unsigned int)snap->height);
+    p = put_u64(p, snap->rng_seed);
+    *p++ = (unsigned char)snap->n_pacmans;
+    *p++ = (unsigned char)snap->n_ghosts;
+    for (int i = 0; i < snap->n_pacmans; i++) {
+        p = put_entity(p, &snap->pacmans[i]);
+    }
+    for (int i = 0; i < snap->n_ghosts; i++) {
+        p = put_entity(p, &snap->ghosts[i]);
+    }
+    for (int i = 0; i < snap->n_words; i++) {
+        p = put_u64(p, snap->dots[i]);
+    }
+    return (size_t)(p - data);
+}
+
+// Reads an image, error is set as soon as it runs past its end
+typedef struct {
+    const unsigned char *p, *end;
+    int error;
+} reader_t;
+
+// Helper private functions that read what the put_ functions wrote
+static unsigned int get_u8(reader_t *r) {
+    if (r->p >= r->end) {
+        r->error = 1;
+        return 0;
+    }
+    return *r->p++;
+}
+
+static uint64_t get_u64(reader_t *r, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)get_u8(r) << (8 * i);
+    }
+    return value;
+}
+
+static unsigned int get_varint(reader_t *r) {
+    unsigned long long value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        unsigned int byte = get_u8(r);
+        value |= (unsigned long long)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return (unsigned int)value;
+    }
+    r->error = 1;
+    return 0;
+}
+
+static void get_entity(reader_t *r, entity_state_t *state) {
+    state->pos_x = (int)get_varint(r);
+    state->pos_y = (int)get_varint(r);
+    state->alive = (int)get_u8(r);
+    state->points = (int)get_varint(r);
+    state->waiting = (int)get_varint(r);
+    state->current_move = (int)get_varint(r);
+    state->charged = (int)get_u8(r);
+    for (int i = 0; i < 4; i++) {
+        state->rng.s[i] = (uint32_t)get_u64(r, 4);
+    }
+    state->n_moves = (int)get_u8(r);
+    if (state->n_moves > MAX_MOVES) {
+        r->error = 1;
+        return;
+    }
+    for (int j = 0; j < state->n_moves; j++) {
+        state->turns_left[j] = (int)get_varint(r);
+    }
+}
+
+int snapshot_decode(snapshot_t *snap, const unsigned char *data, size_t len) {
+    reader_t r = {data, data + len, 0};
+    if (len < 6 || memcmp(data, SNAPSHOT_MAGIC, 4) != 0 || data[4] != SNAPSHOT_VERSION) {
+        return -1;
+    }
+    r.p += 5;
+    unsigned int name_len = get_u8(&r);
+    if (r.error || (size_t)(r.end - r.p) < name_len) {
+        return -1;
+    }
+    memcpy(snap->level_name, r.p, name_len);
+    snap->level_name[name_len] = '\0';
+    r.p += name_len;
+    unsigned int width = get_varint(&r);
+    unsigned int height = get_varint(&r);
+    snap->rng_seed = get_u64(&r, 8);
+    snap->n_pacmans = (int)get_u8(&r);
+    snap->n_ghosts = (int)get_u8(&r);
+    if (r.error || snap->n_pacmans > MAX_PACMANS || snap->n_ghosts > MAX_GHOSTS ||
+        width > INT_MAX / (height > 0 ? height : 1)) {
+        return -1;
+    }
+    for (int i = 0; i < snap->n_pacmans && !r.error; i++) {
+        get_entity(&r, &snap->pacmans[i]);
+    }
+    for (int i = 0; i < snap->n_ghosts && !r.error; i++) {
+        get_entity(&r, &snap->ghosts[i]);
+    }
+    if (r.error || !entities_inside(snap, (int)width, (int)height)) {
+        return -1;
+    }
+    int n_words = (int)(((long long)width * height + 63) / 64);
+    if ((size_t)(r.end - r.p) != (size_t)n_words * 8) {
+        return -1;
+    }
+    if (snap->dots == NULL || n_words > snap->capacity) {
+        uint64_t *dots = realloc(snap->dots, (n_words > 0 ? n_words : 1) * sizeof(uint64_t));
+        if (dots == NULL) {
+            return -1;
+        }
+        snap->dots = dots;
+        snap->capacity = n_words;
+    }
+    for (int i = 0; i < n_words; i++) {
+        snap->dots[i] = get_u64(&r, 8);
+    }
+    snap->n_words = n_words;
+    snap->width = (int)width;
+    snap->height = (int)height;
+    // Not captured from a level of this server, a restore rewrites every chunk
+    snap->level_serial = 0;
+    snap->epoch = 0;
+    return 0;
+}
+
+// Helper private function that replaces path with an encoded image
+// @return 0, -1 on error
+static int write_image(const unsigned char *data, size_t len, const char *path) {
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "wb");
+    int written = fp != NULL && fwrite(data, 1, len, fp) == len;
+    if (fp != NULL && fclose(fp) != 0) {
+        written = 0;
+    }
+    // Readers of path only ever see a whole image
+    if (!written || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_save(const snapshot_t *snap, const char *path) {
+    unsigned char *data = malloc(snapshot_encoded_size(snap));
+    if (data == NULL) {
+        return -1;
+    }
+    size_t len = snapshot_encode(snap, data);
+    int saved = write_image(data, len, path);
+    free(data);
+    return saved;
+}
+
+int snapshot_load(snapshot_t *snap, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    unsigned char *data = NULL;
+    size_t len = 0;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        long size = ftell(fp);
+        data = size > 0 ? malloc((size_t)size) : NULL;
+        len = data != NULL ? (size_t)size : 0;
+    }
+    rewind(fp);
+    int read_whole = data != NULL && fread(data, 1, len, fp) == len;
+    fclose(fp);
+    int decoded = read_whole && snapshot_decode(snap, data, len) == 0;
+    free(data);
+    return decoded ? 0 : -1;
+}
+
+// Helper private function for the checkpoint file of a game slot
+static void checkpoint_path(char *path, size_t size, int game_id) {
+    snprintf(path, size, "%s/game%d.snap", checkpoint_dir, game_id);
+}
+
+// Helper private function that writes or removes the checkpoint of a job, without the lock
+static void run_checkpoint_job(checkpoint_job_t *job) {
+    char path[512];
+    checkpoint_path(path, sizeof(path), job->game_id);
+    if (job->data == NULL) {
+        remove(path);
+        return;
+    }
+    long long start = now_us();
+    if (write_image(job->data, job->len, path) < 0) {
+        debug("Error writing checkpoint %s\n", path);
+        return;
+    }
+    log_trace("Checkpoint of game %d written in %lld us\n", job->game_id, now_us() - start);
+}
+
+static void *checkpoint_writer_thread(void *arg) {
+    (void)arg;
+    // Signals are handled by the accept loop
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&checkpoint_lock);
+    while (1) {
+        while (checkpoint_jobs == NULL && !checkpoint_stopping) {
+            pthread_cond_wait(&checkpoint_cond, &checkpoint_lock);
+        }
+        checkpoint_job_t *job = checkpoint_jobs;
+        if (job == NULL) break;
+        checkpoint_jobs = job->next;
+        pthread_mutex_unlock(&checkpoint_lock);
+
+        // Files are written without the lock, the screen threads keep queueing meanwhile
+        run_checkpoint_job(job);
+        free(job->data);
+        free(job);
+
+        pthread_mutex_lock(&checkpoint_lock);
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+    return NULL;
+}
+
+// Helper private function that queues a job, replacing the one of the same game not written yet
+static void queue_checkpoint_job(checkpoint_job_t *job) {
+    pthread_mutex_lock(&checkpoint_lock);
+    checkpoint_job_t **link = &checkpoint_jobs;
+    while (*link != NULL && (*link)->game_id != job->game_id) {
+        link = &(*link)->next;
+    }
+    checkpoint_job_t *stale = *link;
+    if (stale != NULL) {
+        job->next = stale->next;
+    }
+    *link = job;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_lock);
+    if (stale != NULL) {
+        free(stale->data);
+        free(stale);
+    }
+}
+
+void checkpoint_init(void) {
+    checkpoint_dir = getenv("PACMAN_CHECKPOINT");
+    if (checkpoint_dir == NULL) {
+        return;
+    }
+    if (pthread_create(&checkpoint_writer, NULL, checkpoint_writer_thread, NULL) != 0) {
+        debug("Error starting the checkpoint writer, checkpoints are off\n");
+        checkpoint_dir = NULL;
+        return;
+    }
+    debug("Checkpointing sessions to %s\n", checkpoint_dir);
+}
+
+void checkpoint_session(board_t *board, snapshot_t *snap) {
+    if (checkpoint_dir == NULL || now_us() - snap->captured_us < CHECKPOINT_INTERVAL_MS * 1000LL) {
+        return;
+    }
+    // Only the capture and its encoding run in the tick, the writer thread does the file
+    checkpoint_job_t *job = calloc(1, sizeof(checkpoint_job_t));
+    if (job == NULL || snapshot_capture(board, snap) < 0 || (job->data = malloc(snapshot_encoded_size(snap))) == NULL) {
+        debug("Error capturing the checkpoint of game %d\n", board->game_id);
+        free(job);
+        return;
+    }
+    job->game_id = board->game_id;
+    job->len = snapshot_encode(snap, job->data);
+    queue_checkpoint_job(job);
+}
+
+int checkpoint_load(int game_id, snapshot_t *snap) {
+    if (checkpoint_dir == NULL) {
+        return -1;
+    }
+    char path[512];
+    checkpoint_path(path, sizeof(path), game_id);
+    if (snapshot_load(snap, path) < 0) {
+        if (access(path, F_OK) == 0) {
+            debug("Checkpoint %s is corrupted or does not fit its level, the session starts over\n", path);
+        }
+        snap->level_name[0] = '\0';
+        return -1;
+    }
+    debug("Checkpoint %s of level %s loaded\n", path, snap->level_name);
+    return 0;
+}
+
+void checkpoint_clear(int game_id) {
+    if (checkpoint_dir == NULL) {
+        return;
+    }
+    // Queued like a write, so a checkpoint not written yet does not bring the file back
+    checkpoint_job_t *job = calloc(1, sizeof(checkpoint_job_t));
+    if (job == NULL) {
+        debug("Error removing the checkpoint of game %d\n", game_id);
+        return;
+    }
+    job->game_id = game_id;
+    queue_checkpoint_job(job);
+}
+
+void checkpoint_shutdown(void) {
+    if (checkpoint_dir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&checkpoint_lock);
+    checkpoint_stopping = 1;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_lock);
+    pthread_join(checkpoint_writer, NULL);
+}
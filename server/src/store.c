@@ -0,0 +1,229 @@
+#include "store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+    char magic[4];
+    int version;
+    int max_games;
+    size_t region_size;         // with the dots of both snapshots
+    size_t header_size;         // sizeof(session_region_t) of the server that made the store
+} store_header_t;
+
+static unsigned char *store = NULL;
+static size_t store_size = 0;
+static size_t region_size = 0;
+static int store_games = 0;
+
+// Regions start on page boundaries, the header gets a page of its own
+static size_t page_round(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// Helper private function that tells why the store of the last server in fd can not be kept
+// by this one
+// @return NULL when it can, or when fd is a new, empty file
+static const char *store_mismatch(int fd, int max_games) {
+    struct stat st;
+    store_header_t header = {0};
+    if (fstat(fd, &st) < 0) {
+        return "it can not be read";
+    }
+    if (st.st_size == 0) {
+        return NULL;
+    }
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || memcmp(header.magic, STORE_MAGIC, 4) != 0) {
+        return "it is not a session store";
+    }
+    if (header.version != STORE_VERSION || header.header_size != sizeof(session_region_t)) {
+        return "it was written by another version of the server";
+    }
+    if (header.max_games != max_games) {
+        return "it was written for another number of games";
+    }
+    if (header.region_size != region_size) {
+        return "it was written for levels of another size";
+    }
+    if ((size_t)st.st_size != store_size) {
+        return "it is truncated";
+    }
+    return NULL;
+}
+
+int store_init(int max_games, level_info *levels, int n_levels) {
+    const char *path = getenv("PACMAN_SESSION_STORE");
+    if (path == NULL) {
+        return 0;
+    }
+    int max_words = 1;
+    for (int i = 0; i < n_levels; i++) {
+        int n_words = (levels[i].width * levels[i].height + 63) / 64;
+        if (n_words > max_words) max_words = n_words;
+    }
+    size_t header_size = page_round(sizeof(store_header_t));
+    region_size = page_round(sizeof(session_region_t) + 2 * (size_t)max_words * sizeof(uint64_t));
+    store_size = header_size + (size_t)max_games * region_size;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        debug("Error opening session store %s\n", path);
+        return -1;
+    }
+    // The sessions of a store this server can not resume are moved aside, not wiped
+    const char *mismatch = store_mismatch(fd, max_games);
+    if (mismatch != NULL) {
+        char old_path[512];
+        snprintf(old_path, sizeof(old_path), "%s.old", path);
+        close(fd);
+        if (rename(path, old_path) < 0) {
+            fprintf(stderr, "Session store %s can not be used, %s, and could not be moved to %s\n", path, mismatch, old_path);
+            return -1;
+        }
+        fprintf(stderr, "Session store %s can not be used, %s: moved to %s, its sessions are not resumed\n", path, mismatch, old_path);
+        debug("Session store %s moved to %s, %s\n", path, old_path, mismatch);
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            debug("Error creating session store %s\n", path);
+            return -1;
+        }
+    }
+    struct stat st;
+    int keep = fstat(fd, &st) == 0 && st.st_size > 0;
+    store_header_t header = {0};
+    // A new store is zeroed by its sizing
+    if (!keep && ftruncate(fd, (off_t)store_size) < 0) {
+        debug("Error sizing session store %s\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, store_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        debug("Error mapping session store %s\n", path);
+        return -1;
+    }
+    store = map;
+    store_games = max_games;
+    if (!keep) {
+        memcpy(header.magic, STORE_MAGIC, 4);
+        header.version = STORE_VERSION;
+        header.max_games = max_games;
+        header.region_size = region_size;
+        header.header_size = sizeof(session_region_t);
+        memcpy(store, &header, sizeof(header));
+    }
+
+    // Pointers into the mapping are only good for this process, and a snapshot of the last
+    // server was captured from none of the levels this one loads
+    for (int g = 1; g <= max_games; g++) {
+        session_region_t *region = store_region(g);
+        uint64_t *dots = (uint64_t *)(region + 1);
+        for (int k = 0; k < 2; k++) {
+            region->images[k].dots = dots + (size_t)k * max_words;
+            region->images[k].capacity = max_words;
+            region->images[k].level_serial = 0;
+        }
+        if (!region->active) {
+            region->committed = -1;
+        }
+    }
+    debug("Session store %s %s, %d games of %zu bytes\n", path, keep ? "reopened" : "created", max_games, region_size);
+    return 0;
+}
+
+session_region_t *store_region(int game_id) {
+    if (store == NULL || game_id < 1 || game_id > store_games) {
+        return NULL;
+    }
+    return (session_region_t *)(store + page_round(sizeof(store_header_t)) + (size_t)(game_id - 1) * region_size);
+}
+
+int store_resumable(session_region_t *region) {
+    return region != NULL && region->active && region->committed >= 0;
+}
+
+const snapshot_t *store_snapshot(session_region_t *region) {
+    return &region->images[region->committed];
+}
+
+void store_session_start(session_region_t *region, uint64_t seed) {
+    if (region == NULL) {
+        return;
+    }
+    memset(region->players, 0, sizeof(region->players));
+    region->seed = seed;
+    region->tick = 0;
+    region->committed = -1;
+    for (int k = 0; k < 2; k++) {
+        region->images[k].level_serial = 0;
+    }
+    __atomic_store_n(&region->active, 1, __ATOMIC_RELEASE);
+}
+
+void store_session_end(session_region_t *region) {
+    if (region == NULL) {
+        return;
+    }
+    __atomic_store_n(&region->active, 0, __ATOMIC_RELEASE);
+    region->committed = -1;
+}
+
+void store_player(session_region_t *region, int index, const char *req_pipe, const char *notif_pipe) {
+    if (region == NULL) {
+        return;
+    }
+    stored_player_t *player = &region->players[index];
+    memset(player, 0, sizeof(stored_player_t));
+    strncpy(player->req_pipe, req_pipe, MAX_PIPE_PATH_LENGTH - 1);
+    strncpy(player->notif_pipe, notif_pipe, MAX_PIPE_PATH_LENGTH - 1);
+    player->connected = 1;
+}
+
+void store_player_gone(session_region_t *region, int index) {
+    if (region != NULL) {
+        region->players[index].connected = 0;
+    }
+}
+
+void store_player_view(session_region_t *region, int index, int view_width, int view_height) {
+    if (region != NULL) {
+        region->players[index].view_width = view_width;
+        region->players[index].view_height = view_height;
+    }
+}
+
+void store_player_points(session_region_t *region, int index, int points) {
+    if (region != NULL) {
+        region->players[index].points = points;
+    }
+}
+
+void store_tick(session_region_t *region, board_t *board, int tick) {
+    if (region == NULL) {
+        return;
+    }
+    // The entities are copied under the board's snapshot_lock, not on every tick
+    int new_level = region->committed < 0 || region->images[region->committed].level_serial != board->level_serial;
+    if (!new_level && tick - region->tick < STORE_CAPTURE_TICKS) {
+        return;
+    }
+    int next = region->committed == 0 ? 1 : 0;
+    if (snapshot_capture(board, &region->images[next]) < 0) {
+        debug("Error capturing game %d into the session store\n", board->game_id);
+        return;
+    }
+    region->tick = tick;
+    __atomic_store_n(&region->committed, next, __ATOMIC_RELEASE);
+}
+
+void store_sync(void) {
+    if (store != NULL && msync(store, store_size, MS_SYNC) < 0) {
+        debug("Error writing the session store back\n");
+    }
+}
@@ -0,0 +1,193 @@
+#include "trace.h"
+#include "board.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct {
+    const char *name;   // string literal given to TRACE_END
+    long long start_us; // relative to the start of the trace
+    long long dur_us;
+} trace_event_t;
+
+typedef struct trace_chunk {
+    trace_event_t events[TRACE_CHUNK_EVENTS];
+    int count;                  // published with release, read by trace_export
+    struct trace_chunk *next;
+} trace_chunk_t;
+
+// Spans of a lane, kept after its thread exits until they are exported; the thread that takes
+// the same role in the next level appends to it
+typedef struct trace_buffer {
+    char name[32];
+    int tid;
+    int game_id;
+    int in_use;         // a live thread appends to it, under buffers_lock
+    int n_events;
+    int dropped;
+    trace_chunk_t *first;
+    trace_chunk_t *last;
+    struct trace_buffer *next;
+} trace_buffer_t;
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *buffers = NULL;
+static int next_tid = 1;
+static _Thread_local trace_buffer_t *local_buffer = NULL;
+static pthread_key_t exit_key;          // hands the buffer of an exiting thread back
+
+static long long trace_start_us = 0;
+static int session_filter = 0;          // 0 traces every game
+static long long window_from_us = 0;
+static long long window_to_us = -1;     // -1 for no end
+
+// Destructor of exit_key, the buffer of a thread that exits can be taken by the next one
+static void release_buffer(void *buffer) {
+    pthread_mutex_lock(&buffers_lock);
+    ((trace_buffer_t *)buffer)->in_use = 0;
+    pthread_mutex_unlock(&buffers_lock);
+}
+
+void trace_init(void) {
+    trace_start_us = now_us();
+    pthread_key_create(&exit_key, release_buffer);
+    const char *session = getenv("PACMAN_TRACE_SESSION");
+    if (session != NULL) {
+        session_filter = atoi(session);
+    }
+    const char *window = getenv("PACMAN_TRACE_WINDOW");
+    if (window != NULL) {
+        double from = 0, to = -1;
+        if (sscanf(window, "%lf:%lf", &from, &to) >= 1) {
+            window_from_us = (long long)(from * 1000000);
+            window_to_us = to >= 0 ? (long long)(to * 1000000) : -1;
+        }
+    }
+    debug("Tracing game %d from %lld us to %lld us\n", session_filter, window_from_us, window_to_us);
+}
+
+void trace_thread(const char *role, int index, int game_id) {
+    if (local_buffer != NULL) {
+        release_buffer(local_buffer);
+    }
+    local_buffer = NULL;
+    pthread_setspecific(exit_key, NULL);
+    if (session_filter != 0 && game_id != session_filter) {
+        return;
+    }
+    char name[32];
+    if (index >= 0) {
+        snprintf(name, sizeof(name), "%s %d", role, index);
+    } else {
+        snprintf(name, sizeof(name), "%s", role);
+    }
+
+    pthread_mutex_lock(&buffers_lock);
+    // Threads are recreated every level, the same role keeps the same lane and its buffer
+    trace_buffer_t *buffer = NULL;
+    int tid = 0;
+    for (trace_buffer_t *other = buffers; other != NULL; other = other->next) {
+        if (other->game_id == game_id && strcmp(other->name, name) == 0) {
+            tid = other->tid;
+            if (!other->in_use) {
+                buffer = other;
+                break;
+            }
+        }
+    }
+    if (buffer == NULL) {
+        buffer = calloc(1, sizeof(trace_buffer_t));
+        if (buffer == NULL) {
+            pthread_mutex_unlock(&buffers_lock);
+            return;
+        }
+        strcpy(buffer->name, name);
+        buffer->game_id = game_id;
+        buffer->tid = tid != 0 ? tid : next_tid++;
+        buffer->next = buffers;
+        buffers = buffer;
+    }
+    buffer->in_use = 1;
+    pthread_mutex_unlock(&buffers_lock);
+    local_buffer = buffer;
+    pthread_setspecific(exit_key, buffer);
+}
+
+long long trace_begin(void) {
+    return local_buffer != NULL ? now_us() : 0;
+}
+
+void trace_span(const char *name, long long start_us) {
+    trace_buffer_t *buffer = local_buffer;
+    if (buffer == NULL) {
+        return;
+    }
+    long long end_us = now_us() - trace_start_us;
+    start_us -= trace_start_us;
+    if (start_us < window_from_us || (window_to_us >= 0 && end_us > window_to_us)) {
+        return;
+    }
+    if (buffer->n_events >= TRACE_MAX_THREAD_EVENTS) {
+        buffer->dropped++;
+        return;
+    }
+
+    trace_chunk_t *chunk = buffer->last;
+    if (chunk == NULL || chunk->count == TRACE_CHUNK_EVENTS) {
+        trace_chunk_t *fresh = malloc(sizeof(trace_chunk_t));
+        if (fresh == NULL) {
+            buffer->dropped++;
+            return;
+        }
+        fresh->count = 0;
+        fresh->next = NULL;
+        // Linked only once initialized, trace_export may be walking the list
+        if (chunk == NULL) {
+            __atomic_store_n(&buffer->first, fresh, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&chunk->next, fresh, __ATOMIC_RELEASE);
+        }
+        buffer->last = fresh;
+        chunk = fresh;
+    }
+    chunk->events[chunk->count] = (trace_event_t){name, start_us, end_us - start_us};
+    __atomic_store_n(&chunk->count, chunk->count + 1, __ATOMIC_RELEASE);
+    buffer->n_events++;
+}
+
+void trace_export(void) {
+    FILE *fp = fopen(TRACE_FILE, "w");
+    if (fp == NULL) {
+        debug("Error opening %s\n", TRACE_FILE);
+        return;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&buffers_lock);
+    int first_event = 1;
+    for (trace_buffer_t *buffer = buffers; buffer != NULL; buffer = buffer->next) {
+        fprintf(fp, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"game %d\"}},\n"
+                    "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first_event ? "" : ",\n", buffer->game_id, buffer->game_id,
+                buffer->game_id, buffer->tid, buffer->name);
+        first_event = 0;
+
+        trace_chunk_t *chunk = __atomic_load_n(&buffer->first, __ATOMIC_ACQUIRE);
+        for (; chunk != NULL; chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+            int count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+            for (int i = 0; i < count; i++) {
+                trace_event_t *event = &chunk->events[i];
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d}",
+                        event->name, event->start_us, event->dur_us, buffer->game_id, buffer->tid);
+            }
+        }
+        if (buffer->dropped > 0) {
+            debug("Trace of %s in game %d dropped %d spans\n", buffer->name, buffer->game_id, buffer->dropped);
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}